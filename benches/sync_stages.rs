@@ -0,0 +1,236 @@
+// Benchmarks of the sync stages on a fixed range of blocks
+//
+// The compact blocks are downloaded once into benches/fixtures and read from there
+// afterwards, so the results only depend on the code. Set BENCH_LWD_URL, BENCH_START_HEIGHT
+// and BENCH_BLOCK_COUNT to record another range, BENCH_FVK to decrypt with a real key.
+//
+// Compare two commits with
+//   cargo bench --bench sync_stages -- --save-baseline base
+//   cargo bench --bench sync_stages -- --baseline base
+
+use criterion::{black_box, criterion_group, criterion_main, Criterion};
+use prost::Message;
+use std::collections::HashMap;
+use std::fs::File;
+use std::io::{Read, Write};
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+use tokio::runtime::Runtime;
+use tokio::sync::mpsc;
+use warp_api_ffi::{
+    advance_tree, connect_lightwalletd, download_chain, AccountViewKey, CTree, CheckpointPolicy,
+    CompactBlock, DbAdapter, DecryptNode, Nf, NfIndex, NfRef, Witness,
+};
+use zcash_client_backend::encoding::decode_extended_full_viewing_key;
+use zcash_params::coin::CoinType;
+use zcash_primitives::consensus::{Network, Parameters};
+use zcash_primitives::sapling::Node;
+use zcash_primitives::zip32::{ExtendedFullViewingKey, ExtendedSpendingKey};
+
+const START_HEIGHT: u32 = 1_700_000;
+const BLOCK_COUNT: u32 = 1_000;
+const WITNESS_SPACING: usize = 100;
+const NF_INDEX_SIZE: usize = 10_000;
+
+static CANCEL: AtomicBool = AtomicBool::new(false);
+
+fn env_u32(name: &str, default: u32) -> u32 {
+    std::env::var(name)
+        .ok()
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(default)
+}
+
+/// Encoded compact blocks of the fixture, recorded from the server on first use
+fn load_fixture() -> Vec<Vec<u8>> {
+    let start_height = env_u32("BENCH_START_HEIGHT", START_HEIGHT);
+    let count = env_u32("BENCH_BLOCK_COUNT", BLOCK_COUNT);
+    let path: PathBuf = [
+        env!("CARGO_MANIFEST_DIR"),
+        "benches",
+        "fixtures",
+        &format!("blocks-{}-{}.bin", start_height, count),
+    ]
+    .iter()
+    .collect();
+    if !path.exists() {
+        record_fixture(&path, start_height, count);
+    }
+
+    let mut data = vec![];
+    File::open(&path).unwrap().read_to_end(&mut data).unwrap();
+    let mut buf = &data[..];
+    let mut blocks = vec![];
+    while !buf.is_empty() {
+        let len = prost::decode_length_delimiter(&mut buf).unwrap();
+        blocks.push(buf[..len].to_vec());
+        buf = &buf[len..];
+    }
+    blocks
+}
+
+fn record_fixture(path: &PathBuf, start_height: u32, count: u32) {
+    let url = std::env::var("BENCH_LWD_URL").unwrap_or_else(|_| warp_api_ffi::LWD_URL.to_string());
+    println!("Recording blocks {}+{} from {}", start_height, count, url);
+    let r = Runtime::new().unwrap();
+    let blocks = r.block_on(async {
+        let mut client = connect_lightwalletd(&url).await.unwrap();
+        let (blocks_tx, mut blocks_rx) = mpsc::channel(1);
+        let downloader = tokio::spawn(async move {
+            download_chain(
+                &mut client,
+                start_height,
+                start_height + count,
+                None,
+                &[],
+                &CheckpointPolicy::default(),
+                blocks_tx,
+                &CANCEL,
+            )
+            .await
+        });
+        let mut blocks: Vec<CompactBlock> = vec![];
+        while let Some(chunk) = blocks_rx.recv().await {
+            blocks.extend(chunk.0);
+        }
+        downloader.await.unwrap().unwrap();
+        blocks
+    });
+
+    std::fs::create_dir_all(path.parent().unwrap()).unwrap();
+    let mut file = File::create(path).unwrap();
+    for block in blocks.iter() {
+        file.write_all(&block.encode_length_delimited_to_vec())
+            .unwrap();
+    }
+}
+
+fn view_keys(count: u32) -> HashMap<u32, AccountViewKey> {
+    let mut vks = HashMap::new();
+    if let Ok(fvk) = std::env::var("BENCH_FVK") {
+        let fvk = decode_extended_full_viewing_key(
+            Network::MainNetwork.hrp_sapling_extended_full_viewing_key(),
+            &fvk,
+        )
+        .unwrap()
+        .unwrap();
+        vks.insert(0, AccountViewKey::from_fvk(&fvk));
+    }
+    for i in vks.len() as u32..count {
+        let sk = ExtendedSpendingKey::master(&[i as u8; 32]);
+        let fvk = ExtendedFullViewingKey::from(&sk);
+        vks.insert(i, AccountViewKey::from_fvk(&fvk));
+    }
+    vks
+}
+
+fn decode_blocks(data: &[Vec<u8>]) -> Vec<CompactBlock> {
+    data.iter()
+        .map(|b| CompactBlock::decode(&b[..]).unwrap())
+        .collect()
+}
+
+fn commitments(blocks: &[CompactBlock]) -> Vec<Node> {
+    let mut nodes = vec![];
+    for cb in blocks.iter() {
+        for tx in cb.vtx.iter() {
+            for co in tx.outputs.iter() {
+                let mut cmu = [0u8; 32];
+                cmu.copy_from_slice(&co.cmu);
+                nodes.push(Node::new(cmu));
+            }
+        }
+    }
+    nodes
+}
+
+/// Witnesses of every WITNESS_SPACING-th output, as if they were our notes
+fn new_witnesses(count: usize) -> Vec<Witness> {
+    (0..count)
+        .step_by(WITNESS_SPACING)
+        .map(|p| Witness::new(p, p as u32, None))
+        .collect()
+}
+
+fn sync_stages(c: &mut Criterion) {
+    let _ = env_logger::try_init();
+    let data = load_fixture();
+    let blocks = decode_blocks(&data);
+    let nodes = commitments(&blocks);
+    let network = Network::MainNetwork;
+
+    let mut group = c.benchmark_group("scan");
+    group.sample_size(10);
+
+    group.bench_function("decode", |b| b.iter(|| decode_blocks(black_box(&data))));
+
+    for &accounts in [1u32, 10].iter() {
+        let decrypter = DecryptNode::new(view_keys(accounts));
+        group.bench_function(format!("decrypt/{}", accounts), |b| {
+            b.iter(|| decrypter.decrypt_blocks(&network, black_box(&blocks)).len())
+        });
+    }
+
+    let mut nf_index = NfIndex::default();
+    for i in 0..NF_INDEX_SIZE {
+        let mut nf = [0u8; 32];
+        nf[..8].copy_from_slice(&(i as u64).to_le_bytes());
+        nf[31] = 0xFF;
+        nf_index.insert(
+            Nf(nf),
+            NfRef {
+                id_note: i as u32,
+                account: 0,
+                value: 0,
+            },
+        );
+    }
+    group.bench_function("nullifiers", |b| {
+        b.iter(|| {
+            let mut found = 0;
+            for cb in blocks.iter() {
+                for tx in cb.vtx.iter() {
+                    for cs in tx.spends.iter() {
+                        if nf_index.get_slice(&cs.nf).is_some() {
+                            found += 1;
+                        }
+                    }
+                }
+            }
+            found
+        })
+    });
+
+    let witnesses = new_witnesses(nodes.len());
+    group.bench_function("tree", |b| {
+        b.iter(|| {
+            let mut nodes = nodes.clone();
+            let (tree, ws) = advance_tree(&CTree::new(), &witnesses, &mut nodes, true);
+            advance_tree(&tree, &ws, &mut [], false)
+        })
+    });
+
+    let (tree, ws) = advance_tree(&CTree::new(), &witnesses, &mut nodes.clone(), true);
+    let (tree, ws) = advance_tree(&tree, &ws, &mut [], false);
+    let db_path = std::env::temp_dir().join("warp-bench.db");
+    let _ = std::fs::remove_file(&db_path);
+    let mut db = DbAdapter::new(CoinType::Zcash, db_path.to_str().unwrap()).unwrap();
+    db.init_db().unwrap();
+    let height = AtomicU32::new(0);
+    group.bench_function("db_commit", |b| {
+        b.iter(|| {
+            let height = height.fetch_add(1, Ordering::Relaxed);
+            let db_tx = db.begin_transaction().unwrap();
+            for w in ws.iter() {
+                DbAdapter::store_witnesses(&db_tx, w, height, w.id_note).unwrap();
+            }
+            DbAdapter::store_block(&db_tx, height, &[0u8; 32], 0, &tree).unwrap();
+            db_tx.commit().unwrap();
+        })
+    });
+
+    group.finish();
+}
+
+criterion_group!(benches, sync_stages);
+criterion_main!(benches);
@@ -27,12 +27,16 @@ char *get_error_msg(void);
 
 void init_wallet(char *db_path);
 
+void init_prover(char *cache_path, bool prewarm);
+
 void set_active(uint8_t active);
 
 void set_active_account(uint8_t coin, uint32_t id);
 
 void set_coin_lwd_url(uint8_t coin, char *lwd_url);
 
+void set_recent_first_blocks(uint8_t coin, uint32_t blocks);
+
 char *get_lwd_url(uint8_t coin);
 
 void reset_app(void);
@@ -41,20 +45,42 @@ uint32_t new_account(uint8_t coin, char *name, char *data, int32_t index);
 
 void new_sub_account(char *name, int32_t index, uint32_t count);
 
+void set_birth_height(uint8_t coin, uint32_t id_account, uint32_t height);
+
 void import_transparent_key(uint8_t coin, uint32_t id_account, char *path);
 
 void import_transparent_secret_key(uint8_t coin, uint32_t id_account, char *secret_key);
 
 void cancel_warp(void);
 
+void cancel_sync(uint8_t coin);
+
+bool is_syncing(uint8_t coin);
+
+uint32_t get_sync_progress(uint8_t coin);
+
+char *get_sync_metrics(uint8_t coin);
+
 uint8_t warp(uint8_t coin, bool get_tx, uint32_t anchor_offset, int64_t port);
 
+uint8_t warp_with_progress(uint8_t coin, bool get_tx, uint32_t anchor_offset, int64_t port);
+
 int8_t is_valid_key(uint8_t coin, char *key);
 
 bool valid_address(uint8_t coin, char *address);
 
 char *new_diversified_address(void);
 
+char *new_diversified_addresses(uint32_t count);
+
+void register_invoice(char *invoice, char *address);
+
+char *new_invoice_address(char *invoice);
+
+char *get_invoice_payments(char *invoice);
+
+void pregenerate_addresses(uint32_t count);
+
 uint32_t get_latest_height(void);
 
 char *send_multi_payment(char *recipients_json,
@@ -68,10 +94,29 @@ void rewind_to_height(uint32_t height);
 
 int64_t mempool_sync(void);
 
+void start_mempool_monitor(uint8_t coin, int64_t port);
+
+void stop_mempool_monitor(void);
+
+void start_consolidation(uint8_t coin,
+                         uint64_t dust_threshold,
+                         uint32_t max_inputs,
+                         uint32_t interval_secs,
+                         int64_t port);
+
+void stop_consolidation(void);
+
+char *plan_consolidation(uint8_t coin,
+                         uint32_t account,
+                         uint64_t dust_threshold,
+                         uint32_t max_inputs);
+
 void mempool_reset(void);
 
 int64_t get_mempool_balance(void);
 
+int64_t get_mempool_account_balance(uint32_t account);
+
 uint64_t get_taddr_balance(uint8_t coin, uint32_t id_account);
 
 char *shield_taddr(void);
@@ -80,6 +125,10 @@ void scan_transparent_accounts(uint32_t gap_limit);
 
 char *prepare_multi_payment(char *recipients_json, bool use_transparent, uint32_t anchor_offset);
 
+char *prepare_multi_payment_binary(char *recipients_json,
+                                   bool use_transparent,
+                                   uint32_t anchor_offset);
+
 char *sign(char *tx, int64_t port);
 
 char *broadcast_tx(char *tx_str);
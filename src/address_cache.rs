@@ -0,0 +1,265 @@
+use crate::db::DbAdapter;
+use group::GroupEncoding;
+use rayon::prelude::*;
+use std::collections::HashMap;
+use zcash_primitives::sapling::{Diversifier, Note, PaymentAddress, Rseed, SaplingIvk};
+use zcash_primitives::zip32::{DiversifierIndex, ExtendedFullViewingKey};
+
+const SEARCH_RANGE: u64 = 64;
+
+/// Payment address of a diversifier with the base point of its notes
+#[derive(Clone)]
+pub struct DiversifiedAddress {
+    /// None if the address was not generated from the account diversifier key
+    pub diversifier_index: Option<u64>,
+    pub pa: PaymentAddress,
+    pub g_d: jubjub::SubgroupPoint,
+}
+
+impl DiversifiedAddress {
+    /// Hash the diversifier to the curve, once for both the address and the notes
+    pub fn derive(ivk: &SaplingIvk, diversifier: Diversifier) -> Option<Self> {
+        let g_d = diversifier.g_d()?;
+        let pk_d = g_d * ivk.0;
+        let pa = PaymentAddress::from_parts(diversifier, pk_d)?;
+        Some(DiversifiedAddress {
+            diversifier_index: None,
+            pa,
+            g_d,
+        })
+    }
+
+    /// Rebuild an address saved by the database
+    ///
+    /// The points were checked when the address was derived
+    pub fn from_parts_unchecked(
+        diversifier_index: Option<u64>,
+        diversifier: &[u8],
+        g_d: &[u8],
+        pk_d: &[u8],
+    ) -> Option<Self> {
+        let mut d = [0u8; 11];
+        d.copy_from_slice(diversifier);
+        let g_d: Option<_> = jubjub::SubgroupPoint::from_bytes_unchecked(&to_array(g_d)).into();
+        let pk_d: Option<_> = jubjub::SubgroupPoint::from_bytes_unchecked(&to_array(pk_d)).into();
+        let pa = PaymentAddress::from_parts(Diversifier(d), pk_d?)?;
+        Some(DiversifiedAddress {
+            diversifier_index,
+            pa,
+            g_d: g_d?,
+        })
+    }
+
+    /// Same as `PaymentAddress::create_note` without hashing the diversifier again
+    pub fn create_note(&self, value: u64, rseed: Rseed) -> Note {
+        Note {
+            value,
+            g_d: self.g_d,
+            pk_d: *self.pa.pk_d(),
+            rseed,
+        }
+    }
+}
+
+/// Payment addresses of the diversifiers used by the accounts
+///
+/// Loaded from the database on first use. Addresses that are not there yet
+/// are derived and saved so that a diversifier is only hashed to the curve once
+#[derive(Default)]
+pub struct AddressCache {
+    loaded: bool,
+    addresses: HashMap<(u32, [u8; 11]), DiversifiedAddress>,
+}
+
+impl AddressCache {
+    pub fn load(&mut self, db: &DbAdapter) -> anyhow::Result<()> {
+        if !self.loaded {
+            for (account, address) in db.get_diversified_addresses()? {
+                self.addresses
+                    .insert((account, address.pa.diversifier().0), address);
+            }
+            self.loaded = true;
+        }
+        Ok(())
+    }
+
+    pub fn get(
+        &mut self,
+        db: &DbAdapter,
+        account: u32,
+        ivk: &SaplingIvk,
+        diversifier: Diversifier,
+    ) -> anyhow::Result<Option<DiversifiedAddress>> {
+        self.load(db)?;
+        if let Some(address) = self.addresses.get(&(account, diversifier.0)) {
+            return Ok(Some(address.clone()));
+        }
+        let address = match DiversifiedAddress::derive(ivk, diversifier) {
+            Some(address) => address,
+            None => return Ok(None),
+        };
+        db.store_diversified_addresses(account, std::slice::from_ref(&address))?;
+        self.addresses
+            .insert((account, diversifier.0), address.clone());
+        Ok(Some(address))
+    }
+
+    pub fn insert(&mut self, account: u32, addresses: &[DiversifiedAddress]) {
+        if self.loaded {
+            for address in addresses.iter() {
+                self.addresses
+                    .insert((account, address.pa.diversifier().0), address.clone());
+            }
+        }
+    }
+
+    pub fn invalidate(&mut self) {
+        self.loaded = false;
+        self.addresses.clear();
+    }
+}
+
+/// Find the next `count` valid diversifiers from `start` and derive their addresses
+///
+/// About half of the diversifier indices are valid. The indices are split into
+/// ranges that are searched in parallel
+pub fn generate_addresses(
+    fvk: &ExtendedFullViewingKey,
+    start: u64,
+    count: usize,
+) -> Vec<DiversifiedAddress> {
+    let max_ranges = rayon::current_num_threads() as u64 * 4;
+    let mut addresses: Vec<DiversifiedAddress> = vec![];
+    let mut next = start;
+    while addresses.len() < count {
+        let missing = (count - addresses.len()) as u64;
+        let ranges = (missing * 2 / SEARCH_RANGE + 1).min(max_ranges);
+        let found: Vec<Vec<DiversifiedAddress>> = (0..ranges)
+            .into_par_iter()
+            .map(|r| search_range(fvk, next + r * SEARCH_RANGE, missing as usize))
+            .collect();
+        addresses.extend(found.into_iter().flatten());
+        next += ranges * SEARCH_RANGE;
+    }
+    addresses.truncate(count);
+    addresses
+}
+
+/// Addresses of the valid diversifiers in `[start, start + SEARCH_RANGE)`, up to `limit`
+fn search_range(fvk: &ExtendedFullViewingKey, start: u64, limit: usize) -> Vec<DiversifiedAddress> {
+    let end = start + SEARCH_RANGE;
+    let mut addresses = vec![];
+    let mut j = start;
+    while addresses.len() < limit {
+        let (index, pa) = match fvk.find_address(to_diversifier_index(j)) {
+            Some(found) => found,
+            None => break,
+        };
+        let index = from_diversifier_index(&index);
+        if index >= end {
+            break;
+        }
+        if let Some(g_d) = pa.g_d() {
+            addresses.push(DiversifiedAddress {
+                diversifier_index: Some(index),
+                pa,
+                g_d,
+            });
+        }
+        j = index + 1;
+    }
+    addresses
+}
+
+pub fn to_diversifier_index(index: u64) -> DiversifierIndex {
+    let mut di = [0u8; 11];
+    di[..8].copy_from_slice(&index.to_le_bytes());
+    DiversifierIndex(di)
+}
+
+pub fn from_diversifier_index(index: &DiversifierIndex) -> u64 {
+    let mut di = [0u8; 8];
+    di.copy_from_slice(&index.0[..8]);
+    u64::from_le_bytes(di)
+}
+
+fn to_array(bytes: &[u8]) -> [u8; 32] {
+    let mut a = [0u8; 32];
+    a.copy_from_slice(bytes);
+    a
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chain_gen::ChainGenerator;
+
+    /// The valid diversifiers from `start`, one at a time
+    fn find_addresses(fvk: &ExtendedFullViewingKey, start: u64, count: usize) -> Vec<u64> {
+        let mut indices = vec![];
+        let mut j = start;
+        while indices.len() < count {
+            let (index, _) = fvk.find_address(to_diversifier_index(j)).unwrap();
+            let index = from_diversifier_index(&index);
+            indices.push(index);
+            j = index + 1;
+        }
+        indices
+    }
+
+    #[test]
+    fn test_generate_addresses() {
+        let fvk = &ChainGenerator::test_fvks(1)[0];
+        let start = 10;
+        let count = SEARCH_RANGE as usize * 3;
+        let addresses = generate_addresses(fvk, start, count);
+        assert_eq!(addresses.len(), count);
+        let indices: Vec<_> = addresses
+            .iter()
+            .map(|a| a.diversifier_index.unwrap())
+            .collect();
+        // spans several ranges, in order and without gaps or duplicates
+        assert!(indices[count - 1] >= start + 2 * SEARCH_RANGE);
+        assert!(indices.windows(2).all(|w| w[0] < w[1]));
+        assert_eq!(indices, find_addresses(fvk, start, count));
+        for a in addresses.iter() {
+            let (_, pa) = fvk
+                .find_address(to_diversifier_index(a.diversifier_index.unwrap()))
+                .unwrap();
+            assert!(a.pa == pa);
+            assert!(a.g_d == pa.g_d().unwrap());
+        }
+
+        // continuing from the last index gives the same addresses
+        let first = generate_addresses(fvk, start, 5);
+        let next = first.last().unwrap().diversifier_index.unwrap() + 1;
+        let rest = generate_addresses(fvk, next, count - 5);
+        let continued: Vec<_> = first
+            .iter()
+            .chain(rest.iter())
+            .map(|a| a.diversifier_index.unwrap())
+            .collect();
+        assert_eq!(continued, indices);
+    }
+
+    #[test]
+    fn test_search_range() {
+        let fvk = &ChainGenerator::test_fvks(1)[0];
+        let start = SEARCH_RANGE;
+        let all = search_range(fvk, start, usize::MAX);
+        assert!(!all.is_empty());
+        let indices: Vec<_> = all.iter().map(|a| a.diversifier_index.unwrap()).collect();
+        assert!(indices.windows(2).all(|w| w[0] < w[1]));
+        assert!(indices
+            .iter()
+            .all(|&i| i >= start && i < start + SEARCH_RANGE));
+        assert_eq!(indices, find_addresses(fvk, start, indices.len()));
+
+        let limited = search_range(fvk, start, 3);
+        assert_eq!(limited.len(), 3.min(all.len()));
+        assert!(limited
+            .iter()
+            .zip(all.iter())
+            .all(|(a, b)| a.diversifier_index == b.diversifier_index));
+    }
+}
@@ -1,7 +1,9 @@
 pub mod account;
+pub mod consolidation;
 pub mod contact;
 pub mod fullbackup;
 pub mod historical_prices;
+pub mod invoice;
 pub mod mempool;
 pub mod message;
 pub mod payment;
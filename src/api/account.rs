@@ -1,15 +1,26 @@
 // Account creation
 
+use crate::address_cache::{generate_addresses, to_diversifier_index};
 use crate::coinconfig::CoinConfig;
 use crate::key2::decode_key;
 use crate::taddr::{derive_taddr, derive_tkeys};
 use anyhow::anyhow;
 use bip39::{Language, Mnemonic};
+use lazy_static::lazy_static;
 use rand::rngs::OsRng;
 use rand::RngCore;
+use std::sync::Mutex;
 use zcash_client_backend::encoding::{decode_extended_full_viewing_key, encode_payment_address};
 use zcash_primitives::consensus::Parameters;
 
+lazy_static! {
+    // new addresses must not be handed out twice
+    static ref ADDRESS_ISSUER: Mutex<()> = Mutex::new(());
+}
+
+/// Most addresses derived in one call, the search runs under `ADDRESS_ISSUER`
+pub const MAX_ADDRESS_COUNT: u32 = 1_000;
+
 pub fn new_account(
     coin: u8,
     name: &str,
@@ -51,9 +62,21 @@ fn new_account_with_key(coin: u8, name: &str, key: &str, index: u32) -> anyhow::
     if !exists {
         db.create_taddr(account)?;
     }
+    drop(db);
+    c.mempool().invalidate_keys();
     Ok(account)
 }
 
+/// Height of the first block that can have notes of the account
+///
+/// When every account has one, the first sync of the database starts there
+pub fn set_birth_height(coin: u8, id_account: u32, height: u32) -> anyhow::Result<()> {
+    let c = CoinConfig::get(coin);
+    let db = c.db()?;
+    db.store_birth_height(id_account, height)?;
+    Ok(())
+}
+
 pub fn import_transparent_key(coin: u8, id_account: u32, path: &str) -> anyhow::Result<()> {
     let c = CoinConfig::get(coin);
     let db = c.db()?;
@@ -73,22 +96,91 @@ pub fn import_transparent_secret_key(coin: u8, id_account: u32, sk: &str) -> any
 }
 
 pub fn new_diversified_address() -> anyhow::Result<String> {
+    let mut addresses = new_diversified_addresses(1)?;
+    addresses
+        .pop()
+        .ok_or_else(|| anyhow!("Cannot generate new address"))
+}
+
+/// Hand out `count` new diversified addresses of the active account
+///
+/// The addresses generated in advance are used first and the others
+/// are derived in parallel. The last diversifier index is saved once
+pub fn new_diversified_addresses(count: u32) -> anyhow::Result<Vec<String>> {
+    check_address_count(count)?;
+    let _issuer = ADDRESS_ISSUER.lock().unwrap();
     let c = CoinConfig::get_active();
-    let db = c.db()?;
-    let ivk = db.get_ivk(c.id_account)?;
-    let fvk = decode_extended_full_viewing_key(
-        c.chain.network().hrp_sapling_extended_full_viewing_key(),
-        &ivk,
-    )?
-    .unwrap();
-    let mut diversifier_index = db.get_diversifier(c.id_account)?;
-    diversifier_index.increment().unwrap();
-    let (new_diversifier_index, pa) = fvk
-        .find_address(diversifier_index)
-        .ok_or_else(|| anyhow::anyhow!("Cannot generate new address"))?;
-    db.store_diversifier(c.id_account, &new_diversifier_index)?;
-    let pa = encode_payment_address(c.chain.network().hrp_sapling_payment_address(), &pa);
-    Ok(pa)
+    let network = c.chain.network();
+    let (fvk, mut addresses, next) = {
+        let db = c.db()?;
+        let ivk = db.get_ivk(c.id_account)?;
+        let fvk = decode_extended_full_viewing_key(
+            network.hrp_sapling_extended_full_viewing_key(),
+            &ivk,
+        )?
+        .unwrap();
+        let addresses = db.get_unused_diversified_addresses(c.id_account, count)?;
+        (fvk, addresses, db.get_next_diversifier_index(c.id_account)?)
+    };
+    let missing = count as usize - addresses.len();
+    if missing > 0 {
+        let generated = generate_addresses(&fvk, next, missing);
+        c.db()?
+            .store_diversified_addresses(c.id_account, &generated)?;
+        c.address_cache
+            .lock()
+            .unwrap()
+            .insert(c.id_account, &generated);
+        addresses.extend(generated.iter().map(|a| {
+            (
+                a.diversifier_index.unwrap(),
+                encode_payment_address(network.hrp_sapling_payment_address(), &a.pa),
+            )
+        }));
+    }
+    if let Some(&(last_index, _)) = addresses.last() {
+        c.db()?
+            .store_diversifier(c.id_account, &to_diversifier_index(last_index))?;
+    }
+    Ok(addresses.into_iter().map(|(_, address)| address).collect())
+}
+
+/// Derive the next `count` diversified addresses of the active account in advance
+///
+/// `new_diversified_address` hands them out without hashing to the curve
+pub fn pregenerate_addresses(count: u32) -> anyhow::Result<()> {
+    check_address_count(count)?;
+    let _issuer = ADDRESS_ISSUER.lock().unwrap();
+    let c = CoinConfig::get_active();
+    let (fvk, start) = {
+        let db = c.db()?;
+        let ivk = db.get_ivk(c.id_account)?;
+        let fvk = decode_extended_full_viewing_key(
+            c.chain.network().hrp_sapling_extended_full_viewing_key(),
+            &ivk,
+        )?
+        .unwrap();
+        (fvk, db.get_next_diversifier_index(c.id_account)?)
+    };
+    let addresses = generate_addresses(&fvk, start, count as usize);
+    c.db()?
+        .store_diversified_addresses(c.id_account, &addresses)?;
+    c.address_cache
+        .lock()
+        .unwrap()
+        .insert(c.id_account, &addresses);
+    Ok(())
+}
+
+fn check_address_count(count: u32) -> anyhow::Result<()> {
+    if count > MAX_ADDRESS_COUNT {
+        anyhow::bail!(
+            "Too many addresses requested: {} (max {})",
+            count,
+            MAX_ADDRESS_COUNT
+        );
+    }
+    Ok(())
 }
 
 pub async fn get_taddr_balance_default() -> anyhow::Result<u64> {
@@ -136,20 +228,30 @@ pub fn get_sk(account: u32) -> anyhow::Result<String> {
 
 pub fn reset_db(coin: u8) -> anyhow::Result<()> {
     let c = CoinConfig::get(coin);
-    let db = c.db()?;
-    db.reset_db()
+    c.db()?.reset_db()?;
+    c.mempool().invalidate_keys();
+    c.nf_index.lock().unwrap().invalidate();
+    c.note_cache.lock().unwrap().invalidate();
+    c.address_cache.lock().unwrap().invalidate();
+    Ok(())
 }
 
 pub fn truncate_data() -> anyhow::Result<()> {
     let c = CoinConfig::get_active();
-    let db = c.db()?;
-    db.truncate_data()
+    c.db()?.truncate_data()?;
+    c.nf_index.lock().unwrap().invalidate();
+    c.note_cache.lock().unwrap().invalidate();
+    c.address_cache.lock().unwrap().invalidate();
+    Ok(())
 }
 
 pub fn delete_account(coin: u8, account: u32) -> anyhow::Result<()> {
     let c = CoinConfig::get(coin);
-    let db = c.db()?;
-    db.delete_account(account)?;
+    c.db()?.delete_account(account)?;
+    c.mempool().invalidate_keys();
+    c.nf_index.lock().unwrap().invalidate();
+    c.note_cache.lock().unwrap().invalidate();
+    c.address_cache.lock().unwrap().invalidate();
     Ok(())
 }
 
@@ -162,5 +264,7 @@ pub fn import_from_zwl(coin: u8, name: &str, data: &str) -> anyhow::Result<()> {
         let (seed, sk, ivk, pa) = decode_key(coin, key, 0)?;
         db.store_account(&name, seed.as_deref(), 0, sk.as_deref(), &ivk, &pa)?;
     }
+    drop(db);
+    c.mempool().invalidate_keys();
     Ok(())
 }
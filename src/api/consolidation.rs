@@ -0,0 +1,250 @@
+// Note consolidation
+
+use crate::api::payment::RecipientMemo;
+use crate::coinconfig::{get_prover, CoinConfig};
+use crate::db::SpendableNote;
+use crate::pay::{send_raw_tx, TxBuilder};
+use crate::{get_latest_height, CompactTxStreamerClient};
+use serde::Serialize;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+use tokio::time::sleep;
+use tonic::transport::Channel;
+use zcash_client_backend::encoding::{
+    decode_extended_full_viewing_key, decode_extended_spending_key,
+};
+use zcash_primitives::consensus::Parameters;
+use zcash_primitives::memo::Memo;
+use zcash_primitives::transaction::components::amount::DEFAULT_FEE;
+use zcash_primitives::zip32::{ExtendedFullViewingKey, ExtendedSpendingKey};
+
+const CANCEL_POLL_INTERVAL: Duration = Duration::from_secs(1);
+
+#[derive(Clone, Debug)]
+pub struct ConsolidationConfig {
+    /// Notes below this value are merged
+    pub dust_threshold: u64,
+    /// Accounts with fewer dust notes are left alone
+    pub min_dust_notes: u32,
+    /// Max number of notes spent by a merge transaction
+    pub max_inputs: usize,
+    /// Max number of merge transactions per account and per round
+    pub max_transactions: usize,
+    /// Time between rounds
+    pub interval: Duration,
+    pub anchor_offset: u32,
+    /// Estimated time to create a spend proof, in ms
+    pub spend_proof_ms: u64,
+}
+
+impl Default for ConsolidationConfig {
+    fn default() -> Self {
+        ConsolidationConfig {
+            dust_threshold: 100_000,
+            min_dust_notes: 20,
+            max_inputs: 50,
+            max_transactions: 2,
+            interval: Duration::from_secs(3600),
+            anchor_offset: 3,
+            spend_proof_ms: 500,
+        }
+    }
+}
+
+#[derive(Serialize, Debug)]
+pub struct ConsolidationReport {
+    pub account: u32,
+    pub transactions: usize,
+    pub tx_ids: Vec<String>,
+    pub notes_before: usize,
+    pub notes_after: usize,
+    /// Estimated time to prove the spends of the whole balance, in ms
+    pub spend_time_before_ms: u64,
+    pub spend_time_after_ms: u64,
+}
+
+struct ConsolidationPlan {
+    groups: Vec<Vec<SpendableNote>>,
+    report: ConsolidationReport,
+}
+
+/// Group the smallest notes of an account into merge transactions
+///
+/// Every group spends between 2 and `max_inputs` notes and must be worth more than the fee.
+/// Each merge replaces its inputs with a single note
+fn make_plan(
+    account: u32,
+    mut notes: Vec<SpendableNote>,
+    config: &ConsolidationConfig,
+) -> ConsolidationPlan {
+    let fee = u64::from(DEFAULT_FEE);
+    let notes_before = notes.len();
+    notes.sort_by_key(|n| n.note.value);
+    let dust: Vec<_> = notes
+        .into_iter()
+        .take_while(|n| n.note.value < config.dust_threshold)
+        .collect();
+    let groups: Vec<Vec<SpendableNote>> = dust
+        .chunks(config.max_inputs.max(2))
+        .filter(|g| g.len() >= 2 && g.iter().map(|n| n.note.value).sum::<u64>() > fee)
+        .take(config.max_transactions)
+        .map(|g| g.to_vec())
+        .collect();
+
+    let merged: usize = groups.iter().map(|g| g.len()).sum();
+    let notes_after = notes_before - merged + groups.len();
+    ConsolidationPlan {
+        report: ConsolidationReport {
+            account,
+            transactions: groups.len(),
+            tx_ids: vec![],
+            notes_before,
+            notes_after,
+            spend_time_before_ms: notes_before as u64 * config.spend_proof_ms,
+            spend_time_after_ms: notes_after as u64 * config.spend_proof_ms,
+        },
+        groups,
+    }
+}
+
+fn plan_account(
+    coin: u8,
+    account: u32,
+    config: &ConsolidationConfig,
+) -> anyhow::Result<ConsolidationPlan> {
+    let c = CoinConfig::get(coin);
+    let height = c.db()?.get_last_sync_height()?.unwrap_or(0);
+    let anchor_height = height.saturating_sub(config.anchor_offset);
+    let notes = c.get_spendable_notes(account, anchor_height)?;
+    Ok(make_plan(account, notes, config))
+}
+
+/// Plan the consolidation of an account without sending anything
+pub fn plan_consolidation(
+    coin: u8,
+    account: u32,
+    config: &ConsolidationConfig,
+) -> anyhow::Result<ConsolidationReport> {
+    let plan = plan_account(coin, account, config)?;
+    Ok(plan.report)
+}
+
+/// Merge the dust notes of an account into its default address
+pub async fn consolidate_account(
+    coin: u8,
+    account: u32,
+    config: &ConsolidationConfig,
+) -> anyhow::Result<ConsolidationReport> {
+    let c = CoinConfig::get(coin);
+    let plan = plan_account(coin, account, config)?;
+    if plan.groups.is_empty() {
+        return Ok(plan.report);
+    }
+    let (fvk, extsk, address) = {
+        let db = c.db()?;
+        let network = c.chain.network();
+        let fvk = decode_extended_full_viewing_key(
+            network.hrp_sapling_extended_full_viewing_key(),
+            &db.get_ivk(account)?,
+        )?
+        .unwrap();
+        let extsk = decode_extended_spending_key(
+            network.hrp_sapling_extended_spending_key(),
+            &db.get_sk(account)?,
+        )?
+        .unwrap();
+        (fvk, extsk, db.get_address(account)?)
+    };
+
+    let mut client = c.connect_lwd().await?;
+    let last_height = get_latest_height(&mut client).await?;
+    let mut report = plan.report;
+    for group in plan.groups.iter() {
+        // the transactions already sent are reported even if a later one fails
+        let tx_id =
+            match consolidate_group(&c, &mut client, last_height, &fvk, &extsk, &address, group)
+                .await
+            {
+                Ok(tx_id) => tx_id,
+                Err(err) => {
+                    log::warn!("Consolidation of account {} stopped: {}", account, err);
+                    break;
+                }
+            };
+        log::info!(
+            "Consolidated {} notes of account {} in {}",
+            group.len(),
+            account,
+            tx_id
+        );
+        report.tx_ids.push(tx_id);
+    }
+    Ok(report)
+}
+
+/// Merge a group of notes into a single note sent to `address`
+async fn consolidate_group(
+    c: &CoinConfig,
+    client: &mut CompactTxStreamerClient<Channel>,
+    last_height: u32,
+    fvk: &ExtendedFullViewingKey,
+    extsk: &ExtendedSpendingKey,
+    address: &str,
+    group: &[SpendableNote],
+) -> anyhow::Result<String> {
+    let total: u64 = group.iter().map(|n| n.note.value).sum();
+    let recipient = RecipientMemo {
+        address: address.to_string(),
+        amount: total - u64::from(DEFAULT_FEE),
+        memo: Memo::Empty,
+        max_amount_per_note: 0,
+    };
+    let mut tx_builder = TxBuilder::new(c.coin_type, last_height);
+    let note_ids = tx_builder.select_inputs(fvk, group, &[], recipient.amount)?;
+    tx_builder.select_outputs(fvk, &[recipient])?;
+    let tx = tx_builder.tx;
+    let extsk = extsk.clone();
+    // the proofs take seconds, keep them off the runtime threads
+    let raw_tx =
+        tokio::task::spawn_blocking(move || tx.sign(None, &extsk, get_prover(), |_| {})).await??;
+    let tx_id = send_raw_tx(client, last_height, &raw_tx).await?;
+    if let Err(err) = c.db().and_then(|mut db| db.tx_mark_spend(&note_ids)) {
+        log::warn!("{} sent but its notes are not marked spent: {}", tx_id, err);
+    }
+    Ok(tx_id)
+}
+
+/// Consolidate the accounts with too many dust notes until canceled
+///
+/// Runs a round every `config.interval`. `report_callback` receives
+/// the result of every consolidated account
+pub async fn run_consolidation(
+    coin: u8,
+    config: ConsolidationConfig,
+    report_callback: impl Fn(&ConsolidationReport),
+    cancel: &'static AtomicBool,
+) -> anyhow::Result<()> {
+    while !cancel.load(Ordering::Acquire) {
+        let accounts = {
+            let c = CoinConfig::get(coin);
+            let db = c.db()?;
+            db.get_dusty_accounts(config.dust_threshold, config.min_dust_notes)?
+        };
+        for account in accounts {
+            if cancel.load(Ordering::Acquire) {
+                break;
+            }
+            match consolidate_account(coin, account, &config).await {
+                Ok(report) => report_callback(&report),
+                Err(err) => log::warn!("Consolidation of account {} failed: {}", account, err),
+            }
+        }
+
+        let mut waited = Duration::ZERO;
+        while waited < config.interval && !cancel.load(Ordering::Acquire) {
+            sleep(CANCEL_POLL_INTERVAL).await;
+            waited += CANCEL_POLL_INTERVAL;
+        }
+    }
+    Ok(())
+}
@@ -1,4 +1,4 @@
-use crate::api::payment::{build_sign_send_multi_payment, RecipientMemo};
+use crate::api::payment::{build_sign_send_multi_payment, NoteSelectionStrategy, RecipientMemo};
 use crate::api::sync::get_latest_height;
 use crate::coinconfig::CoinConfig;
 use crate::contact::{serialize_contacts, Contact};
@@ -42,6 +42,7 @@ pub async fn save_contacts_tx(memos: &[Memo], anchor_offset: u32) -> anyhow::Res
         &recipients,
         false,
         anchor_offset,
+        NoteSelectionStrategy::default(),
         Box::new(|_| {}),
     )
     .await?;
@@ -1,4 +1,6 @@
+use crate::api::payment::NoteSelectionStrategy;
 use crate::coinconfig::{init_coin, CoinConfig};
+use crate::sync_metrics::{SyncProgress, SyncStage};
 use crate::{ChainError, Tx};
 use allo_isolate::{ffi, IntoDart};
 use android_logger::Config;
@@ -8,8 +10,7 @@ use std::cell::RefCell;
 use std::ffi::{CStr, CString};
 use std::os::raw::c_char;
 use std::sync::atomic::{AtomicBool, Ordering};
-use std::sync::Mutex;
-use tokio::sync::Semaphore;
+use std::sync::{Arc, Mutex};
 use zcash_primitives::transaction::builder::Progress;
 
 static mut POST_COBJ: Option<ffi::DartPostCObjectFnType> = None;
@@ -110,6 +111,17 @@ pub unsafe extern "C" fn init_wallet(db_path: *mut c_char) {
     let _ = init_coin(1, &format!("{}/yec.db", &db_path));
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn init_prover(cache_path: *mut c_char, prewarm: bool) {
+    from_c_str!(cache_path);
+    if !cache_path.is_empty() {
+        crate::coinconfig::set_prover_cache_path(&cache_path);
+    }
+    if prewarm {
+        crate::coinconfig::prewarm_prover();
+    }
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn set_active(active: u8) {
     crate::coinconfig::set_active(active);
@@ -126,6 +138,11 @@ pub unsafe extern "C" fn set_coin_lwd_url(coin: u8, lwd_url: *mut c_char) {
     crate::coinconfig::set_coin_lwd_url(coin, &lwd_url);
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn set_recent_first_blocks(coin: u8, blocks: u32) {
+    crate::coinconfig::set_recent_first_blocks(coin, blocks);
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn get_lwd_url(coin: u8) -> *mut c_char {
     let server = crate::coinconfig::get_coin_lwd_url(coin);
@@ -169,6 +186,12 @@ pub unsafe extern "C" fn new_sub_account(name: *mut c_char, index: i32, count: u
     log_result(res)
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn set_birth_height(coin: u8, id_account: u32, height: u32) {
+    let res = crate::api::account::set_birth_height(coin, id_account, height);
+    log_result(res)
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn import_transparent_key(coin: u8, id_account: u32, path: *mut c_char) {
     from_c_str!(path);
@@ -187,59 +210,108 @@ pub unsafe extern "C" fn import_transparent_secret_key(
     log_result(res)
 }
 
-lazy_static! {
-    static ref SYNC_LOCK: Semaphore = Semaphore::new(1);
-    static ref SYNC_CANCELED: AtomicBool = AtomicBool::new(false);
-}
-
 #[no_mangle]
 pub unsafe extern "C" fn cancel_warp() {
     log::info!("Sync canceled");
-    SYNC_CANCELED.store(true, Ordering::Release);
+    crate::api::sync::cancel_all_syncs();
 }
 
-#[tokio::main]
 #[no_mangle]
-pub async unsafe extern "C" fn warp(coin: u8, get_tx: bool, anchor_offset: u32, port: i64) -> u8 {
-    let res = async {
-        let _permit = SYNC_LOCK.acquire().await?;
-        log::info!("Sync started");
-        let result = crate::api::sync::coin_sync(
-            coin,
-            get_tx,
-            anchor_offset,
-            move |height| {
-                let mut height = height.into_dart();
-                if port != 0 {
-                    if let Some(p) = POST_COBJ {
-                        p(port, &mut height);
-                    }
-                }
-            },
-            &SYNC_CANCELED,
-        )
-        .await;
-        log::info!("Sync finished");
+pub unsafe extern "C" fn cancel_sync(coin: u8) {
+    log::info!("Sync canceled {}", coin);
+    crate::api::sync::cancel_sync(coin);
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn is_syncing(coin: u8) -> bool {
+    crate::api::sync::is_syncing(coin)
+}
 
+#[no_mangle]
+pub unsafe extern "C" fn get_sync_progress(coin: u8) -> u32 {
+    crate::api::sync::get_sync_progress(coin)
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn get_sync_metrics(coin: u8) -> *mut c_char {
+    let res = || {
+        let metrics = crate::api::sync::get_sync_metrics(coin)?;
+        let metrics = serde_json::to_string(&metrics)?;
+        Ok(metrics)
+    };
+    to_c_str(log_string(res()))
+}
+
+async fn warp_sync(
+    coin: u8,
+    get_tx: bool,
+    anchor_offset: u32,
+    progress_callback: impl Fn(&SyncProgress) + Send + 'static,
+) -> anyhow::Result<u8> {
+    log::info!("Sync started {}", coin);
+    let result =
+        crate::api::sync::coin_sync_scheduled(coin, get_tx, anchor_offset, progress_callback).await;
+    log::info!("Sync finished {}", coin);
+
+    if coin == CoinConfig::get_active().coin {
         crate::api::mempool::scan().await?;
+    }
 
-        match result {
-            Ok(_) => Ok(0),
-            Err(err) => {
-                if let Some(e) = err.downcast_ref::<ChainError>() {
-                    match e {
-                        ChainError::Reorg => Ok(1),
-                        ChainError::Busy => Ok(2),
-                    }
-                } else {
-                    log::error!("{}", err);
-                    Ok(0xFF)
+    match result {
+        Ok(_) => Ok(0),
+        Err(err) => {
+            if let Some(e) = err.downcast_ref::<ChainError>() {
+                match e {
+                    ChainError::Reorg(_) => Ok(1),
+                    ChainError::Busy => Ok(2),
+                    ChainError::TreeMismatch => Ok(3),
                 }
+            } else {
+                log::error!("{}", err);
+                Ok(0xFF)
             }
         }
-    };
-    let r = res.await;
-    SYNC_CANCELED.store(false, Ordering::Release);
+    }
+}
+
+#[tokio::main]
+#[no_mangle]
+pub async unsafe extern "C" fn warp(coin: u8, get_tx: bool, anchor_offset: u32, port: i64) -> u8 {
+    let r = warp_sync(coin, get_tx, anchor_offset, move |progress| {
+        // Only a downloaded chunk or the end of the sync moves the height
+        if !matches!(progress.stage, SyncStage::Download | SyncStage::Done) {
+            return;
+        }
+        let mut height = progress.height.into_dart();
+        if port != 0 {
+            if let Some(p) = POST_COBJ {
+                p(port, &mut height);
+            }
+        }
+    })
+    .await;
+    log_result(r)
+}
+
+#[tokio::main]
+#[no_mangle]
+pub async unsafe extern "C" fn warp_with_progress(
+    coin: u8,
+    get_tx: bool,
+    anchor_offset: u32,
+    port: i64,
+) -> u8 {
+    let r = warp_sync(coin, get_tx, anchor_offset, move |progress| {
+        if port != 0 {
+            if let Ok(progress) = serde_json::to_string(progress) {
+                let mut progress = progress.into_dart();
+                if let Some(p) = POST_COBJ {
+                    p(port, &mut progress);
+                }
+            }
+        }
+    })
+    .await;
     log_result(r)
 }
 
@@ -261,6 +333,48 @@ pub unsafe extern "C" fn new_diversified_address() -> *mut c_char {
     to_c_str(log_string(res()))
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn new_diversified_addresses(count: u32) -> *mut c_char {
+    let res = || {
+        let addresses = crate::api::account::new_diversified_addresses(count)?;
+        let addresses = serde_json::to_string(&addresses)?;
+        Ok(addresses)
+    };
+    to_c_str(log_string(res()))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn register_invoice(invoice: *mut c_char, address: *mut c_char) {
+    from_c_str!(invoice);
+    from_c_str!(address);
+    let res = crate::api::invoice::register_invoice(&invoice, &address);
+    log_result(res)
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn new_invoice_address(invoice: *mut c_char) -> *mut c_char {
+    from_c_str!(invoice);
+    let res = crate::api::invoice::new_invoice_address(&invoice);
+    to_c_str(log_string(res))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn get_invoice_payments(invoice: *mut c_char) -> *mut c_char {
+    from_c_str!(invoice);
+    let res = || {
+        let payments = crate::api::invoice::get_invoice_payments(&invoice)?;
+        let payments = serde_json::to_string(&payments)?;
+        Ok(payments)
+    };
+    to_c_str(log_string(res()))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn pregenerate_addresses(count: u32) {
+    let res = crate::api::account::pregenerate_addresses(count);
+    log_result(res)
+}
+
 #[tokio::main]
 #[no_mangle]
 pub async unsafe extern "C" fn get_latest_height() -> u32 {
@@ -300,6 +414,7 @@ pub async unsafe extern "C" fn send_multi_payment(
             &recipients,
             use_transparent,
             anchor_offset,
+            NoteSelectionStrategy::default(),
             Box::new(move |progress| {
                 report_progress(progress, port);
             }),
@@ -331,6 +446,129 @@ pub async unsafe extern "C" fn mempool_sync() -> i64 {
     log_result(res)
 }
 
+lazy_static! {
+    // cancellation flag of the running watcher of each coin
+    static ref MEMPOOL_WATCHERS: Mutex<[Option<Arc<AtomicBool>>; 2]> = Mutex::new([None, None]);
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn start_mempool_monitor(coin: u8, port: i64) {
+    let cancel = Arc::new(AtomicBool::new(false));
+    {
+        let mut watchers = MEMPOOL_WATCHERS.lock().unwrap();
+        let watcher = match watchers.get_mut(coin as usize) {
+            Some(watcher) => watcher,
+            None => {
+                log::error!("Invalid coin {}", coin);
+                return;
+            }
+        };
+        // a new watcher replaces the running one
+        if let Some(running) = watcher.replace(cancel.clone()) {
+            running.store(true, Ordering::Release);
+        }
+    }
+    std::thread::spawn(move || {
+        let res = || {
+            let runtime = tokio::runtime::Runtime::new()?;
+            runtime.block_on(crate::api::mempool::watch(
+                coin,
+                move |balance| {
+                    let mut balance = balance.into_dart();
+                    if port != 0 {
+                        if let Some(p) = POST_COBJ {
+                            p(port, &mut balance);
+                        }
+                    }
+                },
+                &cancel,
+            ))
+        };
+        log_result(res())
+    });
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn stop_mempool_monitor() {
+    let mut watchers = MEMPOOL_WATCHERS.lock().unwrap();
+    for watcher in watchers.iter_mut() {
+        if let Some(cancel) = watcher.take() {
+            cancel.store(true, Ordering::Release);
+        }
+    }
+}
+
+lazy_static! {
+    static ref CONSOLIDATION_CANCELED: AtomicBool = AtomicBool::new(false);
+}
+
+fn consolidation_config(
+    dust_threshold: u64,
+    max_inputs: u32,
+    interval_secs: u32,
+) -> crate::api::consolidation::ConsolidationConfig {
+    crate::api::consolidation::ConsolidationConfig {
+        dust_threshold,
+        max_inputs: max_inputs as usize,
+        interval: std::time::Duration::from_secs(interval_secs as u64),
+        ..Default::default()
+    }
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn start_consolidation(
+    coin: u8,
+    dust_threshold: u64,
+    max_inputs: u32,
+    interval_secs: u32,
+    port: i64,
+) {
+    CONSOLIDATION_CANCELED.store(false, Ordering::Release);
+    let config = consolidation_config(dust_threshold, max_inputs, interval_secs);
+    std::thread::spawn(move || {
+        let res = || {
+            let runtime = tokio::runtime::Runtime::new()?;
+            runtime.block_on(crate::api::consolidation::run_consolidation(
+                coin,
+                config,
+                move |report| {
+                    if port != 0 {
+                        if let Ok(report) = serde_json::to_string(report) {
+                            let mut report = report.into_dart();
+                            if let Some(p) = POST_COBJ {
+                                p(port, &mut report);
+                            }
+                        }
+                    }
+                },
+                &CONSOLIDATION_CANCELED,
+            ))
+        };
+        log_result(res())
+    });
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn stop_consolidation() {
+    CONSOLIDATION_CANCELED.store(true, Ordering::Release);
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn plan_consolidation(
+    coin: u8,
+    account: u32,
+    dust_threshold: u64,
+    max_inputs: u32,
+) -> *mut c_char {
+    let res = || {
+        let config = consolidation_config(dust_threshold, max_inputs, 0);
+        let report = crate::api::consolidation::plan_consolidation(coin, account, &config)?;
+        let report = serde_json::to_string(&report)?;
+        Ok(report)
+    };
+    to_c_str(log_string(res()))
+}
+
 #[no_mangle]
 pub unsafe extern "C" fn mempool_reset() {
     let c = CoinConfig::get_active();
@@ -345,6 +583,13 @@ pub unsafe extern "C" fn get_mempool_balance() -> i64 {
     mempool.get_unconfirmed_balance()
 }
 
+#[no_mangle]
+pub unsafe extern "C" fn get_mempool_account_balance(account: u32) -> i64 {
+    let c = CoinConfig::get_active();
+    let mempool = c.mempool.lock().unwrap();
+    mempool.get_account_unconfirmed_balance(account)
+}
+
 #[tokio::main]
 #[no_mangle]
 pub async unsafe extern "C" fn get_taddr_balance(coin: u8, id_account: u32) -> u64 {
@@ -386,6 +631,7 @@ pub async unsafe extern "C" fn prepare_multi_payment(
             &recipients,
             use_transparent,
             anchor_offset,
+            NoteSelectionStrategy::default(),
         )
         .await?;
         let tx_str = serde_json::to_string(&tx)?;
@@ -394,12 +640,37 @@ pub async unsafe extern "C" fn prepare_multi_payment(
     to_c_str(log_string(res.await))
 }
 
+#[tokio::main]
+#[no_mangle]
+pub async unsafe extern "C" fn prepare_multi_payment_binary(
+    recipients_json: *mut c_char,
+    use_transparent: bool,
+    anchor_offset: u32,
+) -> *mut c_char {
+    from_c_str!(recipients_json);
+    let res = async {
+        let last_height = crate::api::sync::get_latest_height().await?;
+        let recipients = crate::api::payment::parse_recipients(&recipients_json)?;
+        let tx = crate::api::payment::build_only_multi_payment(
+            last_height,
+            &recipients,
+            use_transparent,
+            anchor_offset,
+            NoteSelectionStrategy::default(),
+        )
+        .await?;
+        let tx_str = base64::encode(&tx.to_bytes()?);
+        Ok(tx_str)
+    };
+    to_c_str(log_string(res.await))
+}
+
 #[tokio::main]
 #[no_mangle]
 pub async unsafe extern "C" fn sign(tx: *mut c_char, port: i64) -> *mut c_char {
     from_c_str!(tx);
     let res = async {
-        let tx: Tx = serde_json::from_str(&tx)?;
+        let tx = Tx::parse(&tx)?;
         let raw_tx = crate::api::payment::sign_only_multi_payment(
             &tx,
             Box::new(move |progress| {
@@ -584,7 +855,7 @@ pub unsafe extern "C" fn merge_data(drop: *mut c_char) -> *mut c_char {
 pub unsafe extern "C" fn get_tx_summary(tx: *mut c_char) -> *mut c_char {
     from_c_str!(tx);
     let res = || {
-        let tx: Tx = serde_json::from_str(&tx)?;
+        let tx = Tx::parse(&tx)?;
         let summary = crate::get_tx_summary(&tx)?;
         let summary = serde_json::to_string(&summary)?;
         Ok::<_, anyhow::Error>(summary)
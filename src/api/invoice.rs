@@ -0,0 +1,46 @@
+// Invoices
+
+use crate::coinconfig::CoinConfig;
+use crate::db::InvoicePayment;
+use anyhow::anyhow;
+use zcash_client_backend::encoding::{decode_extended_full_viewing_key, decode_payment_address};
+use zcash_primitives::consensus::Parameters;
+
+/// Attach an invoice id to an address of the active account
+///
+/// Notes received on the address from then on are recorded as payments of the invoice
+pub fn register_invoice(invoice: &str, address: &str) -> anyhow::Result<()> {
+    let c = CoinConfig::get_active();
+    let network = c.chain.network();
+    let db = c.db()?;
+    let pa = decode_payment_address(network.hrp_sapling_payment_address(), address)?
+        .ok_or_else(|| anyhow!("Invalid address"))?;
+    let fvk = decode_extended_full_viewing_key(
+        network.hrp_sapling_extended_full_viewing_key(),
+        &db.get_ivk(c.id_account)?,
+    )?
+    .unwrap();
+    if fvk.fvk.vk.to_payment_address(*pa.diversifier()).as_ref() != Some(&pa) {
+        anyhow::bail!("Not an address of this account");
+    }
+    db.store_invoice(c.id_account, &pa.diversifier().0, invoice)?;
+    Ok(())
+}
+
+/// Hand out a new diversified address for an invoice
+pub fn new_invoice_address(invoice: &str) -> anyhow::Result<String> {
+    let c = CoinConfig::get_active();
+    let address = crate::api::account::new_diversified_address()?;
+    let pa = decode_payment_address(c.chain.network().hrp_sapling_payment_address(), &address)?
+        .ok_or_else(|| anyhow!("Invalid address"))?;
+    c.db()?
+        .store_invoice(c.id_account, &pa.diversifier().0, invoice)?;
+    Ok(address)
+}
+
+/// Notes received for an invoice
+pub fn get_invoice_payments(invoice: &str) -> anyhow::Result<Vec<InvoicePayment>> {
+    let c = CoinConfig::get_active();
+    let payments = c.db()?.get_invoice_payments(invoice)?;
+    Ok(payments)
+}
@@ -1,12 +1,17 @@
-use zcash_client_backend::encoding::decode_extended_full_viewing_key;
-use zcash_primitives::consensus::Parameters;
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+use tokio::time::{sleep, timeout};
+use tonic::Request;
 
-use crate::coinconfig::CoinConfig;
-use crate::get_latest_height;
+use crate::coinconfig::{set_coin_height, CoinConfig};
+use crate::{get_latest_height, Empty};
+
+const WATCH_POLL_INTERVAL: Duration = Duration::from_secs(1);
+const WATCH_RETRY_DELAY: Duration = Duration::from_secs(5);
 
 pub async fn scan() -> anyhow::Result<i64> {
     let c = CoinConfig::get_active();
-    let ivk = c.db()?.get_ivk(c.id_account)?;
     let mut client = c.connect_lwd().await?;
     let height = get_latest_height(&mut client).await?;
     let mut mempool = c.mempool.lock().unwrap();
@@ -15,14 +20,81 @@ pub async fn scan() -> anyhow::Result<i64> {
         CoinConfig::set_height(height);
         mempool.clear()?;
     }
-    let fvk = decode_extended_full_viewing_key(
-        c.chain.network().hrp_sapling_extended_full_viewing_key(),
-        &ivk,
-    )?
-    .unwrap();
-    mempool
-        .update(&mut client, height, &fvk.fvk.vk.ivk())
-        .await?;
+    mempool.update(&mut client, height).await?;
 
     Ok(mempool.get_unconfirmed_balance())
 }
+
+/// Unconfirmed balances of every account of a coin
+pub fn get_unconfirmed_balances(coin: u8) -> HashMap<u32, i64> {
+    let c = CoinConfig::get(coin);
+    let mempool = c.mempool.lock().unwrap();
+    mempool.get_unconfirmed_balances().clone()
+}
+
+/// Watch the mempool of a coin until canceled
+///
+/// Subscribes to the server mempool stream and trial decrypts transactions
+/// as they arrive for every account. `balance_callback` receives the unconfirmed balance
+/// of the active account whenever it changes.
+/// The server closes the stream when a new block is mined, then
+/// the mempool is reset and we subscribe again.
+pub async fn watch(
+    coin: u8,
+    balance_callback: impl Fn(i64) + Send + Sync + 'static,
+    cancel: &AtomicBool,
+) -> anyhow::Result<()> {
+    while !cancel.load(Ordering::Acquire) {
+        if let Err(err) = watch_stream(coin, &balance_callback, cancel).await {
+            log::warn!("Mempool stream error: {}", err);
+            sleep(WATCH_RETRY_DELAY).await;
+        }
+    }
+    log::info!("Mempool watcher stopped");
+    Ok(())
+}
+
+async fn watch_stream(
+    coin: u8,
+    balance_callback: &(impl Fn(i64) + Sync),
+    cancel: &AtomicBool,
+) -> anyhow::Result<()> {
+    let c = CoinConfig::get(coin);
+    let mut client = c.connect_lwd().await?;
+    let height = get_latest_height(&mut client).await?;
+    if height != c.height {
+        set_coin_height(coin, height);
+        let balance = {
+            let mut mempool = c.mempool.lock().unwrap();
+            mempool.clear()?;
+            mempool.get_unconfirmed_balance()
+        };
+        balance_callback(balance);
+    }
+    let mut txs = client
+        .get_mempool_stream(Request::new(Empty {}))
+        .await?
+        .into_inner();
+    loop {
+        if cancel.load(Ordering::Acquire) {
+            return Ok(());
+        }
+        let raw_tx = match timeout(WATCH_POLL_INTERVAL, txs.message()).await {
+            Err(_) => continue, // no new tx, check for cancellation
+            Ok(raw_tx) => raw_tx?,
+        };
+        match raw_tx {
+            Some(raw_tx) => {
+                let balance = {
+                    let mut mempool = c.mempool.lock().unwrap();
+                    let changed = mempool.add_raw_transaction(height, &raw_tx)?;
+                    changed.then(|| mempool.get_unconfirmed_balance())
+                };
+                if let Some(balance) = balance {
+                    balance_callback(balance);
+                }
+            }
+            None => return Ok(()), // new block
+        }
+    }
+}
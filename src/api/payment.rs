@@ -4,8 +4,10 @@ use secp256k1::SecretKey;
 
 use crate::api::sync::get_latest_height;
 use crate::coinconfig::{get_prover, CoinConfig};
-use crate::pay::TxBuilder;
+pub use crate::note_selection::NoteSelectionStrategy;
+use crate::pay::{send_raw_tx, TxBuilder};
 pub use crate::{broadcast_tx, Tx};
+use rayon::prelude::*;
 use zcash_client_backend::encoding::{
     decode_extended_full_viewing_key, decode_extended_spending_key,
 };
@@ -25,9 +27,11 @@ async fn prepare_multi_payment(
     recipients: &[RecipientMemo],
     use_transparent: bool,
     anchor_offset: u32,
+    strategy: NoteSelectionStrategy,
 ) -> anyhow::Result<(Tx, Vec<u32>)> {
     let c = CoinConfig::get_active();
     let mut tx_builder = TxBuilder::new(c.coin_type, last_height);
+    tx_builder.set_note_selection(strategy);
 
     let fvk = c.db()?.get_ivk(c.id_account)?;
     let fvk = decode_extended_full_viewing_key(
@@ -50,9 +54,7 @@ async fn prepare_multi_payment(
 
     let target_amount: u64 = recipients.iter().map(|r| r.amount).sum();
     let anchor_height = last_height.saturating_sub(anchor_offset);
-    let spendable_notes = c
-        .db()?
-        .get_spendable_notes(c.id_account, anchor_height, &fvk)?;
+    let spendable_notes = c.get_spendable_notes(c.id_account, anchor_height)?;
     let note_ids = tx_builder.select_inputs(&fvk, &spendable_notes, &utxos, target_amount)?;
     tx_builder.select_outputs(&fvk, recipients)?;
     Ok((tx_builder.tx, note_ids))
@@ -80,9 +82,16 @@ pub async fn build_only_multi_payment(
     recipients: &[RecipientMemo],
     use_transparent: bool,
     anchor_offset: u32,
+    strategy: NoteSelectionStrategy,
 ) -> anyhow::Result<Tx> {
-    let (tx, _) =
-        prepare_multi_payment(last_height, recipients, use_transparent, anchor_offset).await?;
+    let (tx, _) = prepare_multi_payment(
+        last_height,
+        recipients,
+        use_transparent,
+        anchor_offset,
+        strategy,
+    )
+    .await?;
     // let tx_str = serde_json::to_string(&tx)?;
     Ok(tx)
 }
@@ -102,11 +111,18 @@ pub async fn build_sign_send_multi_payment(
     recipients: &[RecipientMemo],
     use_transparent: bool,
     anchor_offset: u32,
+    strategy: NoteSelectionStrategy,
     progress_callback: PaymentProgressCallback,
 ) -> anyhow::Result<String> {
     let c = CoinConfig::get_active();
-    let (tx, note_ids) =
-        prepare_multi_payment(last_height, recipients, use_transparent, anchor_offset).await?;
+    let (tx, note_ids) = prepare_multi_payment(
+        last_height,
+        recipients,
+        use_transparent,
+        anchor_offset,
+        strategy,
+    )
+    .await?;
     let raw_tx = sign(&tx, progress_callback)?;
     let tx_id = broadcast_tx(&raw_tx).await?;
 
@@ -114,9 +130,108 @@ pub async fn build_sign_send_multi_payment(
     Ok(tx_id)
 }
 
+/// Build, sign and broadcast several independent payments
+///
+/// The keys, the spendable notes and the server connection are loaded once.
+/// Each payment selects its inputs from the notes left over by the previous ones
+/// so that they never spend the same note. The transactions are then signed
+/// in parallel and broadcast in order.
+/// Returns the txid or the error of every payment
+pub async fn build_sign_send_batch_payments(
+    last_height: u32,
+    payments: &[Vec<RecipientMemo>],
+    anchor_offset: u32,
+    strategy: NoteSelectionStrategy,
+) -> anyhow::Result<Vec<anyhow::Result<String>>> {
+    let c = CoinConfig::get_active();
+    let network = c.chain.network();
+    let (fvk, zsk) = {
+        let db = c.db()?;
+        let fvk = db.get_ivk(c.id_account)?;
+        let fvk =
+            decode_extended_full_viewing_key(network.hrp_sapling_extended_full_viewing_key(), &fvk)
+                .unwrap()
+                .unwrap();
+        let zsk = db.get_sk(c.id_account)?;
+        (fvk, zsk)
+    };
+    let anchor_height = last_height.saturating_sub(anchor_offset);
+    let mut notes = c.get_spendable_notes(c.id_account, anchor_height)?;
+    let extsk = decode_extended_spending_key(network.hrp_sapling_extended_spending_key(), &zsk)
+        .unwrap()
+        .unwrap();
+
+    let mut txs: Vec<anyhow::Result<(Tx, Vec<u32>)>> = vec![];
+    for recipients in payments.iter() {
+        let mut tx_builder = TxBuilder::new(c.coin_type, last_height);
+        tx_builder.set_note_selection(strategy);
+        let target_amount: u64 = recipients.iter().map(|r| r.amount).sum();
+        let tx = tx_builder
+            .select_inputs(&fvk, &notes, &[], target_amount)
+            .and_then(|note_ids| {
+                tx_builder.select_outputs(&fvk, recipients)?;
+                Ok(note_ids)
+            })
+            .map(|note_ids| {
+                notes.retain(|n| !note_ids.contains(&n.id));
+                (tx_builder.tx, note_ids)
+            });
+        txs.push(tx);
+    }
+
+    // the proofs take seconds, keep them off the runtime threads
+    let raw_txs: Vec<anyhow::Result<(Vec<u8>, Vec<u32>)>> =
+        tokio::task::spawn_blocking(move || {
+            let prover = get_prover();
+            txs.into_par_iter()
+                .map(|tx| {
+                    let (tx, note_ids) = tx?;
+                    let raw_tx = tx.sign(None, &extsk, prover, |_| {})?;
+                    Ok((raw_tx, note_ids))
+                })
+                .collect()
+        })
+        .await?;
+
+    let mut client = c.connect_lwd().await?;
+    let latest_height = crate::get_latest_height(&mut client).await?;
+    let mut results = vec![];
+    for raw_tx in raw_txs {
+        let res = match raw_tx {
+            Ok((raw_tx, note_ids)) => {
+                let tx_id = send_raw_tx(&mut client, latest_height, &raw_tx).await;
+                // the transaction is out, a db error must not stop the next ones
+                tx_id.and_then(|tx_id| {
+                    c.db()
+                        .and_then(|mut db| db.tx_mark_spend(&note_ids))
+                        .map_err(|e| {
+                            anyhow::anyhow!(
+                                "{} sent but its notes are not marked spent: {}",
+                                tx_id,
+                                e
+                            )
+                        })?;
+                    Ok(tx_id)
+                })
+            }
+            Err(e) => Err(e),
+        };
+        results.push(res);
+    }
+    Ok(results)
+}
+
 pub async fn shield_taddr() -> anyhow::Result<String> {
     let last_height = get_latest_height().await?;
-    let tx_id = build_sign_send_multi_payment(last_height, &[], true, 0, Box::new(|_| {})).await?;
+    let tx_id = build_sign_send_multi_payment(
+        last_height,
+        &[],
+        true,
+        0,
+        NoteSelectionStrategy::default(),
+        Box::new(|_| {}),
+    )
+    .await?;
     Ok(tx_id)
 }
 
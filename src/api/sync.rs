@@ -1,21 +1,120 @@
 // Sync
 
-use crate::coinconfig::CoinConfig;
+use crate::coinconfig::{CoinConfig, COIN_CONFIG};
 use crate::scan::AMProgressCallback;
-use crate::{BlockId, CTree, CompactTxStreamerClient, DbAdapter};
-use std::sync::atomic::AtomicBool;
+use crate::sync_metrics::{to_prometheus, SyncMetrics, SyncProgress};
+use crate::{ChainError, CompactTxStreamerClient, DbAdapter};
+use lazy_static::lazy_static;
+use std::sync::atomic::{AtomicBool, AtomicU32, Ordering};
 use std::sync::Arc;
-use tokio::sync::Mutex;
+use tokio::sync::{Mutex, Semaphore};
 use tonic::transport::Channel;
-use tonic::Request;
 
 const DEFAULT_CHUNK_SIZE: u32 = 100_000;
+const MAX_REORG_RETRIES: u32 = 3;
+
+lazy_static! {
+    static ref SYNC_LOCKS: [Semaphore; 2] = [Semaphore::new(1), Semaphore::new(1)];
+}
+static SYNC_CANCELED: [AtomicBool; 2] = [AtomicBool::new(false), AtomicBool::new(false)];
+static SYNC_RUNNING: [AtomicBool; 2] = [AtomicBool::new(false), AtomicBool::new(false)];
+static SYNC_HEIGHTS: [AtomicU32; 2] = [AtomicU32::new(0), AtomicU32::new(0)];
+
+fn check_coin(coin: u8) -> anyhow::Result<()> {
+    if coin as usize >= COIN_CONFIG.len() {
+        anyhow::bail!("Invalid coin {}", coin);
+    }
+    Ok(())
+}
+
+/// Sync a coin after any other sync of the same coin has finished
+///
+/// Each coin has its own lock and cancellation flag so that Zcash and Ycash
+/// can sync at the same time. Both share the global rayon pool for
+/// trial decryption. Its queue is FIFO so chunks of the two coins
+/// get processed in turns
+pub async fn coin_sync_scheduled(
+    coin: u8,
+    get_tx: bool,
+    anchor_offset: u32,
+    progress_callback: impl Fn(&SyncProgress) + Send + 'static,
+) -> anyhow::Result<()> {
+    check_coin(coin)?;
+    let i = coin as usize;
+    let _permit = SYNC_LOCKS[i].acquire().await?;
+    SYNC_RUNNING[i].store(true, Ordering::Release);
+    let res = coin_sync(
+        coin,
+        get_tx,
+        anchor_offset,
+        move |progress: &SyncProgress| {
+            SYNC_HEIGHTS[i].store(progress.height, Ordering::Release);
+            progress_callback(progress);
+        },
+        &SYNC_CANCELED[i],
+    )
+    .await;
+    SYNC_RUNNING[i].store(false, Ordering::Release);
+    SYNC_CANCELED[i].store(false, Ordering::Release);
+    res
+}
+
+/// Sync several coins concurrently
+///
+/// Returns the result of every coin in the same order
+pub async fn sync_coins(coins: &[u8], get_tx: bool, anchor_offset: u32) -> Vec<anyhow::Result<()>> {
+    let syncs = coins
+        .iter()
+        .map(|&coin| coin_sync_scheduled(coin, get_tx, anchor_offset, |_| {}));
+    futures::future::join_all(syncs).await
+}
+
+pub fn cancel_sync(coin: u8) {
+    if let Some(canceled) = SYNC_CANCELED.get(coin as usize) {
+        canceled.store(true, Ordering::Release);
+    }
+}
+
+pub fn cancel_all_syncs() {
+    for canceled in SYNC_CANCELED.iter() {
+        canceled.store(true, Ordering::Release);
+    }
+}
+
+pub fn is_syncing(coin: u8) -> bool {
+    SYNC_RUNNING
+        .get(coin as usize)
+        .map_or(false, |running| running.load(Ordering::Acquire))
+}
+
+/// Last height reported by the sync of a coin
+pub fn get_sync_progress(coin: u8) -> u32 {
+    SYNC_HEIGHTS
+        .get(coin as usize)
+        .map_or(0, |height| height.load(Ordering::Acquire))
+}
+
+/// Sync counters of a coin since the start of the process
+pub fn get_sync_metrics(coin: u8) -> anyhow::Result<SyncMetrics> {
+    check_coin(coin)?;
+    let c = CoinConfig::get(coin);
+    let metrics = c.sync_metrics.lock().unwrap();
+    Ok(metrics.clone())
+}
+
+/// Sync counters of every coin in the Prometheus text format
+pub fn get_sync_metrics_prometheus() -> String {
+    let metrics: Vec<_> = (0..COIN_CONFIG.len() as u8)
+        .filter_map(|coin| get_sync_metrics(coin).ok().map(|m| (coin, m)))
+        .collect();
+    to_prometheus(&metrics)
+}
 
 pub async fn coin_sync(
     coin: u8,
     get_tx: bool,
     anchor_offset: u32,
-    progress_callback: impl Fn(u32) + Send + 'static,
+    progress_callback: impl Fn(&SyncProgress) + Send + 'static,
     cancel: &'static AtomicBool,
 ) -> anyhow::Result<()> {
     let cb = Arc::new(Mutex::new(progress_callback));
@@ -41,18 +140,73 @@ async fn coin_sync_impl(
     cancel: &'static AtomicBool,
 ) -> anyhow::Result<()> {
     let c = CoinConfig::get(coin);
-    crate::scan::sync_async(
-        c.coin_type,
-        chunk_size,
-        get_tx,
-        c.db_path.as_ref().unwrap(),
-        target_height_offset,
-        progress_callback,
-        cancel,
-        c.lwd_url.as_ref().unwrap(),
-    )
-    .await?;
-    Ok(())
+    let mut reorgs = 0;
+    loop {
+        let res = crate::scan::sync_async(
+            c.coin_type,
+            chunk_size,
+            get_tx,
+            c.db_path.as_ref().unwrap(),
+            target_height_offset,
+            progress_callback.clone(),
+            cancel,
+            c.lwd_url.as_ref().unwrap(),
+        )
+        .await;
+        let fork_height = match &res {
+            Err(err) => match err.downcast_ref::<ChainError>() {
+                Some(ChainError::Reorg(fork_height)) => *fork_height,
+                _ => None,
+            },
+            Ok(_) => None,
+        };
+        match fork_height {
+            Some(fork_height) if reorgs < MAX_REORG_RETRIES => {
+                reorgs += 1;
+                let height = rewind_to_fork(coin, fork_height)?;
+                log::info!("Reorg: resuming sync from {}", height);
+            }
+            _ => return res,
+        }
+    }
+}
+
+/// Roll back to the latest stored block at or before `fork_height`,
+/// the last block that the sync found on the chain of the server
+///
+/// The tree and the witnesses of that block are kept so the sync can
+/// continue from there without fetching a tree state. Only the notes, spends
+/// and witnesses after it are removed from the nullifier index and the note cache.
+/// Returns the height the sync resumes from
+pub fn rewind_to_fork(coin: u8, fork_height: u32) -> anyhow::Result<u32> {
+    let c = CoinConfig::get(coin);
+    // the db lock is released before the caches are locked, see `CoinConfig`
+    let (trim_height, removed, restored) = {
+        let mut db = c.db()?;
+        let height = match db.get_checkpoint_height(fork_height)? {
+            Some(height) => height,
+            None => anyhow::bail!(ChainError::Reorg(None)), // older than the stored blocks
+        };
+        let trim_height = db.get_trim_height(height + 1)?;
+        let (removed, restored) = db.get_trimmed_nullifiers(trim_height)?;
+        db.trim_to_height(trim_height)?;
+        (trim_height, removed, restored)
+    };
+    {
+        let mut nf_index = c.nf_index.lock().unwrap();
+        for nf in removed.iter() {
+            nf_index.remove(nf);
+        }
+        for (nf, nf_ref) in restored.iter() {
+            nf_index.insert(*nf, *nf_ref);
+        }
+    }
+    c.note_cache
+        .lock()
+        .unwrap()
+        .rewind(trim_height, !restored.is_empty());
+    let height = c.db()?.get_last_sync_height()?.unwrap_or(0);
+    Ok(height)
 }
 
 pub async fn get_latest_height() -> anyhow::Result<u32> {
@@ -76,11 +230,25 @@ pub async fn skip_to_last_height(coin: u8) -> anyhow::Result<()> {
     Ok(())
 }
 
+/// Rewind to the latest stored block with witnesses at or before `height`
+///
+/// The tree state is only fetched from the server when there is no such block
 pub async fn rewind_to_height(height: u32) -> anyhow::Result<()> {
     let c = CoinConfig::get_active();
-    let mut client = c.connect_lwd().await?;
-    c.db()?.trim_to_height(height)?;
-    fetch_and_store_tree_state(c.coin, &mut client, height).await?;
+    let checkpoint = c.db()?.get_checkpoint_height(height)?;
+    match checkpoint {
+        Some(checkpoint) => {
+            log::info!("Rewinding to stored block {}", checkpoint);
+            c.db()?.trim_to_height(checkpoint + 1)?;
+        }
+        None => {
+            let mut client = c.connect_lwd().await?;
+            c.db()?.trim_to_height(height)?;
+            fetch_and_store_tree_state(c.coin, &mut client, height).await?;
+        }
+    }
+    c.nf_index.lock().unwrap().invalidate();
+    c.note_cache.lock().unwrap().invalidate();
     Ok(())
 }
 
@@ -90,18 +258,9 @@ async fn fetch_and_store_tree_state(
     height: u32,
 ) -> anyhow::Result<()> {
     let c = CoinConfig::get(coin);
-    let block_id = BlockId {
-        height: height as u64,
-        hash: vec![],
-    };
-    let block = client.get_block(block_id.clone()).await?.into_inner();
-    let tree_state = client
-        .get_tree_state(Request::new(block_id))
-        .await?
-        .into_inner();
-    let tree = CTree::read(&*hex::decode(&tree_state.sapling_tree)?)?;
+    let (hash, time, tree) = crate::chain::get_block_tree_state(client, height).await?;
     let db = c.db()?;
-    DbAdapter::store_block(&db.connection, height, &block.hash, block.time, &tree)?;
+    DbAdapter::store_block(&db.connection, height, &hash, time, &tree)?;
     Ok(())
 }
 
@@ -118,3 +277,115 @@ pub async fn get_block_by_time(time: u32) -> anyhow::Result<u32> {
     let date_time = crate::chain::get_block_by_time(c.chain.network(), &mut client, time).await?;
     Ok(date_time)
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chain::Nf;
+    use crate::chain_gen::{ChainGenConfig, ChainGenerator};
+    use crate::coinconfig::{init_coin, set_checkpoint_policy, set_coin_lwd_url};
+    use crate::mock_lwd::{create_test_wallet, spawn_mock_lightwalletd, MockLightwalletd};
+    use crate::CheckpointPolicy;
+    use rusqlite::params;
+    use zcash_primitives::consensus::Network;
+
+    static CANCEL: AtomicBool = AtomicBool::new(false);
+
+    /// Check the notes received and spent up to `height`, and that no later ones remain
+    fn check_notes(chain: &ChainGenerator, db: &DbAdapter, height: u32) -> anyhow::Result<()> {
+        let delay = chain.config.wallet_spend_delay;
+        let count = |sql: &str| -> anyhow::Result<usize> {
+            Ok(db.connection.query_row(sql, [], |row| row.get(0))?)
+        };
+        let received = count("SELECT COUNT(*) FROM received_notes")?;
+        let spent = count("SELECT COUNT(*) FROM received_notes WHERE spent IS NOT NULL")?;
+        assert_eq!(received, chain.wallet_note_count(height));
+        assert_eq!(spent, chain.wallet_note_count(height.saturating_sub(delay)));
+        let later: usize = db.connection.query_row(
+            "SELECT COUNT(*) FROM received_notes WHERE height > ?1 OR spent > ?1",
+            params![height],
+            |row| row.get(0),
+        )?;
+        assert_eq!(later, 0);
+        assert_eq!(db.get_last_sync_height()?, Some(height));
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_sync_after_reorg() -> anyhow::Result<()> {
+        let config = ChainGenConfig {
+            block_count: 150,
+            outputs_per_block: 20,
+            spends_per_block: 5,
+            wallet_output_rate: 0.1,
+            wallet_spend_delay: 10,
+            ..ChainGenConfig::default()
+        };
+        let start = config.start_height;
+        let fvks = ChainGenerator::test_fvks(1);
+        let chain = Arc::new(ChainGenerator::new(
+            Network::MainNetwork,
+            config,
+            fvks.clone(),
+        ));
+        let server = Arc::new(MockLightwalletd::new(Network::MainNetwork, chain.clone()));
+        let url = spawn_mock_lightwalletd(server.clone()).await?;
+        let tip = chain.tip_height();
+
+        let db_path =
+            std::env::temp_dir().join(format!("warp-reorg-sync-{}.db", std::process::id()));
+        let db_path = db_path.to_string_lossy().to_string();
+        let accounts = create_test_wallet(Network::MainNetwork, &db_path, &fvks)?;
+        init_coin(0, &db_path)?;
+        set_coin_lwd_url(0, &url);
+        // store a block every 10 blocks so that the sync finds the fork
+        set_checkpoint_policy(
+            0,
+            CheckpointPolicy {
+                interval: 10,
+                recent_depth: 100_000,
+                min_depth: 100,
+            },
+        );
+        let c = CoinConfig::get(0);
+
+        server.set_tip_height(start + 100);
+        coin_sync(0, false, 0, |_| {}, &CANCEL).await?;
+        check_notes(&chain, &*c.db()?, start + 100)?;
+
+        // the sync runs into the fork, rewinds to the stored block before it and resumes
+        server.reorg(10);
+        server.set_tip_height(tip);
+        coin_sync(0, false, 0, |_| {}, &CANCEL).await?;
+        check_notes(&chain, &*c.db()?, tip)?;
+
+        // rewinding removes the later notes and spends from the db and the caches
+        let unspent = c.get_spendable_notes(accounts[0], tip)?.len();
+        assert!(unspent > 0);
+        let height = rewind_to_fork(0, tip - 25)?;
+        assert!(height <= tip - 25);
+        check_notes(&chain, &*c.db()?, height)?;
+        let nullifiers = c.db()?.get_nullifiers()?;
+        {
+            let nf_index = c.nf_index()?;
+            for nf in nullifiers.keys() {
+                assert!(nf_index.get(nf).is_some());
+            }
+            for h in height + 1..=tip {
+                for (_, n) in chain.wallet_notes(h) {
+                    let nf = n.note.nf(&fvks[n.account].fvk.vk, n.position);
+                    assert!(nf_index.get(&Nf(nf.0)).is_none());
+                }
+            }
+        }
+        assert_eq!(
+            c.get_spendable_notes(accounts[0], height)?.len(),
+            nullifiers.len()
+        );
+
+        coin_sync(0, false, 0, |_| {}, &CANCEL).await?;
+        check_notes(&chain, &*c.db()?, tip)?;
+        let _ = std::fs::remove_file(&db_path);
+        Ok(())
+    }
+}
@@ -1,14 +1,17 @@
 use crate::advance_tree;
+use crate::checkpoint::CheckpointPolicy;
 use crate::commitment::{CTree, Witness};
-use crate::db::AccountViewKey;
+use crate::db::{AccountViewKey, DbAdapter};
 use crate::lw_rpc::compact_tx_streamer_client::CompactTxStreamerClient;
 use crate::lw_rpc::*;
 use crate::scan::{Blocks, MAX_OUTPUTS_PER_CHUNK};
 use ff::PrimeField;
 use futures::{future, FutureExt};
 use log::info;
+use prost::Message;
 use rayon::prelude::*;
-use std::collections::HashMap;
+use std::collections::{HashMap, VecDeque};
+use std::convert::TryInto;
 use std::marker::PhantomData;
 use std::sync::atomic::{AtomicBool, Ordering};
 use std::time::Duration;
@@ -59,6 +62,24 @@ pub async fn get_block_date(
     Ok(block.time)
 }
 
+/// Hash, time and commitment tree of the block at `height`
+pub async fn get_block_tree_state(
+    client: &mut CompactTxStreamerClient<Channel>,
+    height: u32,
+) -> anyhow::Result<(Vec<u8>, u32, CTree)> {
+    let block_id = BlockId {
+        height: height as u64,
+        hash: vec![],
+    };
+    let block = client.get_block(block_id.clone()).await?.into_inner();
+    let tree_state = client
+        .get_tree_state(Request::new(block_id))
+        .await?
+        .into_inner();
+    let tree = CTree::read(&*hex::decode(&tree_state.sapling_tree)?)?;
+    Ok((block.hash, block.time, tree))
+}
+
 pub async fn get_block_by_time(
     network: &Network,
     client: &mut CompactTxStreamerClient<Channel>,
@@ -89,23 +110,35 @@ pub async fn get_block_by_time(
 
 #[derive(Error, Debug)]
 pub enum ChainError {
+    /// Holds the latest stored block still on the chain, if it was found
     #[error("Blockchain reorganization")]
-    Reorg,
+    Reorg(Option<u32>),
     #[error("Synchronizer busy")]
     Busy,
+    #[error("Commitment tree mismatch")]
+    TreeMismatch,
 }
 
+/// Deepest reorg that the sync recovers from on its own
+const MAX_REORG_DEPTH: u32 = 100;
+
 /* download [start_height+1, end_height] inclusive */
+/// `stored_blocks` are the (height, hash) of the stored blocks, latest first.
+/// They locate the fork when the chain of the server does not continue `prev_hash`
 pub async fn download_chain(
     client: &mut CompactTxStreamerClient<Channel>,
     start_height: u32,
     end_height: u32,
     mut prev_hash: Option<[u8; 32]>,
+    stored_blocks: &[(u32, Vec<u8>)],
+    checkpoint_policy: &CheckpointPolicy,
     blocks_tx: Sender<Blocks>,
     cancel: &'static AtomicBool,
 ) -> anyhow::Result<()> {
     let mut output_count = 0;
+    let mut byte_count = 0;
     let mut cbs: Vec<CompactBlock> = Vec::new();
+    let mut downloaded: VecDeque<(u32, Vec<u8>)> = VecDeque::new();
     let range = BlockRange {
         start: Some(BlockId {
             height: (start_height + 1) as u64,
@@ -131,11 +164,18 @@ pub async fn download_chain(
                 hex::encode(block.prev_hash.as_slice()),
                 hex::encode(prev_hash.unwrap())
             );
-            anyhow::bail!(ChainError::Reorg);
+            let known = downloaded.iter().rev().chain(stored_blocks.iter());
+            let fork_height = find_fork_height(client, block.height as u32, known).await?;
+            anyhow::bail!(ChainError::Reorg(fork_height));
         }
         let mut ph = [0u8; 32];
         ph.copy_from_slice(&block.hash);
         prev_hash = Some(ph);
+        downloaded.push_back((block.height as u32, block.hash.clone()));
+        if downloaded.len() > MAX_REORG_DEPTH as usize {
+            downloaded.pop_front();
+        }
+        let block_byte_count = block.encoded_len();
         for b in block.vtx.iter_mut() {
             b.actions.clear(); // don't need Orchard actions
         }
@@ -145,17 +185,71 @@ pub async fn download_chain(
             // output
             let out = cbs;
             cbs = Vec::new();
-            blocks_tx.send(Blocks(out)).await.unwrap();
+            blocks_tx.send(Blocks::new(out, byte_count)).await.unwrap();
             output_count = 0;
+            byte_count = 0;
         }
 
+        let height = block.height as u32;
         cbs.push(block);
         output_count += block_output_count;
+        byte_count += block_byte_count;
+
+        // end the chunk so that the block is stored
+        if checkpoint_policy.is_checkpoint(height, end_height) {
+            let out = cbs;
+            cbs = Vec::new();
+            blocks_tx.send(Blocks::new(out, byte_count)).await.unwrap();
+            output_count = 0;
+            byte_count = 0;
+        }
     }
-    let _ = blocks_tx.send(Blocks(cbs)).await;
+    let _ = blocks_tx.send(Blocks::new(cbs, byte_count)).await;
     Ok(())
 }
 
+/// Latest of the `known` blocks below `height` that the server still has
+///
+/// The blocks of the server are fetched with a single range request
+async fn find_fork_height<'a>(
+    client: &mut CompactTxStreamerClient<Channel>,
+    height: u32,
+    known: impl Iterator<Item = &'a (u32, Vec<u8>)>,
+) -> anyhow::Result<Option<u32>> {
+    let min_height = height.saturating_sub(MAX_REORG_DEPTH).max(1);
+    let known: Vec<_> = known
+        .filter(|(h, _)| *h >= min_height && *h < height)
+        .collect();
+    let start = match known.iter().map(|(h, _)| *h).min() {
+        Some(start) => start,
+        None => return Ok(None),
+    };
+    let range = BlockRange {
+        start: Some(BlockId {
+            height: start as u64,
+            hash: vec![],
+        }),
+        end: Some(BlockId {
+            height: (height - 1) as u64,
+            hash: vec![],
+        }),
+    };
+    let mut block_stream = client
+        .get_block_range(Request::new(range))
+        .await?
+        .into_inner();
+    let mut hashes: HashMap<u32, Vec<u8>> = HashMap::new();
+    while let Some(block) = block_stream.message().await? {
+        hashes.insert(block.height as u32, block.hash);
+    }
+    let fork_height = known
+        .iter()
+        .filter(|(h, hash)| hashes.get(h) == Some(hash))
+        .map(|(h, _)| *h)
+        .max();
+    Ok(fork_height)
+}
+
 pub struct DecryptNode {
     vks: HashMap<u32, AccountViewKey>,
 }
@@ -167,6 +261,55 @@ pub struct Nf(pub [u8; 32]);
 pub struct NfRef {
     pub id_note: u32,
     pub account: u32,
+    pub value: u64,
+}
+
+/// Nullifiers of the unspent notes of every account
+///
+/// Shared by the sync engine and the mempool. It is loaded from the
+/// database once and then kept up to date as notes are received and spent.
+/// Operations that rewrite the notes table must call `invalidate`
+#[derive(Default)]
+pub struct NfIndex {
+    loaded: bool,
+    nfs: HashMap<Nf, NfRef>,
+}
+
+impl NfIndex {
+    /// Load the nullifiers from the database unless they already are
+    pub fn load(&mut self, db: &DbAdapter) -> anyhow::Result<()> {
+        if !self.loaded {
+            self.nfs = db.get_nullifiers()?;
+            self.loaded = true;
+        }
+        Ok(())
+    }
+
+    pub fn is_loaded(&self) -> bool {
+        self.loaded
+    }
+
+    pub fn invalidate(&mut self) {
+        self.nfs.clear();
+        self.loaded = false;
+    }
+
+    pub fn get(&self, nf: &Nf) -> Option<&NfRef> {
+        self.nfs.get(nf)
+    }
+
+    pub fn get_slice(&self, nf: &[u8]) -> Option<&NfRef> {
+        let nf: [u8; 32] = nf.try_into().ok()?;
+        self.nfs.get(&Nf(nf))
+    }
+
+    pub fn insert(&mut self, nf: Nf, nf_ref: NfRef) {
+        self.nfs.insert(nf, nf_ref);
+    }
+
+    pub fn remove(&mut self, nf: &Nf) -> Option<NfRef> {
+        self.nfs.remove(nf)
+    }
 }
 
 pub struct DecryptedBlock<'a> {
@@ -553,80 +696,92 @@ pub async fn get_best_server(servers: &[String]) -> Option<String> {
 
 #[cfg(test)]
 mod tests {
-    #[allow(unused_imports)]
-    use crate::chain::{
-        calculate_tree_state_v1, calculate_tree_state_v2, download_chain, get_latest_height,
-        get_tree_state, DecryptNode,
-    };
+    use crate::chain::{calculate_tree_state_v2, download_chain, get_latest_height, DecryptNode};
+    use crate::chain_gen::{ChainGenConfig, ChainGenerator};
+    use crate::checkpoint::CheckpointPolicy;
     use crate::db::AccountViewKey;
-    use crate::lw_rpc::compact_tx_streamer_client::CompactTxStreamerClient;
-    use crate::LWD_URL;
-
+    use crate::mock_lwd::{spawn_mock_lightwalletd, MockLightwalletd};
+    use crate::scan::Blocks;
+    use crate::{connect_lightwalletd, CompactBlock};
     use std::collections::HashMap;
+    use std::sync::atomic::AtomicBool;
+    use std::sync::Arc;
     use std::time::Instant;
-    use zcash_client_backend::encoding::decode_extended_full_viewing_key;
-    use zcash_primitives::consensus::{Network, NetworkUpgrade, Parameters};
+    use tokio::sync::mpsc;
+    use zcash_primitives::consensus::Network;
 
     const NETWORK: &Network = &Network::MainNetwork;
+    static CANCEL: AtomicBool = AtomicBool::new(false);
+
+    async fn mock_chain(wallet_output_rate: f64) -> anyhow::Result<(Arc<ChainGenerator>, String)> {
+        let config = ChainGenConfig {
+            block_count: 100,
+            outputs_per_block: 20,
+            wallet_output_rate,
+            ..ChainGenConfig::default()
+        };
+        let chain = Arc::new(ChainGenerator::new(
+            *NETWORK,
+            config,
+            ChainGenerator::test_fvks(1),
+        ));
+        let server = Arc::new(MockLightwalletd::new(*NETWORK, chain.clone()));
+        let url = spawn_mock_lightwalletd(server).await?;
+        Ok((chain, url))
+    }
 
     #[tokio::test]
     async fn test_get_latest_height() -> anyhow::Result<()> {
-        let mut client = CompactTxStreamerClient::connect(LWD_URL).await?;
+        let (chain, url) = mock_chain(0.0).await?;
+        let mut client = connect_lightwalletd(&url).await?;
         let height = get_latest_height(&mut client).await?;
-        assert!(height > 1288000);
+        assert_eq!(height, chain.tip_height());
         Ok(())
     }
 
     #[tokio::test]
     async fn test_download_chain() -> anyhow::Result<()> {
-        dotenv::dotenv().unwrap();
-        let fvk = dotenv::var("FVK").unwrap();
-
+        let (chain, url) = mock_chain(0.1).await?;
+        let fvk = ChainGenerator::test_fvks(1).remove(0);
         let mut fvks: HashMap<u32, AccountViewKey> = HashMap::new();
-        let fvk =
-            decode_extended_full_viewing_key(NETWORK.hrp_sapling_extended_full_viewing_key(), &fvk)
-                .unwrap()
-                .unwrap();
         fvks.insert(1, AccountViewKey::from_fvk(&fvk));
         let decrypter = DecryptNode::new(fvks);
-        let mut client = CompactTxStreamerClient::connect(LWD_URL).await?;
-        let start_height: u32 = NETWORK
-            .activation_height(NetworkUpgrade::Sapling)
-            .unwrap()
-            .into();
+        let mut client = connect_lightwalletd(&url).await?;
+        let start_height = chain.config.start_height;
         let end_height = get_latest_height(&mut client).await?;
 
         let start = Instant::now();
-        let cbs = download_chain(&mut client, start_height, end_height, None).await?;
+        let (blocks_tx, mut blocks_rx) = mpsc::channel::<Blocks>(1);
+        let downloader = tokio::spawn(async move {
+            download_chain(
+                &mut client,
+                start_height,
+                end_height,
+                None,
+                &[],
+                &CheckpointPolicy::default(),
+                blocks_tx,
+                &CANCEL,
+            )
+            .await
+        });
+        let mut cbs: Vec<CompactBlock> = vec![];
+        while let Some(blocks) = blocks_rx.recv().await {
+            cbs.extend(blocks.0);
+        }
+        downloader.await??;
         eprintln!("Download chain: {} ms", start.elapsed().as_millis());
+        assert_eq!(cbs.len() as u32, end_height - start_height);
 
         let start = Instant::now();
-        let blocks = decrypter.decrypt_blocks(&Network::MainNetwork, &cbs);
+        let blocks = decrypter.decrypt_blocks(NETWORK, &cbs);
         eprintln!("Decrypt Notes: {} ms", start.elapsed().as_millis());
 
-        // no need to calculate tree before the first note if we can
-        // get it from the server
-        // disabled because I want to see the performance of a complete scan
-
-        // let first_block = blocks.iter().find(|b| !b.notes.is_empty()).unwrap();
-        // let height = first_block.height - 1;
-        // let tree_state = get_tree_state(&mut client, height).await;
-        // let tree_state = hex::decode(tree_state).unwrap();
-        // let tree_state = CommitmentTree::<Node>::read(&*tree_state).unwrap();
-
-        // let witnesses = calculate_tree_state(&cbs, &blocks, 0, tree_state);
-
         let start = Instant::now();
         let witnesses = calculate_tree_state_v2(&cbs, &blocks);
         eprintln!("Tree State & Witnesses: {} ms", start.elapsed().as_millis());
-
-        eprintln!("# Witnesses {}", witnesses.len());
-        for w in witnesses.iter() {
-            let mut bb: Vec<u8> = vec![];
-            w.write(&mut bb).unwrap();
-            log::info!("{}", hex::encode(&bb));
-        }
-
+        assert!(!witnesses.is_empty());
+        assert_eq!(witnesses.len(), chain.wallet_note_count(end_height));
         Ok(())
     }
 }
@@ -0,0 +1,331 @@
+use crate::{CompactBlock, CompactSaplingOutput, CompactSaplingSpend, CompactTx};
+use blake2b_simd::Params;
+use ff::{Field, PrimeField};
+use group::{Group, GroupEncoding};
+use rand::{Rng, RngCore, SeedableRng};
+use rand_chacha::ChaCha20Rng;
+use rayon::prelude::*;
+use zcash_primitives::consensus::{BlockHeight, Network, NetworkUpgrade, Parameters};
+use zcash_primitives::memo::Memo;
+use zcash_primitives::sapling::note_encryption::sapling_note_encryption;
+use zcash_primitives::sapling::{Note, PaymentAddress, Rseed};
+use zcash_primitives::zip32::{ExtendedFullViewingKey, ExtendedSpendingKey};
+
+const COMPACT_CIPHERTEXT_SIZE: usize = 52;
+const EPK_POOL_SIZE: usize = 1024;
+const BLOCK_INTERVAL: u32 = 75;
+
+/// Shape of a synthetic chain
+#[derive(Clone, Debug)]
+pub struct ChainGenConfig {
+    pub seed: u64,
+    /// The chain continues an empty commitment tree at this height
+    pub start_height: u32,
+    pub start_time: u32,
+    pub block_count: u32,
+    pub outputs_per_block: u32,
+    pub outputs_per_tx: u32,
+    /// Spends of notes that are not ours
+    pub spends_per_block: u32,
+    /// Fraction of the outputs that go to the test accounts
+    pub wallet_output_rate: f64,
+    /// Number of blocks after which a note of the test accounts is spent, 0 to keep them
+    pub wallet_spend_delay: u32,
+    pub note_value: u64,
+}
+
+impl Default for ChainGenConfig {
+    fn default() -> Self {
+        ChainGenConfig {
+            seed: 0,
+            start_height: 419_200,
+            start_time: 1_540_779_337,
+            block_count: 10_000,
+            outputs_per_block: 100,
+            outputs_per_tx: 2,
+            spends_per_block: 50,
+            wallet_output_rate: 0.01,
+            wallet_spend_delay: 0,
+            note_value: 10_000,
+        }
+    }
+}
+
+/// Note of a test account created by the generator
+pub struct WalletNote {
+    pub account: usize,
+    pub position: u64,
+    pub note: Note,
+}
+
+/// Deterministic generator of compact blocks
+///
+/// Every block is derived from the seed and its height only, so that blocks can be
+/// generated in any order and in parallel. The outputs of the test accounts are
+/// encrypted like real notes and their spends use their real nullifiers.
+/// The other outputs have valid commitments and ephemeral keys but random ciphertexts
+pub struct ChainGenerator {
+    pub config: ChainGenConfig,
+    network: Network,
+    fvks: Vec<ExtendedFullViewingKey>,
+    addresses: Vec<PaymentAddress>,
+    epks: Vec<[u8; 32]>,
+}
+
+impl ChainGenerator {
+    pub fn new(
+        network: Network,
+        config: ChainGenConfig,
+        fvks: Vec<ExtendedFullViewingKey>,
+    ) -> Self {
+        let addresses = fvks.iter().map(|fvk| fvk.default_address().1).collect();
+        let mut rng = ChaCha20Rng::seed_from_u64(config.seed);
+        let epks = (0..EPK_POOL_SIZE)
+            .map(|_| jubjub::SubgroupPoint::random(&mut rng).to_bytes())
+            .collect();
+        ChainGenerator {
+            config,
+            network,
+            fvks,
+            addresses,
+            epks,
+        }
+    }
+
+    /// Viewing keys of `count` test accounts
+    pub fn test_fvks(count: u32) -> Vec<ExtendedFullViewingKey> {
+        (0..count)
+            .map(|i| {
+                let mut seed = [0u8; 32];
+                seed[..4].copy_from_slice(&i.to_le_bytes());
+                ExtendedFullViewingKey::from(&ExtendedSpendingKey::master(&seed))
+            })
+            .collect()
+    }
+
+    pub fn tip_height(&self) -> u32 {
+        self.config.start_height + self.config.block_count
+    }
+
+    pub fn contains(&self, height: u32) -> bool {
+        height > self.config.start_height && height <= self.tip_height()
+    }
+
+    pub fn block_hash(&self, height: u32) -> [u8; 32] {
+        let mut data = [0u8; 12];
+        data[..8].copy_from_slice(&self.config.seed.to_le_bytes());
+        data[8..].copy_from_slice(&height.to_le_bytes());
+        let hash = Params::new()
+            .hash_length(32)
+            .personal(b"WarpChainGenHash")
+            .hash(&data);
+        let mut h = [0u8; 32];
+        h.copy_from_slice(hash.as_bytes());
+        h
+    }
+
+    pub fn block_time(&self, height: u32) -> u32 {
+        self.config.start_time + (height - self.config.start_height) * BLOCK_INTERVAL
+    }
+
+    fn rng(&self, height: u32, stream: u64) -> ChaCha20Rng {
+        let mut rng = ChaCha20Rng::seed_from_u64(self.config.seed);
+        rng.set_stream(height as u64 * 2 + stream);
+        rng
+    }
+
+    fn first_position(&self, height: u32) -> u64 {
+        (height - self.config.start_height - 1) as u64 * self.config.outputs_per_block as u64
+    }
+
+    /// Outputs of the block that belong to the test accounts, by index in the block
+    pub fn wallet_notes(&self, height: u32) -> Vec<(usize, WalletNote)> {
+        if self.fvks.is_empty() {
+            return vec![];
+        }
+        let mut rng = self.rng(height, 0);
+        let zip212 = self
+            .network
+            .is_nu_active(NetworkUpgrade::Canopy, BlockHeight::from_u32(height));
+        let first_position = self.first_position(height);
+        let mut notes = vec![];
+        for i in 0..self.config.outputs_per_block as usize {
+            if !rng.gen_bool(self.config.wallet_output_rate) {
+                continue;
+            }
+            let account = rng.gen_range(0..self.fvks.len());
+            let rseed = if zip212 {
+                let mut rseed = [0u8; 32];
+                rng.fill_bytes(&mut rseed);
+                Rseed::AfterZip212(rseed)
+            } else {
+                Rseed::BeforeZip212(jubjub::Fr::random(&mut rng))
+            };
+            let note = self.addresses[account]
+                .create_note(self.config.note_value, rseed)
+                .unwrap();
+            notes.push((
+                i,
+                WalletNote {
+                    account,
+                    position: first_position + i as u64,
+                    note,
+                },
+            ));
+        }
+        notes
+    }
+
+    /// Nullifiers of the test account notes spent in the block
+    fn wallet_spends(&self, height: u32) -> Vec<[u8; 32]> {
+        let delay = self.config.wallet_spend_delay;
+        if delay == 0 || height <= self.config.start_height + delay {
+            return vec![];
+        }
+        self.wallet_notes(height - delay)
+            .iter()
+            .map(|(_, n)| {
+                let fvk = &self.fvks[n.account];
+                n.note.nf(&fvk.fvk.vk, n.position).0
+            })
+            .collect()
+    }
+
+    /// Number of notes of the test accounts spent in the chain
+    pub fn wallet_spent_count(&self) -> usize {
+        match self.config.wallet_spend_delay {
+            0 => 0,
+            delay => self.wallet_note_count(self.tip_height().saturating_sub(delay)),
+        }
+    }
+
+    pub fn block(&self, height: u32) -> CompactBlock {
+        let mut rng = self.rng(height, 1);
+        let mut wallet_notes = self.wallet_notes(height).into_iter().peekable();
+        let mut outputs = vec![];
+        for i in 0..self.config.outputs_per_block as usize {
+            let output = match wallet_notes.peek() {
+                Some((index, _)) if *index == i => {
+                    let (_, n) = wallet_notes.next().unwrap();
+                    self.encrypt(&n, &mut rng)
+                }
+                _ => {
+                    let mut ciphertext = vec![0u8; COMPACT_CIPHERTEXT_SIZE];
+                    rng.fill_bytes(&mut ciphertext);
+                    CompactSaplingOutput {
+                        cmu: bls12_381::Scalar::random(&mut rng).to_repr().to_vec(),
+                        epk: self.epks[rng.gen_range(0..self.epks.len())].to_vec(),
+                        ciphertext,
+                    }
+                }
+            };
+            outputs.push(output);
+        }
+
+        let mut spends: Vec<CompactSaplingSpend> = self
+            .wallet_spends(height)
+            .iter()
+            .map(|nf| CompactSaplingSpend { nf: nf.to_vec() })
+            .collect();
+        for _ in 0..self.config.spends_per_block {
+            let mut nf = vec![0u8; 32];
+            rng.fill_bytes(&mut nf);
+            spends.push(CompactSaplingSpend { nf });
+        }
+
+        let outputs_per_tx = self.config.outputs_per_tx.max(1) as usize;
+        let mut vtx: Vec<CompactTx> = outputs
+            .chunks(outputs_per_tx)
+            .map(|outputs| CompactTx {
+                outputs: outputs.to_vec(),
+                ..CompactTx::default()
+            })
+            .collect();
+        if vtx.is_empty() {
+            vtx.push(CompactTx::default());
+        }
+        vtx[0].spends = spends;
+        for (index, tx) in vtx.iter_mut().enumerate() {
+            let mut hash = vec![0u8; 32];
+            rng.fill_bytes(&mut hash);
+            tx.index = index as u64;
+            tx.hash = hash;
+        }
+
+        CompactBlock {
+            height: height as u64,
+            hash: self.block_hash(height).to_vec(),
+            prev_hash: self.block_hash(height - 1).to_vec(),
+            time: self.block_time(height),
+            vtx,
+            ..CompactBlock::default()
+        }
+    }
+
+    /// Blocks in `[start, end]`, generated in parallel
+    pub fn blocks(&self, start: u32, end: u32) -> Vec<CompactBlock> {
+        (start..=end)
+            .into_par_iter()
+            .map(|height| self.block(height))
+            .collect()
+    }
+
+    fn encrypt(&self, n: &WalletNote, rng: &mut ChaCha20Rng) -> CompactSaplingOutput {
+        let encryptor = sapling_note_encryption::<_, Network>(
+            None,
+            n.note.clone(),
+            self.addresses[n.account].clone(),
+            Memo::Empty.encode(),
+            rng,
+        );
+        let enc_ciphertext = encryptor.encrypt_note_plaintext();
+        CompactSaplingOutput {
+            cmu: n.note.cmu().to_repr().to_vec(),
+            epk: encryptor.epk().to_bytes().to_vec(),
+            ciphertext: enc_ciphertext[..COMPACT_CIPHERTEXT_SIZE].to_vec(),
+        }
+    }
+
+    /// Number of notes of the test accounts received up to `height`, spent or not
+    pub fn wallet_note_count(&self, height: u32) -> usize {
+        (self.config.start_height + 1..=height.min(self.tip_height()))
+            .into_par_iter()
+            .map(|height| self.wallet_notes(height).len())
+            .sum()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{AccountViewKey, DecryptNode};
+    use std::collections::HashMap;
+
+    #[test]
+    fn test_generated_notes_decrypt() {
+        let config = ChainGenConfig {
+            block_count: 20,
+            outputs_per_block: 20,
+            wallet_output_rate: 0.1,
+            ..ChainGenConfig::default()
+        };
+        let fvks = ChainGenerator::test_fvks(2);
+        let chain = ChainGenerator::new(Network::MainNetwork, config, fvks.clone());
+        let blocks = chain.blocks(chain.config.start_height + 1, chain.tip_height());
+        assert_eq!(blocks[3], chain.block(chain.config.start_height + 4));
+
+        let vks: HashMap<u32, AccountViewKey> = fvks
+            .iter()
+            .enumerate()
+            .map(|(i, fvk)| (i as u32, AccountViewKey::from_fvk(fvk)))
+            .collect();
+        let decrypter = DecryptNode::new(vks);
+        let found: usize = decrypter
+            .decrypt_blocks(&Network::MainNetwork, &blocks)
+            .iter()
+            .map(|b| b.notes.len())
+            .sum();
+        assert!(found > 0);
+        assert_eq!(found, chain.wallet_note_count(chain.tip_height()));
+    }
+}
@@ -0,0 +1,166 @@
+use serde::{Deserialize, Serialize};
+use std::collections::HashSet;
+
+/// Spacing of the blocks that keep their witnesses, relative to the kept blocks
+const WITNESS_SPACING: u32 = 10;
+
+/// Which stored blocks (tree and witnesses) are kept after a sync
+///
+/// Every block of the last `min_depth` blocks is kept. Below that, one block per
+/// `interval` down to `recent_depth`, then the spacing quadruples every time the
+/// depth doubles. The sync splits its chunks at multiples of `interval` in the
+/// recent range so that these blocks exist
+///
+/// Only one in `WITNESS_SPACING` of them also keeps the witnesses of the unspent
+/// notes. The others keep their hash and tree frontier, to find forks
+#[derive(Clone, Copy, Debug, Serialize, Deserialize)]
+pub struct CheckpointPolicy {
+    pub interval: u32,
+    pub recent_depth: u32,
+    pub min_depth: u32,
+}
+
+impl Default for CheckpointPolicy {
+    fn default() -> Self {
+        CheckpointPolicy {
+            interval: 1_000,
+            recent_depth: 100_000,
+            min_depth: 100,
+        }
+    }
+}
+
+impl CheckpointPolicy {
+    /// Whether the sync should store the block at `height`
+    pub fn is_checkpoint(&self, height: u32, end_height: u32) -> bool {
+        self.interval != 0
+            && height % self.interval == 0
+            && end_height.saturating_sub(height) <= self.recent_depth
+    }
+
+    /// Heights to keep among `heights`, sorted in increasing order
+    ///
+    /// The oldest block of each interval is kept. The latest block is always kept
+    pub fn checkpoints_to_keep(&self, heights: &[u32], tip: u32) -> Vec<u32> {
+        let mut buckets: HashSet<(u32, u32)> = HashSet::new();
+        let mut keep = vec![];
+        for &height in heights.iter() {
+            let depth = tip.saturating_sub(height);
+            if depth <= self.min_depth || buckets.insert(self.bucket(height, depth)) {
+                keep.push(height);
+            }
+        }
+        if let Some(&latest) = heights.last() {
+            if keep.last() != Some(&latest) {
+                keep.push(latest);
+            }
+        }
+        keep
+    }
+
+    /// Heights among `heights` that keep their witnesses, sorted in increasing order
+    ///
+    /// `heights` are the stored blocks that still have their witnesses. One block
+    /// per `min_depth / WITNESS_SPACING` in the last `min_depth` blocks, then the
+    /// same spacing as the kept blocks with a `WITNESS_SPACING` times larger interval.
+    /// The latest block is always kept
+    pub fn witnesses_to_keep(&self, heights: &[u32], tip: u32) -> Vec<u32> {
+        let sparse = CheckpointPolicy {
+            interval: self.interval.saturating_mul(WITNESS_SPACING),
+            ..*self
+        };
+        let recent_interval = (self.min_depth / WITNESS_SPACING).max(1);
+        let mut buckets: HashSet<(u32, u32)> = HashSet::new();
+        let mut keep = vec![];
+        for &height in heights.iter() {
+            let depth = tip.saturating_sub(height);
+            let bucket = if depth <= self.min_depth {
+                (0, height / recent_interval)
+            } else {
+                sparse.bucket(height, depth)
+            };
+            if buckets.insert(bucket) {
+                keep.push(height);
+            }
+        }
+        if let Some(&latest) = heights.last() {
+            if keep.last() != Some(&latest) {
+                keep.push(latest);
+            }
+        }
+        keep
+    }
+
+    fn bucket(&self, height: u32, depth: u32) -> (u32, u32) {
+        let mut size = self.interval.max(1);
+        let mut d = self.recent_depth.max(1);
+        while d < depth {
+            d = d.saturating_mul(2);
+            size = size.saturating_mul(4);
+        }
+        (size, height / size)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_checkpoint_retention() {
+        let policy = CheckpointPolicy::default();
+        let tip = 2_000_000;
+        let heights: Vec<u32> = (0..=tip).step_by(100).collect();
+        let keep = policy.checkpoints_to_keep(&heights, tip);
+
+        assert_eq!(keep.last(), Some(&tip));
+        // the last 100 blocks
+        assert!(keep.contains(&(tip - 100)));
+        // one block per 1000 in the last 100k
+        assert!(keep.contains(&(tip - 50_000)));
+        assert!(!keep.contains(&(tip - 50_100)));
+        let recent = keep.iter().filter(|&&h| h >= tip - 100_000).count();
+        assert!(recent <= 100 + 2);
+        // much sparser further back
+        let old = keep.iter().filter(|&&h| h < tip - 100_000).count();
+        assert!(old < 60);
+
+        // the same blocks are kept by the next purge
+        let keep2 = policy.checkpoints_to_keep(&keep, tip);
+        assert_eq!(keep, keep2);
+    }
+
+    #[test]
+    fn test_witness_retention() {
+        let policy = CheckpointPolicy::default();
+        let tip = 2_000_000;
+        let mut heights: Vec<u32> = (0..tip - 100).step_by(100).collect();
+        heights.extend(tip - 100..=tip);
+        let keep = policy.checkpoints_to_keep(&heights, tip);
+        let witnesses = policy.witnesses_to_keep(&keep, tip);
+
+        assert_eq!(witnesses.last(), Some(&tip));
+        assert!(witnesses.iter().all(|h| keep.contains(h)));
+        // one block per 10 in the last 100
+        let last = witnesses.iter().filter(|&&h| h >= tip - 100).count();
+        assert!((10..=12).contains(&last));
+        // one block per 10k in the last 100k
+        assert!(witnesses.contains(&(tip - 50_000)));
+        assert!(!witnesses.contains(&(tip - 51_000)));
+        let recent = witnesses
+            .iter()
+            .filter(|&&h| h < tip - 100 && h >= tip - 100_000)
+            .count();
+        assert!(recent <= 11);
+        assert!(witnesses.len() * 5 < keep.len());
+
+        // the next purge only sees the blocks with witnesses and keeps them
+        let witnesses2 = policy.witnesses_to_keep(&witnesses, tip);
+        assert_eq!(witnesses, witnesses2);
+        // older blocks lose their witnesses as the tip moves but some remain
+        let tip2 = tip + 5_000;
+        let witnesses3 = policy.witnesses_to_keep(&witnesses, tip2);
+        assert!(witnesses3.contains(&tip));
+        assert!(witnesses3.contains(&(tip - 50_000)));
+    }
+}
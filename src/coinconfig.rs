@@ -1,20 +1,27 @@
+use crate::address_cache::AddressCache;
+use crate::chain::NfIndex;
+use crate::checkpoint::CheckpointPolicy;
+use crate::db::SpendableNote;
+use crate::note_cache::NoteCache;
+use crate::prover::{params_hash, SaplingProver};
+use crate::scan::RECENT_FIRST_BLOCKS;
+use crate::sync_metrics::SyncMetrics;
 use crate::{connect_lightwalletd, CompactTxStreamerClient, DbAdapter, FountainCodes, MemPool};
 use anyhow::anyhow;
 use lazy_static::lazy_static;
-use lazycell::AtomicLazyCell;
 use std::sync::atomic::{AtomicU8, Ordering};
 use std::sync::{Arc, Mutex, MutexGuard};
 use tonic::transport::Channel;
 use zcash_params::coin::{get_coin_chain, CoinChain, CoinType};
 use zcash_params::{OUTPUT_PARAMS, SPEND_PARAMS};
-use zcash_proofs::prover::LocalTxProver;
 
 lazy_static! {
     pub static ref COIN_CONFIG: [Mutex<CoinConfig>; 2] = [
         Mutex::new(CoinConfig::new(0, CoinType::Zcash)),
         Mutex::new(CoinConfig::new(1, CoinType::Ycash)),
     ];
-    pub static ref PROVER: AtomicLazyCell<LocalTxProver> = AtomicLazyCell::new();
+    pub static ref PROVER: SaplingProver = load_prover();
+    static ref PROVER_CACHE_PATH: Mutex<Option<String>> = Mutex::new(None);
     pub static ref RAPTORQ: Mutex<FountainCodes> = Mutex::new(FountainCodes::new());
 }
 
@@ -31,7 +38,12 @@ pub fn set_active_account(coin: u8, id: u32) {
         c.mempool.clone()
     };
     let mut mempool = mempool.lock().unwrap();
-    let _ = mempool.clear();
+    let _ = mempool.set_account(id);
+}
+
+pub fn set_coin_height(coin: u8, height: u32) {
+    let mut c = COIN_CONFIG[coin as usize].lock().unwrap();
+    c.height = height;
 }
 
 pub fn set_coin_lwd_url(coin: u8, lwd_url: &str) {
@@ -39,6 +51,17 @@ pub fn set_coin_lwd_url(coin: u8, lwd_url: &str) {
     c.lwd_url = Some(lwd_url.to_string());
 }
 
+pub fn set_checkpoint_policy(coin: u8, policy: CheckpointPolicy) {
+    let mut c = COIN_CONFIG[coin as usize].lock().unwrap();
+    c.checkpoint_policy = policy;
+}
+
+/// Scan the last `blocks` blocks first when the wallet is further behind, 0 to disable
+pub fn set_recent_first_blocks(coin: u8, blocks: u32) {
+    let mut c = COIN_CONFIG[coin as usize].lock().unwrap();
+    c.recent_first_blocks = blocks;
+}
+
 pub fn get_coin_lwd_url(coin: u8) -> String {
     let c = COIN_CONFIG[coin as usize].lock().unwrap();
     c.lwd_url.clone().unwrap_or_default()
@@ -50,6 +73,11 @@ pub fn init_coin(coin: u8, db_path: &str) -> anyhow::Result<()> {
     Ok(())
 }
 
+/// Settings and shared state of a coin
+///
+/// The locks are always taken in this order: `mempool`, `db`, `nf_index`,
+/// `note_cache`, `address_cache`. A lock may be skipped but never taken
+/// while holding one that comes after it
 #[derive(Clone)]
 pub struct CoinConfig {
     pub coin: u8,
@@ -59,6 +87,12 @@ pub struct CoinConfig {
     pub lwd_url: Option<String>,
     pub db_path: Option<String>,
     pub mempool: Arc<Mutex<MemPool>>,
+    pub nf_index: Arc<Mutex<NfIndex>>,
+    pub note_cache: Arc<Mutex<NoteCache>>,
+    pub address_cache: Arc<Mutex<AddressCache>>,
+    pub sync_metrics: Arc<Mutex<SyncMetrics>>,
+    pub checkpoint_policy: CheckpointPolicy,
+    pub recent_first_blocks: u32,
     pub db: Option<Arc<Mutex<DbAdapter>>>,
     pub chain: &'static (dyn CoinChain + Send),
 }
@@ -75,6 +109,12 @@ impl CoinConfig {
             db_path: None,
             db: None,
             mempool: Arc::new(Mutex::new(MemPool::new(coin))),
+            nf_index: Arc::new(Mutex::new(NfIndex::default())),
+            note_cache: Arc::new(Mutex::new(NoteCache::default())),
+            address_cache: Arc::new(Mutex::new(AddressCache::default())),
+            sync_metrics: Arc::new(Mutex::new(SyncMetrics::default())),
+            checkpoint_policy: CheckpointPolicy::default(),
+            recent_first_blocks: RECENT_FIRST_BLOCKS,
             chain,
         }
     }
@@ -84,6 +124,9 @@ impl CoinConfig {
         let db = DbAdapter::new(self.coin_type, db_path)?;
         db.init_db()?;
         self.db = Some(Arc::new(Mutex::new(db)));
+        self.nf_index = Arc::new(Mutex::new(NfIndex::default()));
+        self.note_cache = Arc::new(Mutex::new(NoteCache::default()));
+        self.address_cache = Arc::new(Mutex::new(AddressCache::default()));
         Ok(())
     }
 
@@ -108,6 +151,34 @@ impl CoinConfig {
         self.mempool.lock().unwrap()
     }
 
+    /// Nullifier index loaded from the database on first use
+    ///
+    /// The db is only locked when the index must be loaded
+    pub fn nf_index(&self) -> anyhow::Result<MutexGuard<NfIndex>> {
+        {
+            let nf_index = self.nf_index.lock().unwrap();
+            if nf_index.is_loaded() {
+                return Ok(nf_index);
+            }
+        }
+        let db = self.db()?;
+        let mut nf_index = self.nf_index.lock().unwrap();
+        nf_index.load(&db)?;
+        Ok(nf_index)
+    }
+
+    /// Notes of an account that can be spent at `anchor_height`
+    pub fn get_spendable_notes(
+        &self,
+        account: u32,
+        anchor_height: u32,
+    ) -> anyhow::Result<Vec<SpendableNote>> {
+        let db = self.db()?;
+        let mut note_cache = self.note_cache.lock().unwrap();
+        let mut address_cache = self.address_cache.lock().unwrap();
+        note_cache.get_spendable_notes(&db, &mut address_cache, account, anchor_height)
+    }
+
     pub fn db(&self) -> anyhow::Result<MutexGuard<DbAdapter>> {
         let db = self.db.as_ref().unwrap();
         let db = db.lock().unwrap();
@@ -123,9 +194,44 @@ impl CoinConfig {
     }
 }
 
-pub fn get_prover() -> &'static LocalTxProver {
-    if !PROVER.filled() {
-        let _ = PROVER.fill(LocalTxProver::from_bytes(SPEND_PARAMS, OUTPUT_PARAMS));
+/// Keep a deserialized copy of the prover parameters at `path`
+///
+/// Must be called before the prover is first used
+pub fn set_prover_cache_path(path: &str) {
+    let mut cache_path = PROVER_CACHE_PATH.lock().unwrap();
+    *cache_path = Some(path.to_string());
+}
+
+/// Load the prover parameters on a background thread so that the
+/// first payment does not have to wait for them
+pub fn prewarm_prover() {
+    std::thread::spawn(|| {
+        let _ = get_prover();
+        log::info!("Prover ready");
+    });
+}
+
+pub fn get_prover() -> &'static SaplingProver {
+    &PROVER
+}
+
+fn load_prover() -> SaplingProver {
+    let cache_path = PROVER_CACHE_PATH.lock().unwrap().clone();
+    match cache_path {
+        Some(cache_path) => {
+            let params_hash = params_hash(SPEND_PARAMS, OUTPUT_PARAMS);
+            match SaplingProver::from_cache(&cache_path, params_hash.as_bytes()) {
+                Ok(prover) => prover,
+                Err(err) => {
+                    log::info!("Prover cache not loaded: {}", err);
+                    let prover = SaplingProver::from_bytes(SPEND_PARAMS, OUTPUT_PARAMS);
+                    if let Err(err) = prover.write_cache(&cache_path, params_hash.as_bytes()) {
+                        log::warn!("Cannot write prover cache: {}", err);
+                    }
+                    prover
+                }
+            }
+        }
+        None => SaplingProver::from_bytes(SPEND_PARAMS, OUTPUT_PARAMS),
     }
-    PROVER.borrow().unwrap()
 }
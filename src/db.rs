@@ -1,13 +1,16 @@
+use crate::address_cache::{from_diversifier_index, AddressCache, DiversifiedAddress};
 use crate::chain::{Nf, NfRef};
+use crate::checkpoint::CheckpointPolicy;
 use crate::contact::Contact;
 use crate::prices::Quote;
 use crate::taddr::{derive_tkeys, TBalance};
 use crate::transaction::TransactionInfo;
 use crate::{CTree, Witness};
+use group::GroupEncoding;
 use rusqlite::{params, Connection, OptionalExtension, Transaction};
 use serde::{Deserialize, Serialize};
-use std::collections::HashMap;
-use zcash_client_backend::encoding::decode_extended_full_viewing_key;
+use std::collections::{HashMap, HashSet};
+use zcash_client_backend::encoding::{decode_extended_full_viewing_key, encode_payment_address};
 use zcash_params::coin::{get_coin_chain, get_coin_id, CoinType};
 use zcash_primitives::consensus::{Network, NetworkUpgrade, Parameters};
 use zcash_primitives::merkle_tree::IncrementalWitness;
@@ -35,6 +38,16 @@ pub struct ReceivedNote {
     pub spent: Option<u32>,
 }
 
+#[derive(Serialize, Debug)]
+pub struct InvoicePayment {
+    pub id_note: u32,
+    pub account: u32,
+    pub tx_id: String,
+    pub height: u32,
+    pub value: u64,
+    pub spent: bool,
+}
+
 #[derive(Clone)]
 pub struct SpendableNote {
     pub id: u32,
@@ -43,6 +56,7 @@ pub struct SpendableNote {
     pub witness: IncrementalWitness<Node>,
 }
 
+#[derive(Clone)]
 pub struct AccountViewKey {
     pub fvk: ExtendedFullViewingKey,
     pub ivk: SaplingIvk,
@@ -129,6 +143,32 @@ impl DbAdapter {
         Ok((id_account, exists))
     }
 
+    pub fn store_birth_height(&self, account: u32, height: u32) -> anyhow::Result<()> {
+        self.connection.execute(
+            "INSERT INTO account_birthdays(account, height) VALUES (?1, ?2)
+            ON CONFLICT (account) DO UPDATE SET height = excluded.height",
+            params![account, height],
+        )?;
+        Ok(())
+    }
+
+    /// Height of the first block that can have notes of any account
+    ///
+    /// None if there is an account without a birthday
+    pub fn get_birth_height(&self) -> anyhow::Result<Option<u32>> {
+        let height = self.connection.query_row(
+            "SELECT MIN(b.height), COUNT(*) - COUNT(b.height) FROM accounts a
+            LEFT JOIN account_birthdays b ON a.id_account = b.account",
+            [],
+            |row| {
+                let height: Option<u32> = row.get(0)?;
+                let missing: u32 = row.get(1)?;
+                Ok(if missing == 0 { height } else { None })
+            },
+        )?;
+        Ok(height)
+    }
+
     pub fn next_account_id(&self, seed: &str) -> anyhow::Result<u32> {
         let index = self.connection.query_row(
             "SELECT MAX(aindex) FROM accounts WHERE seed = ?1",
@@ -186,8 +226,23 @@ impl DbAdapter {
         Ok(fvks)
     }
 
-    pub fn trim_to_height(&mut self, height: u32) -> anyhow::Result<()> {
+    /// Height from which `trim_to_height(height)` deletes the data
+    pub fn get_trim_height(&self, height: u32) -> anyhow::Result<u32> {
+        let height = match self.get_backfill()? {
+            Some((start_height, _)) => height.min(start_height + 1),
+            None => height,
+        };
+        Ok(height)
+    }
+
+    /// Delete the data of the blocks from `height`
+    ///
+    /// During a backfill, everything after the last complete block is deleted
+    /// and the backfill is abandoned. Returns the height the data was deleted from
+    pub fn trim_to_height(&mut self, height: u32) -> anyhow::Result<u32> {
+        let height = self.get_trim_height(height)?;
         let tx = self.connection.transaction()?;
+        tx.execute("DELETE FROM backfill", [])?;
         tx.execute("DELETE FROM blocks WHERE height >= ?1", params![height])?;
         tx.execute(
             "DELETE FROM sapling_witnesses WHERE height >= ?1",
@@ -206,9 +261,58 @@ impl DbAdapter {
             params![height],
         )?;
         tx.execute("DELETE FROM messages WHERE height >= ?1", params![height])?;
+        tx.execute(
+            "DELETE FROM invoice_payments WHERE height >= ?1",
+            params![height],
+        )?;
         tx.commit()?;
 
-        Ok(())
+        Ok(height)
+    }
+
+    /// Nullifiers that deleting the data from `height` removes from the unspent notes,
+    /// and the ones it adds back because their spend is deleted
+    pub fn get_trimmed_nullifiers(
+        &self,
+        height: u32,
+    ) -> anyhow::Result<(Vec<Nf>, Vec<(Nf, NfRef)>)> {
+        let mut statement = self
+            .connection
+            .prepare("SELECT nf FROM received_notes WHERE height >= ?1")?;
+        let rows = statement.query_map(params![height], |row| {
+            let nf: Vec<u8> = row.get(0)?;
+            Ok(nf)
+        })?;
+        let mut removed = vec![];
+        for r in rows {
+            let mut nf = [0u8; 32];
+            nf.copy_from_slice(&r?);
+            removed.push(Nf(nf));
+        }
+
+        let mut statement = self.connection.prepare(
+            "SELECT id_note, account, value, nf FROM received_notes WHERE height < ?1 AND spent >= ?1",
+        )?;
+        let rows = statement.query_map(params![height], |row| {
+            let id_note: u32 = row.get(0)?;
+            let account: u32 = row.get(1)?;
+            let value: i64 = row.get(2)?;
+            let nf: Vec<u8> = row.get(3)?;
+            Ok((id_note, account, value, nf))
+        })?;
+        let mut restored = vec![];
+        for r in rows {
+            let (id_note, account, value, nf_vec) = r?;
+            let mut nf = [0u8; 32];
+            nf.copy_from_slice(&nf_vec);
+            let nf_ref = NfRef {
+                id_note,
+                account,
+                value: value as u64,
+            };
+            restored.push((Nf(nf), nf_ref));
+        }
+        Ok((removed, restored))
     }
 
     pub fn get_txhash(&self, id_tx: u32) -> anyhow::Result<(u32, u32, u32, Vec<u8>, String)> {
@@ -290,6 +394,23 @@ impl DbAdapter {
         Ok(id_note)
     }
 
+    /// Link a new note to the invoice of its address, if any
+    pub fn store_invoice_payment(
+        id_note: u32,
+        account: u32,
+        height: u32,
+        diversifier: &[u8],
+        db_tx: &Transaction,
+    ) -> anyhow::Result<()> {
+        db_tx.execute(
+            "INSERT INTO invoice_payments(id_note, account, invoice, height)
+            SELECT ?1, ?2, invoice, ?3 FROM invoices WHERE account = ?2 AND diversifier = ?4
+            ON CONFLICT DO NOTHING",
+            params![id_note, account, height, diversifier],
+        )?;
+        Ok(())
+    }
+
     pub fn store_witnesses(
         connection: &Connection,
         witness: &Witness,
@@ -379,14 +500,45 @@ impl DbAdapter {
         }))
     }
 
+    /// Heights and hashes of the stored blocks, latest first
+    pub fn get_checkpoints(&self) -> anyhow::Result<Vec<(u32, Vec<u8>)>> {
+        let mut statement = self
+            .connection
+            .prepare("SELECT height, hash FROM blocks ORDER BY height DESC")?;
+        let rows = statement.query_map([], |row| {
+            let height: u32 = row.get(0)?;
+            let hash: Vec<u8> = row.get(1)?;
+            Ok((height, hash))
+        })?;
+        let mut checkpoints = vec![];
+        for r in rows {
+            checkpoints.push(r?);
+        }
+        Ok(checkpoints)
+    }
+
     pub fn get_tree(&self) -> anyhow::Result<(CTree, Vec<Witness>)> {
-        let res = self.connection.query_row(
-            "SELECT height, sapling_tree FROM blocks WHERE height = (SELECT MAX(height) FROM blocks)",
-            [], |row| {
-                let height: u32 = row.get(0)?;
-                let tree: Vec<u8> = row.get(1)?;
-                Ok((height, tree))
-            }).optional()?;
+        let height = self.get_last_sync_height()?;
+        match height {
+            Some(height) => self.get_tree_at(height),
+            None => Ok((CTree::new(), vec![])),
+        }
+    }
+
+    /// Tree of a stored block and the witnesses of the notes unspent at that height
+    pub fn get_tree_at(&self, height: u32) -> anyhow::Result<(CTree, Vec<Witness>)> {
+        let res = self
+            .connection
+            .query_row(
+                "SELECT height, sapling_tree FROM blocks WHERE height = ?1",
+                params![height],
+                |row| {
+                    let height: u32 = row.get(0)?;
+                    let tree: Vec<u8> = row.get(1)?;
+                    Ok((height, tree))
+                },
+            )
+            .optional()?;
         Ok(match res {
             Some((height, tree)) => {
                 let tree = CTree::read(&*tree)?;
@@ -407,17 +559,82 @@ impl DbAdapter {
         })
     }
 
+    pub fn get_stored_tree(&self, height: u32) -> anyhow::Result<Option<Vec<u8>>> {
+        let tree = self
+            .connection
+            .query_row(
+                "SELECT sapling_tree FROM blocks WHERE height = ?1",
+                params![height],
+                |row| row.get(0),
+            )
+            .optional()?;
+        Ok(tree)
+    }
+
+    /// Delete the blocks and witnesses strictly between two heights
+    pub fn delete_blocks_between(&mut self, low: u32, high: u32) -> anyhow::Result<()> {
+        let db_tx = self.connection.transaction()?;
+        db_tx.execute(
+            "DELETE FROM blocks WHERE height > ?1 AND height < ?2",
+            params![low, high],
+        )?;
+        db_tx.execute(
+            "DELETE FROM sapling_witnesses WHERE height > ?1 AND height < ?2",
+            params![low, high],
+        )?;
+        db_tx.commit()?;
+        Ok(())
+    }
+
+    /// Remember that the blocks between `start_height` and `frontier_height`
+    /// have to be scanned
+    pub fn store_backfill(
+        connection: &Connection,
+        start_height: u32,
+        frontier_height: u32,
+    ) -> anyhow::Result<()> {
+        connection.execute(
+            "INSERT INTO backfill(id, start_height, frontier_height) VALUES (1, ?1, ?2)
+            ON CONFLICT (id) DO UPDATE SET start_height = excluded.start_height,
+            frontier_height = excluded.frontier_height",
+            params![start_height, frontier_height],
+        )?;
+        Ok(())
+    }
+
+    pub fn get_backfill(&self) -> anyhow::Result<Option<(u32, u32)>> {
+        let backfill = self
+            .connection
+            .query_row(
+                "SELECT start_height, frontier_height FROM backfill WHERE id = 1",
+                [],
+                |row| Ok((row.get(0)?, row.get(1)?)),
+            )
+            .optional()?;
+        Ok(backfill)
+    }
+
+    pub fn delete_backfill(&self) -> anyhow::Result<()> {
+        self.connection.execute("DELETE FROM backfill", [])?;
+        Ok(())
+    }
+
     pub fn get_nullifiers(&self) -> anyhow::Result<HashMap<Nf, NfRef>> {
         let mut statement = self.connection.prepare(
-            "SELECT id_note, account, nf FROM received_notes WHERE spent IS NULL OR spent = 0",
+            "SELECT id_note, account, value, nf FROM received_notes WHERE spent IS NULL OR spent = 0",
         )?;
         let nfs_res = statement.query_map([], |row| {
             let id_note: u32 = row.get(0)?;
             let account: u32 = row.get(1)?;
-            let nf_vec: Vec<u8> = row.get(2)?;
+            let value: i64 = row.get(2)?;
+            let nf_vec: Vec<u8> = row.get(3)?;
             let mut nf = [0u8; 32];
             nf.clone_from_slice(&nf_vec);
-            let nf_ref = NfRef { id_note, account };
+            let nf_ref = NfRef {
+                id_note,
+                account,
+                value: value as u64,
+            };
             Ok((nf_ref, nf))
         })?;
         let mut nfs: HashMap<Nf, NfRef> = HashMap::new();
@@ -429,28 +646,21 @@ impl DbAdapter {
         Ok(nfs)
     }
 
-    pub fn get_nullifier_amounts(
-        &self,
-        account: u32,
-        unspent_only: bool,
-    ) -> anyhow::Result<HashMap<Vec<u8>, u64>> {
-        let mut sql = "SELECT value, nf FROM received_notes WHERE account = ?1".to_string();
-        if unspent_only {
-            sql += "AND (spent IS NULL OR spent = 0)";
-        }
-        let mut statement = self.connection.prepare(&sql)?;
-        let nfs_res = statement.query_map(params![account], |row| {
-            let amount: i64 = row.get(0)?;
-            let nf: Vec<u8> = row.get(1)?;
-            Ok((amount, nf))
+    /// Accounts that have at least `min_count` unspent notes below `max_value`
+    pub fn get_dusty_accounts(&self, max_value: u64, min_count: u32) -> anyhow::Result<Vec<u32>> {
+        let mut statement = self.connection.prepare(
+            "SELECT account FROM received_notes WHERE (spent IS NULL OR spent = 0) AND value < ?1 \
+            GROUP BY account HAVING COUNT(*) >= ?2",
+        )?;
+        let rows = statement.query_map(params![max_value as i64, min_count], |row| {
+            let account: u32 = row.get(0)?;
+            Ok(account)
         })?;
-        let mut nfs: HashMap<Vec<u8>, u64> = HashMap::new();
-        for n in nfs_res {
-            let n = n?;
-            nfs.insert(n.1, n.0 as u64);
+        let mut accounts = vec![];
+        for r in rows {
+            accounts.push(r?);
         }
-
-        Ok(nfs)
+        Ok(accounts)
     }
 
     pub fn get_nullifiers_raw(&self) -> anyhow::Result<Vec<(u32, u64, Vec<u8>)>> {
@@ -515,6 +725,87 @@ impl DbAdapter {
         Ok(spendable_notes)
     }
 
+    /// Height of the last checkpoint with witnesses at or before `height`
+    pub fn get_checkpoint_height(&self, height: u32) -> anyhow::Result<Option<u32>> {
+        let height = self
+            .connection
+            .query_row(
+                "SELECT height FROM blocks WHERE height <= ?1 AND witnesses
+                ORDER BY height DESC LIMIT 1",
+                params![height],
+                |row| row.get(0),
+            )
+            .optional()?;
+        Ok(height)
+    }
+
+    /// Unspent notes of every account with their witness at a checkpoint
+    pub fn get_checkpoint_notes(
+        &self,
+        height: u32,
+        addresses: &mut AddressCache,
+    ) -> anyhow::Result<HashMap<u32, SpendableNote>> {
+        let fvks = self.get_fvks()?;
+        let mut statement = self.connection.prepare(
+            "SELECT id_note, account, diversifier, value, rcm, witness FROM received_notes r, sapling_witnesses w
+            WHERE w.height = ?1 AND r.id_note = w.note AND (r.spent IS NULL OR r.spent = 0)",
+        )?;
+        let rows = statement.query_map(params![height], |row| {
+            let id_note: u32 = row.get(0)?;
+            let account: u32 = row.get(1)?;
+            let diversifier: Vec<u8> = row.get(2)?;
+            let value: i64 = row.get(3)?;
+            let rcm: Vec<u8> = row.get(4)?;
+            let witness: Vec<u8> = row.get(5)?;
+            Ok((id_note, account, diversifier, value, rcm, witness))
+        })?;
+        let rows: Vec<_> = rows.collect::<Result<_, _>>()?;
+        let mut notes: HashMap<u32, SpendableNote> = HashMap::new();
+        for (id_note, account, diversifier, value, rcm, witness) in rows {
+            let ivk = match fvks.get(&account) {
+                Some(vk) => &vk.ivk,
+                None => continue,
+            };
+            let mut diversifer_bytes = [0u8; 11];
+            diversifer_bytes.copy_from_slice(&diversifier);
+            let diversifier = Diversifier(diversifer_bytes);
+            let mut rcm_bytes = [0u8; 32];
+            rcm_bytes.copy_from_slice(&rcm);
+            let rcm = jubjub::Fr::from_bytes(&rcm_bytes).unwrap();
+            let rseed = Rseed::BeforeZip212(rcm);
+            let witness = IncrementalWitness::<Node>::read(&*witness)?;
+
+            let address = addresses
+                .get(self, account, ivk, diversifier)?
+                .ok_or_else(|| anyhow::anyhow!("Invalid diversifier"))?;
+            let note = address.create_note(value as u64, rseed);
+            notes.insert(
+                id_note,
+                SpendableNote {
+                    id: id_note,
+                    note,
+                    diversifier,
+                    witness,
+                },
+            );
+        }
+        Ok(notes)
+    }
+
+    /// Notes of an account that can be spent, in id order
+    pub fn get_spendable_note_ids(&self, account: u32) -> anyhow::Result<Vec<u32>> {
+        let mut statement = self.connection.prepare(
+            "SELECT id_note FROM received_notes WHERE spent IS NULL AND account = ?1
+            AND (excluded IS NULL OR NOT excluded) ORDER BY id_note",
+        )?;
+        let rows = statement.query_map(params![account], |row| row.get(0))?;
+        let mut ids: Vec<u32> = vec![];
+        for r in rows {
+            ids.push(r?);
+        }
+        Ok(ids)
+    }
+
     pub fn tx_mark_spend(&mut self, selected_notes: &[u32]) -> anyhow::Result<()> {
         let db_tx = self.begin_transaction()?;
         for id_note in selected_notes.iter() {
@@ -534,25 +825,71 @@ impl DbAdapter {
         Ok(())
     }
 
-    pub fn purge_old_witnesses(&self, height: u32) -> anyhow::Result<()> {
-        log::debug!("+purge_old_witnesses");
-        let min_height: Option<u32> = self.connection.query_row(
-            "SELECT MAX(height) FROM sapling_witnesses WHERE height <= ?1",
-            params![height],
-            |row| row.get(0),
-        )?;
-
-        // Leave at least one sapling witness
-        if let Some(min_height) = min_height {
-            log::debug!("Purging witnesses older than {}", min_height);
-            self.connection.execute(
-                "DELETE FROM sapling_witnesses WHERE height < ?1",
-                params![min_height],
+    /// Delete the blocks and witnesses that the policy does not keep
+    ///
+    /// The blocks that keep their witnesses are kept too
+    pub fn purge_checkpoints(&mut self, policy: &CheckpointPolicy, tip: u32) -> anyhow::Result<()> {
+        log::debug!("+purge_checkpoints");
+        let mut heights: Vec<u32> = vec![];
+        let mut complete: Vec<u32> = vec![];
+        {
+            let mut statement = self
+                .connection
+                .prepare("SELECT height, witnesses FROM blocks ORDER BY height")?;
+            let rows = statement.query_map([], |row| {
+                let height: u32 = row.get(0)?;
+                let witnesses: bool = row.get(1)?;
+                Ok((height, witnesses))
+            })?;
+            for r in rows {
+                let (height, witnesses) = r?;
+                heights.push(height);
+                if witnesses {
+                    complete.push(height);
+                }
+            }
+        }
+        let mut keep_witnesses: HashSet<u32> = policy
+            .witnesses_to_keep(&complete, tip)
+            .into_iter()
+            .collect();
+        if let Some((start_height, frontier_height)) = self.get_backfill()? {
+            keep_witnesses.insert(start_height);
+            keep_witnesses.insert(frontier_height);
+        }
+        let mut keep: HashSet<u32> = policy
+            .checkpoints_to_keep(&heights, tip)
+            .into_iter()
+            .collect();
+        keep.extend(keep_witnesses.iter());
+        let db_tx = self.connection.transaction()?;
+        for height in heights.iter().filter(|h| !keep.contains(h)) {
+            db_tx.execute(
+                "DELETE FROM sapling_witnesses WHERE height = ?1",
+                params![height],
+            )?;
+            db_tx.execute("DELETE FROM blocks WHERE height = ?1", params![height])?;
+        }
+        for height in complete
+            .iter()
+            .filter(|h| keep.contains(h) && !keep_witnesses.contains(h))
+        {
+            db_tx.execute(
+                "DELETE FROM sapling_witnesses WHERE height = ?1",
+                params![height],
+            )?;
+            db_tx.execute(
+                "UPDATE blocks SET witnesses = FALSE WHERE height = ?1",
+                params![height],
             )?;
-            self.connection
-                .execute("DELETE FROM blocks WHERE height < ?1", params![min_height])?;
         }
-        log::debug!("-purge_old_witnesses");
+        db_tx.commit()?;
+        log::debug!(
+            "-purge_checkpoints {}/{} ({} with witnesses)",
+            keep.len(),
+            heights.len(),
+            keep_witnesses.len()
+        );
         Ok(())
     }
 
@@ -701,6 +1038,141 @@ impl DbAdapter {
         Ok(())
     }
 
+    pub fn get_diversified_addresses(&self) -> anyhow::Result<Vec<(u32, DiversifiedAddress)>> {
+        let mut statement = self.connection.prepare(
+            "SELECT account, diversifier_index, diversifier, g_d, pk_d FROM diversified_addresses",
+        )?;
+        let rows = statement.query_map([], |row| {
+            let account: u32 = row.get(0)?;
+            let diversifier_index: Option<i64> = row.get(1)?;
+            let diversifier: Vec<u8> = row.get(2)?;
+            let g_d: Vec<u8> = row.get(3)?;
+            let pk_d: Vec<u8> = row.get(4)?;
+            Ok((account, diversifier_index, diversifier, g_d, pk_d))
+        })?;
+        let mut addresses = vec![];
+        for r in rows {
+            let (account, diversifier_index, diversifier, g_d, pk_d) = r?;
+            let address = DiversifiedAddress::from_parts_unchecked(
+                diversifier_index.map(|i| i as u64),
+                &diversifier,
+                &g_d,
+                &pk_d,
+            )
+            .ok_or_else(|| anyhow::anyhow!("Invalid diversified address"))?;
+            addresses.push((account, address));
+        }
+        Ok(addresses)
+    }
+
+    pub fn store_diversified_addresses(
+        &self,
+        account: u32,
+        addresses: &[DiversifiedAddress],
+    ) -> anyhow::Result<()> {
+        let db_tx = self.connection.unchecked_transaction()?;
+        {
+            let mut statement = db_tx.prepare(
+                "INSERT INTO diversified_addresses(account, diversifier, diversifier_index, g_d, pk_d, address)
+                VALUES (?1, ?2, ?3, ?4, ?5, ?6) ON CONFLICT DO NOTHING",
+            )?;
+            for address in addresses.iter() {
+                let pa = &address.pa;
+                let encoded =
+                    encode_payment_address(self.network().hrp_sapling_payment_address(), pa);
+                statement.execute(params![
+                    account,
+                    pa.diversifier().0.to_vec(),
+                    address.diversifier_index.map(|i| i as i64),
+                    address.g_d.to_bytes().to_vec(),
+                    pa.pk_d().to_bytes().to_vec(),
+                    encoded
+                ])?;
+            }
+        }
+        db_tx.commit()?;
+        Ok(())
+    }
+
+    /// Index after the last address handed out or generated in advance
+    pub fn get_next_diversifier_index(&self, account: u32) -> anyhow::Result<u64> {
+        let last_used = from_diversifier_index(&self.get_diversifier(account)?);
+        let last_generated: Option<i64> = self.connection.query_row(
+            "SELECT MAX(diversifier_index) FROM diversified_addresses WHERE account = ?1",
+            params![account],
+            |row| row.get(0),
+        )?;
+        let last = last_generated.map_or(last_used, |i| (i as u64).max(last_used));
+        Ok(last + 1)
+    }
+
+    /// Addresses generated in advance that were not handed out, in index order
+    pub fn get_unused_diversified_addresses(
+        &self,
+        account: u32,
+        count: u32,
+    ) -> anyhow::Result<Vec<(u64, String)>> {
+        let last_used = from_diversifier_index(&self.get_diversifier(account)?);
+        let mut statement = self.connection.prepare(
+            "SELECT diversifier_index, address FROM diversified_addresses WHERE account = ?1 \
+            AND diversifier_index > ?2 ORDER BY diversifier_index LIMIT ?3",
+        )?;
+        let rows = statement.query_map(params![account, last_used as i64, count], |row| {
+            let diversifier_index: i64 = row.get(0)?;
+            let address: String = row.get(1)?;
+            Ok((diversifier_index as u64, address))
+        })?;
+        let mut addresses = vec![];
+        for r in rows {
+            addresses.push(r?);
+        }
+        Ok(addresses)
+    }
+
+    pub fn store_invoice(
+        &self,
+        account: u32,
+        diversifier: &[u8],
+        invoice: &str,
+    ) -> anyhow::Result<()> {
+        self.connection.execute(
+            "INSERT INTO invoices(account, diversifier, invoice) VALUES (?1, ?2, ?3) \
+            ON CONFLICT (account, diversifier) DO UPDATE SET invoice = excluded.invoice",
+            params![account, diversifier, invoice],
+        )?;
+        Ok(())
+    }
+
+    pub fn get_invoice_payments(&self, invoice: &str) -> anyhow::Result<Vec<InvoicePayment>> {
+        let mut statement = self.connection.prepare(
+            "SELECT p.id_note, p.account, t.txid, r.height, r.value, r.spent FROM invoice_payments p
+            JOIN received_notes r ON r.id_note = p.id_note JOIN transactions t ON t.id_tx = r.tx
+            WHERE p.invoice = ?1 ORDER BY r.height",
+        )?;
+        let rows = statement.query_map(params![invoice], |row| {
+            let id_note: u32 = row.get(0)?;
+            let account: u32 = row.get(1)?;
+            let mut txid: Vec<u8> = row.get(2)?;
+            let height: u32 = row.get(3)?;
+            let value: i64 = row.get(4)?;
+            let spent: Option<u32> = row.get(5)?;
+            txid.reverse();
+            Ok(InvoicePayment {
+                id_note,
+                account,
+                tx_id: hex::encode(txid),
+                height,
+                value: value as u64,
+                spent: spent.is_some(),
+            })
+        })?;
+        let mut payments = vec![];
+        for r in rows {
+            payments.push(r?);
+        }
+        Ok(payments)
+    }
+
     pub fn get_taddr(&self, account: u32) -> anyhow::Result<Option<String>> {
         let address = self
             .connection
@@ -810,6 +1282,8 @@ impl DbAdapter {
         self.connection.execute("DELETE FROM blocks", [])?;
         self.connection.execute("DELETE FROM contacts", [])?;
         self.connection.execute("DELETE FROM diversifiers", [])?;
+        self.connection
+            .execute("DELETE FROM diversified_addresses", [])?;
         self.connection
             .execute("DELETE FROM historical_prices", [])?;
         self.connection.execute("DELETE FROM received_notes", [])?;
@@ -817,6 +1291,9 @@ impl DbAdapter {
             .execute("DELETE FROM sapling_witnesses", [])?;
         self.connection.execute("DELETE FROM transactions", [])?;
         self.connection.execute("DELETE FROM messages", [])?;
+        self.connection
+            .execute("DELETE FROM invoice_payments", [])?;
+        self.connection.execute("DELETE FROM backfill", [])?;
         Ok(())
     }
 
@@ -833,14 +1310,28 @@ impl DbAdapter {
             "DELETE FROM diversifiers WHERE account = ?1",
             params![account],
         )?;
+        self.connection.execute(
+            "DELETE FROM diversified_addresses WHERE account = ?1",
+            params![account],
+        )?;
         self.connection.execute(
             "DELETE FROM accounts WHERE id_account = ?1",
             params![account],
         )?;
+        self.connection.execute(
+            "DELETE FROM account_birthdays WHERE account = ?1",
+            params![account],
+        )?;
         self.connection
             .execute("DELETE FROM taddrs WHERE account = ?1", params![account])?;
         self.connection
             .execute("DELETE FROM messages WHERE account = ?1", params![account])?;
+        self.connection
+            .execute("DELETE FROM invoices WHERE account = ?1", params![account])?;
+        self.connection.execute(
+            "DELETE FROM invoice_payments WHERE account = ?1",
+            params![account],
+        )?;
         self.connection.execute(
             "DELETE FROM secret_shares WHERE account = ?1",
             params![account],
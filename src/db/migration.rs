@@ -27,6 +27,9 @@ pub fn reset_db(connection: &Connection) -> anyhow::Result<()> {
     connection.execute("DROP TABLE received_notes", [])?;
     connection.execute("DROP TABLE sapling_witnesses", [])?;
     connection.execute("DROP TABLE diversifiers", [])?;
+    connection.execute("DROP TABLE diversified_addresses", [])?;
+    connection.execute("DROP TABLE invoice_payments", [])?;
+    connection.execute("DROP TABLE backfill", [])?;
     connection.execute("DROP TABLE historical_prices", [])?;
     update_schema_version(connection, 0)?;
     Ok(())
@@ -173,8 +176,80 @@ pub fn init_db(connection: &Connection) -> anyhow::Result<()> {
         // )?;
     }
 
-    if version != 3 {
-        update_schema_version(connection, 3)?;
+    if version < 4 {
+        connection.execute(
+            "CREATE TABLE IF NOT EXISTS diversified_addresses (
+            account INTEGER NOT NULL,
+            diversifier BLOB NOT NULL,
+            diversifier_index INTEGER,
+            g_d BLOB NOT NULL,
+            pk_d BLOB NOT NULL,
+            address TEXT NOT NULL,
+            PRIMARY KEY (account, diversifier))",
+            [],
+        )?;
+        connection.execute(
+            "CREATE INDEX IF NOT EXISTS i_diversified_address ON diversified_addresses(account, diversifier_index)",
+            [],
+        )?;
+    }
+
+    if version < 5 {
+        connection.execute(
+            "CREATE TABLE IF NOT EXISTS invoices (
+            account INTEGER NOT NULL,
+            diversifier BLOB NOT NULL,
+            invoice TEXT NOT NULL,
+            PRIMARY KEY (account, diversifier))",
+            [],
+        )?;
+        connection.execute(
+            "CREATE INDEX IF NOT EXISTS i_invoice ON invoices(invoice)",
+            [],
+        )?;
+        connection.execute(
+            "CREATE TABLE IF NOT EXISTS invoice_payments (
+            id_note INTEGER PRIMARY KEY,
+            account INTEGER NOT NULL,
+            invoice TEXT NOT NULL,
+            height INTEGER NOT NULL)",
+            [],
+        )?;
+        connection.execute(
+            "CREATE INDEX IF NOT EXISTS i_invoice_payment ON invoice_payments(invoice)",
+            [],
+        )?;
+    }
+
+    if version < 6 {
+        connection.execute(
+            "CREATE TABLE IF NOT EXISTS account_birthdays (
+            account INTEGER PRIMARY KEY,
+            height INTEGER NOT NULL)",
+            [],
+        )?;
+    }
+
+    if version < 7 {
+        connection.execute(
+            "CREATE TABLE IF NOT EXISTS backfill (
+            id INTEGER PRIMARY KEY NOT NULL,
+            start_height INTEGER NOT NULL,
+            frontier_height INTEGER NOT NULL)",
+            [],
+        )?;
+    }
+
+    if version < 8 {
+        // blocks that only keep their tree frontier have no witnesses
+        connection.execute(
+            "ALTER TABLE blocks ADD COLUMN witnesses BOOL NOT NULL DEFAULT TRUE",
+            [],
+        )?;
+    }
+
+    if version != 8 {
+        update_schema_version(connection, 8)?;
         log::info!("Database migrated");
     }
 
@@ -19,8 +19,10 @@ pub const LWD_URL: &str = "https://mainnet.lightwalletd.com:9067";
 // YCash
 // pub const LWD_URL: &str = "https://lite.ycash.xyz:9067";
 
+mod address_cache;
 mod builder;
 mod chain;
+mod checkpoint;
 mod coinconfig;
 mod commitment;
 mod contact;
@@ -31,10 +33,15 @@ mod key;
 mod key2;
 mod mempool;
 mod misc;
+mod note_cache;
+mod note_selection;
 mod pay;
 mod prices;
 mod print;
+mod prover;
 mod scan;
+mod shared_scan;
+mod sync_metrics;
 mod taddr;
 mod transaction;
 mod ua;
@@ -44,6 +51,11 @@ pub mod api;
 #[cfg(feature = "ledger")]
 mod ledger;
 
+#[cfg(any(test, feature = "simulator"))]
+mod chain_gen;
+#[cfg(any(test, feature = "simulator"))]
+mod mock_lwd;
+
 #[cfg(not(feature = "ledger"))]
 #[allow(dead_code)]
 mod ledger {
@@ -64,13 +76,15 @@ pub fn hex_to_hash(hex: &str) -> anyhow::Result<[u8; 32]> {
 pub use crate::builder::advance_tree;
 pub use crate::chain::{
     calculate_tree_state_v2, connect_lightwalletd, download_chain, get_best_server,
-    get_latest_height, ChainError, DecryptNode,
+    get_latest_height, ChainError, DecryptNode, Nf, NfIndex, NfRef,
 };
+pub use crate::checkpoint::CheckpointPolicy;
 pub use crate::coinconfig::{
-    init_coin, set_active, set_active_account, set_coin_lwd_url, CoinConfig,
+    get_prover, init_coin, prewarm_prover, set_active, set_active_account, set_checkpoint_policy,
+    set_coin_lwd_url, set_prover_cache_path, set_recent_first_blocks, CoinConfig,
 };
 pub use crate::commitment::{CTree, Witness};
-pub use crate::db::{AccountRec, DbAdapter, TxRec};
+pub use crate::db::{AccountRec, AccountViewKey, DbAdapter, InvoicePayment, TxRec};
 pub use crate::fountain::{put_drop, FountainCodes, RaptorQDrops};
 pub use crate::hash::pedersen_hash;
 pub use crate::key::{generate_random_enc_key, KeyHelpers};
@@ -80,7 +94,12 @@ pub use crate::mempool::MemPool;
 pub use crate::misc::read_zwl;
 pub use crate::pay::{broadcast_tx, get_tx_summary, Tx, TxIn, TxOut};
 pub use crate::print::*;
+pub use crate::prover::SaplingProver;
 pub use crate::scan::{latest_height, sync_async};
+pub use crate::shared_scan::sync_tenants;
+pub use crate::sync_metrics::{
+    to_prometheus, ChunkMetrics, ProgressTracker, SyncMetrics, SyncProgress, SyncStage,
+};
 pub use crate::ua::{get_sapling, get_ua};
 // pub use crate::wallet::{decrypt_backup, encrypt_backup, RecipientMemo, Wallet, WalletBalance};
 
@@ -90,5 +109,13 @@ pub use crate::ledger::sapling::build_tx_ledger;
 #[cfg(feature = "ledger")]
 pub use crate::ledger::sweep_ledger;
 
+#[cfg(feature = "simulator")]
+pub use crate::chain_gen::{ChainGenConfig, ChainGenerator};
+#[cfg(feature = "simulator")]
+pub use crate::mock_lwd::{
+    serve_mock_lightwalletd, serve_mock_lightwalletd_on, BlockFixture, BlockSource,
+    MockLightwalletd, NetworkConditions,
+};
+
 #[cfg(feature = "nodejs")]
 pub mod nodejs;
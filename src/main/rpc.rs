@@ -2,22 +2,18 @@
 extern crate rocket;
 
 use anyhow::anyhow;
-use lazy_static::lazy_static;
 use rocket::fairing::AdHoc;
-use rocket::http::Status;
+use rocket::http::{ContentType, Status};
 use rocket::response::Responder;
 use rocket::serde::{json::Json, Deserialize, Serialize};
 use rocket::{response, Request, Response, State};
 use std::collections::HashMap;
-use std::sync::atomic::AtomicBool;
 use thiserror::Error;
-use warp_api_ffi::api::payment::{Recipient, RecipientMemo};
+use warp_api_ffi::api::payment::{NoteSelectionStrategy, Recipient, RecipientMemo};
 use warp_api_ffi::api::payment_uri::PaymentURI;
-use warp_api_ffi::{get_best_server, AccountRec, CoinConfig, RaptorQDrops, Tx, TxRec};
-
-lazy_static! {
-    static ref SYNC_CANCELED: AtomicBool = AtomicBool::new(false);
-}
+use warp_api_ffi::{
+    get_best_server, AccountRec, CoinConfig, InvoicePayment, RaptorQDrops, SyncMetrics, Tx, TxRec,
+};
 
 #[derive(Debug, Error)]
 pub enum Error {
@@ -70,36 +66,46 @@ async fn main() -> anyhow::Result<()> {
     init(0, zec)?;
     let yec: HashMap<String, String> = figment.extract_inner("yec")?;
     init(1, yec)?;
-
-    let _ = rocket
-        .mount(
-            "/",
-            routes![
-                set_active,
-                new_account,
-                list_accounts,
-                sync,
-                rewind,
-                get_latest_height,
-                get_backup,
-                get_balance,
-                get_address,
-                get_tx_history,
-                pay,
-                mark_synced,
-                create_offline_tx,
-                sign_offline_tx,
-                broadcast_tx,
-                new_diversified_address,
-                make_payment_uri,
-                parse_payment_uri,
-                split_data,
-                merge_data,
-            ],
-        )
-        .attach(AdHoc::config::<Config>())
-        .launch()
-        .await?;
+    let prometheus: bool = figment.extract_inner("prometheus").unwrap_or(false);
+    warp_api_ffi::prewarm_prover();
+
+    let mut rocket = rocket.mount(
+        "/",
+        routes![
+            set_active,
+            new_account,
+            list_accounts,
+            sync,
+            sync_all,
+            cancel_sync,
+            rewind,
+            get_sync_metrics,
+            get_latest_height,
+            get_backup,
+            get_balance,
+            get_address,
+            get_tx_history,
+            pay,
+            batch_pay,
+            mark_synced,
+            create_offline_tx,
+            sign_offline_tx,
+            broadcast_tx,
+            new_diversified_address,
+            new_diversified_addresses,
+            register_invoice,
+            new_invoice_address,
+            get_invoice_payments,
+            make_payment_uri,
+            parse_payment_uri,
+            split_data,
+            merge_data,
+        ],
+    );
+    if prometheus {
+        rocket = rocket.mount("/", routes![prometheus_metrics]);
+    }
+    let _ = rocket.attach(AdHoc::config::<Config>()).launch().await?;
 
     Ok(())
 }
@@ -118,6 +124,9 @@ pub fn new_account(seed: Json<AccountSeed>) -> Result<String, Error> {
         seed.key.clone(),
         seed.index,
     )?;
+    if let Some(birth_height) = seed.birth_height {
+        warp_api_ffi::api::account::set_birth_height(seed.coin, id_account, birth_height)?;
+    }
     warp_api_ffi::set_active_account(seed.coin, id_account);
     Ok(id_account.to_string())
 }
@@ -133,11 +142,24 @@ pub fn list_accounts() -> Result<Json<Vec<AccountRec>>, Error> {
 #[post("/sync?<offset>")]
 pub async fn sync(offset: Option<u32>) -> Result<(), Error> {
     let c = CoinConfig::get_active();
-    warp_api_ffi::api::sync::coin_sync(c.coin, true, offset.unwrap_or(0), |_| {}, &SYNC_CANCELED)
-        .await?;
+    warp_api_ffi::api::sync::coin_sync_scheduled(c.coin, true, offset.unwrap_or(0), |_| {}).await?;
     Ok(())
 }
 
+#[post("/sync_all?<offset>")]
+pub async fn sync_all(offset: Option<u32>) -> Result<(), Error> {
+    let results = warp_api_ffi::api::sync::sync_coins(&[0, 1], true, offset.unwrap_or(0)).await;
+    for res in results {
+        res?;
+    }
+    Ok(())
+}
+
+#[post("/cancel_sync?<coin>")]
+pub fn cancel_sync(coin: u8) {
+    warp_api_ffi::api::sync::cancel_sync(coin);
+}
+
 #[post("/rewind?<height>")]
 pub async fn rewind(height: u32) -> Result<(), Error> {
     warp_api_ffi::api::sync::rewind_to_height(height).await?;
@@ -151,6 +173,20 @@ pub async fn mark_synced() -> Result<(), Error> {
     Ok(())
 }
 
+#[get("/sync_metrics?<coin>")]
+pub fn get_sync_metrics(coin: u8) -> Result<Json<SyncMetrics>, Error> {
+    let metrics = warp_api_ffi::api::sync::get_sync_metrics(coin)?;
+    Ok(Json(metrics))
+}
+
+#[get("/metrics")]
+pub fn prometheus_metrics() -> (ContentType, String) {
+    (
+        ContentType::Plain,
+        warp_api_ffi::api::sync::get_sync_metrics_prometheus(),
+    )
+}
+
 #[get("/latest_height")]
 pub async fn get_latest_height() -> Result<Json<Heights>, Error> {
     let latest = warp_api_ffi::api::sync::get_latest_height().await?;
@@ -212,6 +248,7 @@ pub async fn create_offline_tx(payment: Json<Payment>) -> Result<Json<Tx>, Error
         &recipients,
         false,
         payment.confirmations,
+        payment.strategy,
     )
     .await?;
     Ok(Json(tx))
@@ -249,6 +286,7 @@ pub async fn pay(payment: Json<Payment>, config: &State<Config>) -> Result<Strin
             &recipients,
             false,
             payment.confirmations,
+            payment.strategy,
             Box::new(|_| {}),
         )
         .await?;
@@ -256,6 +294,54 @@ pub async fn pay(payment: Json<Payment>, config: &State<Config>) -> Result<Strin
     }
 }
 
+#[post("/batch_pay", data = "<batch>")]
+pub async fn batch_pay(
+    batch: Json<BatchPayment>,
+    config: &State<Config>,
+) -> Result<Json<Vec<BatchPaymentResult>>, Error> {
+    if !config.allow_send {
+        Err(anyhow!("Payment API not enabled").into())
+    } else {
+        let c = CoinConfig::get_active();
+        let latest = warp_api_ffi::api::sync::get_latest_height().await?;
+        let from = {
+            let db = c.db()?;
+            db.get_address(c.id_account)?
+        };
+        let payments: Vec<Vec<_>> = batch
+            .payments
+            .iter()
+            .map(|recipients| {
+                recipients
+                    .iter()
+                    .map(|p| RecipientMemo::from_recipient(&from, p))
+                    .collect()
+            })
+            .collect();
+        let results = warp_api_ffi::api::payment::build_sign_send_batch_payments(
+            latest,
+            &payments,
+            batch.confirmations,
+            batch.strategy,
+        )
+        .await?;
+        let results = results
+            .into_iter()
+            .map(|r| match r {
+                Ok(txid) => BatchPaymentResult {
+                    txid: Some(txid),
+                    error: None,
+                },
+                Err(e) => BatchPaymentResult {
+                    txid: None,
+                    error: Some(e.to_string()),
+                },
+            })
+            .collect();
+        Ok(Json(results))
+    }
+}
+
 #[post("/broadcast_tx?<tx_hex>")]
 pub async fn broadcast_tx(tx_hex: String) -> Result<String, Error> {
     let tx = hex::decode(tx_hex.trim_end()).map_err(|e| anyhow!(e.to_string()))?;
@@ -269,6 +355,30 @@ pub fn new_diversified_address() -> Result<String, Error> {
     Ok(address)
 }
 
+#[get("/new_diversified_addresses?<count>")]
+pub fn new_diversified_addresses(count: u32) -> Result<Json<Vec<String>>, Error> {
+    let addresses = warp_api_ffi::api::account::new_diversified_addresses(count)?;
+    Ok(Json(addresses))
+}
+
+#[post("/register_invoice?<invoice>&<address>")]
+pub fn register_invoice(invoice: String, address: String) -> Result<(), Error> {
+    warp_api_ffi::api::invoice::register_invoice(&invoice, &address)?;
+    Ok(())
+}
+
+#[post("/new_invoice_address?<invoice>")]
+pub fn new_invoice_address(invoice: String) -> Result<String, Error> {
+    let address = warp_api_ffi::api::invoice::new_invoice_address(&invoice)?;
+    Ok(address)
+}
+
+#[get("/invoice_payments?<invoice>")]
+pub fn get_invoice_payments(invoice: String) -> Result<Json<Vec<InvoicePayment>>, Error> {
+    let payments = warp_api_ffi::api::invoice::get_invoice_payments(&invoice)?;
+    Ok(Json(payments))
+}
+
 #[post("/make_payment_uri", data = "<payment>")]
 pub fn make_payment_uri(payment: Json<PaymentURI>) -> Result<String, Error> {
     let uri = warp_api_ffi::api::payment_uri::make_payment_uri(
@@ -313,6 +423,7 @@ pub struct AccountSeed {
     name: String,
     key: Option<String>,
     index: Option<u32>,
+    birth_height: Option<u32>,
 }
 
 #[derive(Serialize)]
@@ -335,4 +446,22 @@ pub struct Backup {
 pub struct Payment {
     recipients: Vec<Recipient>,
     confirmations: u32,
+    #[serde(default)]
+    strategy: NoteSelectionStrategy,
+}
+
+#[derive(Deserialize)]
+#[serde(crate = "rocket::serde")]
+pub struct BatchPayment {
+    payments: Vec<Vec<Recipient>>,
+    confirmations: u32,
+    #[serde(default)]
+    strategy: NoteSelectionStrategy,
+}
+
+#[derive(Serialize)]
+#[serde(crate = "rocket::serde")]
+pub struct BatchPaymentResult {
+    txid: Option<String>,
+    error: Option<String>,
 }
@@ -2,11 +2,10 @@ use clap::{Arg, Command};
 use std::fs::File;
 use std::io::{Read, Write};
 use std::str::FromStr;
-use sync::{KeyHelpers, Tx};
+use sync::{get_prover, KeyHelpers, Tx};
 use zcash_client_backend::encoding::decode_extended_spending_key;
 use zcash_params::coin::CoinType;
 use zcash_primitives::consensus::{Network, Parameters};
-use zcash_proofs::prover::LocalTxProver;
 
 #[tokio::main]
 async fn main() -> anyhow::Result<()> {
@@ -52,10 +51,9 @@ async fn main() -> anyhow::Result<()> {
     let mut file = File::open(tx_filename)?;
     let mut s = String::new();
     file.read_to_string(&mut s).unwrap();
-    let tx: Tx = serde_json::from_str(&s)?;
-    let prover = LocalTxProver::with_default_location()
-        .ok_or_else(|| anyhow::anyhow!("Cannot create prover. Missing zcash-params?"))?;
-    let raw_tx = tx.sign(None, &sk, &prover, |p| {
+    let tx = Tx::parse(&s)?;
+    let prover = get_prover();
+    let raw_tx = tx.sign(None, &sk, prover, |p| {
         println!("Progress {}", p.cur());
     })?;
 
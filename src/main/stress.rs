@@ -0,0 +1,214 @@
+use clap::{Arg, Command};
+use rusqlite::Connection;
+use std::net::SocketAddr;
+use std::path::Path;
+use std::sync::atomic::AtomicBool;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use tokio::sync::Mutex;
+use warp_api_ffi::{
+    serve_mock_lightwalletd, set_recent_first_blocks, sync_async, BlockFixture, BlockSource, CTree,
+    ChainGenConfig, ChainGenerator, DbAdapter, MockLightwalletd, NetworkConditions, SyncProgress,
+    SyncStage,
+};
+use zcash_client_backend::encoding::{encode_extended_full_viewing_key, encode_payment_address};
+use zcash_params::coin::CoinType;
+use zcash_primitives::consensus::{Network, NetworkUpgrade, Parameters};
+
+static CANCEL: AtomicBool = AtomicBool::new(false);
+
+fn arg_u32(matches: &clap::ArgMatches, name: &str) -> anyhow::Result<u32> {
+    Ok(matches.value_of(name).unwrap().parse()?)
+}
+
+/// Sync a fresh wallet against a synthetic chain served locally
+#[tokio::main]
+async fn main() -> anyhow::Result<()> {
+    env_logger::init();
+    let matches = Command::new("Warp sync stress test")
+        .arg(
+            Arg::new("blocks")
+                .short('b')
+                .long("blocks")
+                .takes_value(true)
+                .default_value("10000"),
+        )
+        .arg(
+            Arg::new("outputs")
+                .short('o')
+                .long("outputs")
+                .takes_value(true)
+                .default_value("100"),
+        )
+        .arg(
+            Arg::new("spends")
+                .short('s')
+                .long("spends")
+                .takes_value(true)
+                .default_value("50"),
+        )
+        .arg(
+            Arg::new("accounts")
+                .short('a')
+                .long("accounts")
+                .takes_value(true)
+                .default_value("1"),
+        )
+        .arg(
+            Arg::new("rate")
+                .short('r')
+                .long("rate")
+                .takes_value(true)
+                .default_value("0.01"),
+        )
+        .arg(
+            Arg::new("spend_delay")
+                .long("spend-delay")
+                .takes_value(true)
+                .default_value("0"),
+        )
+        .arg(
+            Arg::new("seed")
+                .long("seed")
+                .takes_value(true)
+                .default_value("0"),
+        )
+        .arg(
+            Arg::new("port")
+                .short('p')
+                .long("port")
+                .takes_value(true)
+                .default_value("19067"),
+        )
+        .arg(
+            Arg::new("latency")
+                .long("latency")
+                .takes_value(true)
+                .default_value("0"),
+        )
+        .arg(
+            Arg::new("bandwidth")
+                .long("bandwidth")
+                .takes_value(true)
+                .default_value("0"),
+        )
+        .arg(Arg::new("fixture").long("fixture").takes_value(true))
+        .arg(Arg::new("db").long("db").takes_value(true))
+        .get_matches();
+
+    let network = Network::MainNetwork;
+    let config = ChainGenConfig {
+        seed: matches.value_of("seed").unwrap().parse()?,
+        start_height: u32::from(network.activation_height(NetworkUpgrade::Sapling).unwrap()),
+        block_count: arg_u32(&matches, "blocks")?,
+        outputs_per_block: arg_u32(&matches, "outputs")?,
+        spends_per_block: arg_u32(&matches, "spends")?,
+        wallet_output_rate: matches.value_of("rate").unwrap().parse()?,
+        wallet_spend_delay: arg_u32(&matches, "spend_delay")?,
+        ..ChainGenConfig::default()
+    };
+    let fvks = ChainGenerator::test_fvks(arg_u32(&matches, "accounts")?);
+    let chain = Arc::new(ChainGenerator::new(network, config, fvks.clone()));
+    // a recorded fixture replaces the generated chain, its notes are not checked
+    let source: Arc<dyn BlockSource> = match matches.value_of("fixture") {
+        Some(path) => Arc::new(BlockFixture::load(Path::new(path), CTree::new())?),
+        None => chain.clone(),
+    };
+
+    let source_start = source.start_height();
+    let server = Arc::new(MockLightwalletd::new(network, source));
+    server.set_conditions(NetworkConditions {
+        latency: Duration::from_millis(arg_u32(&matches, "latency")? as u64),
+        bandwidth: arg_u32(&matches, "bandwidth")? as u64,
+    });
+    // the sync gets the tree state of a fixture from the block before the birthday
+    let fixture = matches.is_present("fixture");
+    let first_height = if fixture {
+        source_start + 2
+    } else {
+        source_start + 1
+    };
+    let port = arg_u32(&matches, "port")?;
+    let addr: SocketAddr = format!("127.0.0.1:{}", port).parse()?;
+    tokio::spawn(serve_mock_lightwalletd(server.clone(), addr));
+    tokio::time::sleep(Duration::from_millis(500)).await;
+
+    let db_path = match matches.value_of("db") {
+        Some(path) => path.to_string(),
+        None => std::env::temp_dir()
+            .join("warp-stress.db")
+            .to_string_lossy()
+            .to_string(),
+    };
+    let _ = std::fs::remove_file(&db_path);
+    let db = DbAdapter::new(CoinType::Zcash, &db_path)?;
+    db.init_db()?;
+    for (i, fvk) in fvks.iter().enumerate() {
+        let efvk =
+            encode_extended_full_viewing_key(network.hrp_sapling_extended_full_viewing_key(), fvk);
+        let (_, pa) = fvk.default_address();
+        let address = encode_payment_address(network.hrp_sapling_payment_address(), &pa);
+        let (id_account, _) =
+            db.store_account(&format!("stress-{}", i), None, 0, None, &efvk, &address)?;
+        if fixture {
+            db.store_birth_height(id_account, first_height)?;
+        }
+    }
+    drop(db);
+    set_recent_first_blocks(0, 0);
+
+    let block_count = (server.tip_height() + 1).saturating_sub(first_height);
+    println!("Syncing {} blocks, {} accounts", block_count, fvks.len());
+    let start = Instant::now();
+    sync_async(
+        CoinType::Zcash,
+        0,
+        false,
+        &db_path,
+        0,
+        Arc::new(Mutex::new(|p: &SyncProgress| {
+            if p.stage == SyncStage::Download {
+                if let Some(eta) = p.eta_secs {
+                    println!(
+                        "{} / {}: {:.0} blocks/s, {:.0} outputs/s, ETA {}s",
+                        p.height, p.target_height, p.blocks_per_sec, p.outputs_per_sec, eta
+                    );
+                }
+            }
+        })),
+        &CANCEL,
+        &format!("http://{}", addr),
+    )
+    .await?;
+    let elapsed = start.elapsed().as_secs_f64();
+    println!(
+        "Synced in {:.1}s: {:.0} blocks/s",
+        elapsed,
+        block_count as f64 / elapsed
+    );
+    if fixture {
+        return Ok(());
+    }
+
+    let outputs = block_count as u64 * chain.config.outputs_per_block as u64;
+    println!("{:.0} outputs/s", outputs as f64 / elapsed);
+
+    let connection = Connection::open(&db_path)?;
+    let received: usize =
+        connection.query_row("SELECT COUNT(*) FROM received_notes", [], |row| row.get(0))?;
+    let spent: usize = connection.query_row(
+        "SELECT COUNT(*) FROM received_notes WHERE spent IS NOT NULL",
+        [],
+        |row| row.get(0),
+    )?;
+    let expected = chain.wallet_note_count(chain.tip_height());
+    let expected_spent = chain.wallet_spent_count();
+    println!(
+        "Received notes: {} (expected {}), spent: {} (expected {})",
+        received, expected, spent, expected_spent
+    );
+    if received != expected || spent != expected_spent {
+        anyhow::bail!("Wallet does not match the chain");
+    }
+    Ok(())
+}
@@ -1,57 +1,120 @@
-use crate::chain::to_output_description;
-use crate::{CompactTx, CompactTxStreamerClient, Exclude};
+use crate::chain::{to_output_description, Nf};
+use crate::{CompactTx, CompactTxStreamerClient, Exclude, RawTransaction};
 use std::collections::HashMap;
 use tonic::transport::Channel;
 use tonic::Request;
 
 use crate::coinconfig::CoinConfig;
-use zcash_primitives::consensus::BlockHeight;
-use zcash_primitives::sapling::note_encryption::try_sapling_compact_note_decryption;
+use zcash_note_encryption::batch::{try_compact_note_decryption, try_note_decryption};
+use zcash_params::coin::get_branch;
+use zcash_primitives::consensus::{BlockHeight, Network};
+use zcash_primitives::sapling::note_encryption::SaplingDomain;
 use zcash_primitives::sapling::SaplingIvk;
+use zcash_primitives::transaction::components::sapling::CompactOutputDescription;
+use zcash_primitives::transaction::Transaction;
 
 const DEFAULT_EXCLUDE_LEN: u8 = 1;
 
+type AccountBalances = HashMap<u32, i64>;
+
 struct MemPoolTransacton {
     #[allow(dead_code)]
-    balance: i64, // negative if spent
+    balances: AccountBalances, // negative if spent
     exclude_len: u8,
 }
 
+/// Unconfirmed transactions of every account of a coin
 pub struct MemPool {
     coin: u8,
+    account: u32,
     transactions: HashMap<Vec<u8>, MemPoolTransacton>,
-    nfs: HashMap<Vec<u8>, u64>,
-    balance: i64,
+    vks: Vec<(u32, SaplingIvk)>,
+    keys_loaded: bool,
+    balances: AccountBalances,
 }
 
 impl MemPool {
     pub fn new(coin: u8) -> MemPool {
         MemPool {
             coin,
+            account: 0,
             transactions: HashMap::new(),
-            nfs: HashMap::new(),
-            balance: 0,
+            vks: vec![],
+            keys_loaded: false,
+            balances: HashMap::new(),
         }
     }
 
+    /// Unconfirmed balance of the active account
     pub fn get_unconfirmed_balance(&self) -> i64 {
-        self.balance
+        self.get_account_unconfirmed_balance(self.account)
+    }
+
+    pub fn get_account_unconfirmed_balance(&self, account: u32) -> i64 {
+        self.balances.get(&account).copied().unwrap_or(0)
     }
 
+    pub fn get_unconfirmed_balances(&self) -> &AccountBalances {
+        &self.balances
+    }
+
+    /// Change the active account
+    ///
+    /// Balances are tracked for every account so there is nothing to
+    /// rescan unless the account was created after the last reset
+    pub fn set_account(&mut self, account: u32) -> anyhow::Result<()> {
+        self.account = account;
+        if !self.has_account(account) {
+            self.invalidate_keys();
+            self.clear()?;
+        }
+        Ok(())
+    }
+
+    /// Forget the unconfirmed transactions
+    ///
+    /// Spends are matched against the shared nullifier index so only
+    /// the viewing keys may need reloading
     pub fn clear(&mut self) -> anyhow::Result<()> {
         let c = CoinConfig::get(self.coin);
-        self.nfs = c.db()?.get_nullifier_amounts(c.id_account, true)?;
+        self.account = c.id_account;
+        self.load_keys()?;
         self.transactions.clear();
-        self.balance = 0;
+        self.balances.clear();
+        Ok(())
+    }
+
+    /// Reload the viewing keys before the next transaction
+    ///
+    /// Must be called when accounts are added or removed
+    pub fn invalidate_keys(&mut self) {
+        self.keys_loaded = false;
+    }
+
+    fn load_keys(&mut self) -> anyhow::Result<()> {
+        if !self.keys_loaded {
+            let c = CoinConfig::get(self.coin);
+            self.vks = c
+                .db()?
+                .get_fvks()?
+                .into_iter()
+                .map(|(account, vk)| (account, vk.ivk))
+                .collect();
+            self.keys_loaded = true;
+        }
         Ok(())
     }
 
+    fn has_account(&self, account: u32) -> bool {
+        self.vks.iter().any(|(id, _)| *id == account)
+    }
+
     pub async fn update(
         &mut self,
         client: &mut CompactTxStreamerClient<Channel>,
         height: u32,
-        ivk: &SaplingIvk,
     ) -> anyhow::Result<()> {
+        self.load_keys()?;
         let filter: Vec<_> = self
             .transactions
             .iter()
@@ -67,47 +130,139 @@ impl MemPool {
             .get_mempool_tx(Request::new(exclude))
             .await?
             .into_inner();
+        let mut new_txs: Vec<CompactTx> = vec![];
         while let Some(tx) = txs.message().await? {
             match self.transactions.get_mut(&*tx.hash) {
                 Some(tx) => {
                     tx.exclude_len += 1; // server sent us the same tx: make the filter more specific
                 }
                 None => {
-                    let balance = self.scan_transaction(height, &tx, ivk);
-                    let mempool_tx = MemPoolTransacton {
-                        balance,
-                        exclude_len: DEFAULT_EXCLUDE_LEN,
-                    };
-                    self.balance += balance;
-                    self.transactions.insert(tx.hash.clone(), mempool_tx);
+                    new_txs.push(tx);
                 }
             }
         }
 
+        // decrypt the new transactions in one batch
+        let balances = self.scan_transactions(height, &new_txs)?;
+        for (tx, balances) in new_txs.iter().zip(balances) {
+            self.add_transaction(tx.hash.clone(), balances);
+        }
+
         Ok(())
     }
 
-    fn scan_transaction(&self, height: u32, tx: &CompactTx, ivk: &SaplingIvk) -> i64 {
-        let c = CoinConfig::get_active();
-        let mut balance = 0i64;
-        for cs in tx.spends.iter() {
-            if let Some(&value) = self.nfs.get(&*cs.nf) {
-                // nf recognized -> value is spent
-                balance -= value as i64;
+    /// Add a full transaction pushed by the mempool stream
+    ///
+    /// Returns true if the unconfirmed balance of the active account changed
+    pub fn add_raw_transaction(
+        &mut self,
+        height: u32,
+        raw_tx: &RawTransaction,
+    ) -> anyhow::Result<bool> {
+        self.load_keys()?;
+        let c = CoinConfig::get(self.coin);
+        let network = *c.chain.network();
+        let tx = Transaction::read(&*raw_tx.data, get_branch(&network, height))?;
+        let txid = tx.txid().as_ref().to_vec();
+        if self.transactions.contains_key(&txid) {
+            return Ok(false); // already seen through get_mempool_tx
+        }
+
+        let mut balances = AccountBalances::new();
+        if let Some(sapling_bundle) = tx.sapling_bundle() {
+            {
+                let nfs = c.nf_index()?;
+                for spend in sapling_bundle.shielded_spends.iter() {
+                    if let Some(nf_ref) = nfs.get(&Nf(spend.nullifier.0)) {
+                        *balances.entry(nf_ref.account).or_default() -= nf_ref.value as i64;
+                    }
+                }
+            }
+            let height = BlockHeight::from_u32(height);
+            let outputs: Vec<_> = sapling_bundle
+                .shielded_outputs
+                .iter()
+                .map(|output| (SaplingDomain::for_height(network, height), output.clone()))
+                .collect();
+            if !outputs.is_empty() {
+                let notes = try_note_decryption(&self.ivks(), &outputs);
+                for (pos, note) in notes.iter().enumerate() {
+                    if let Some((note, _, _)) = note {
+                        let account = self.vks[pos / outputs.len()].0;
+                        *balances.entry(account).or_default() += note.value as i64;
+                    }
+                }
+            }
+        }
+
+        let changed = balances.get(&self.account).map_or(false, |&b| b != 0);
+        self.add_transaction(txid, balances);
+        Ok(changed)
+    }
+
+    fn add_transaction(&mut self, txid: Vec<u8>, balances: AccountBalances) {
+        for (&account, &balance) in balances.iter() {
+            *self.balances.entry(account).or_default() += balance;
+        }
+        let mempool_tx = MemPoolTransacton {
+            balances,
+            exclude_len: DEFAULT_EXCLUDE_LEN,
+        };
+        self.transactions.insert(txid, mempool_tx);
+    }
+
+    /// Trial decrypt the outputs of the transactions with the ivks
+    /// of every account in a single batch
+    ///
+    /// Returns the balance change of each account for every transaction
+    fn scan_transactions(
+        &self,
+        height: u32,
+        txs: &[CompactTx],
+    ) -> anyhow::Result<Vec<AccountBalances>> {
+        let c = CoinConfig::get(self.coin);
+        let network = *c.chain.network();
+        let height = BlockHeight::from_u32(height);
+        let mut balances = vec![AccountBalances::new(); txs.len()];
+        {
+            // the index is only locked to match the spends, not during the decryption
+            let nfs = c.nf_index()?;
+            for (tx_index, tx) in txs.iter().enumerate() {
+                for cs in tx.spends.iter() {
+                    if let Some(nf_ref) = nfs.get_slice(&cs.nf) {
+                        // nf recognized -> value is spent
+                        *balances[tx_index].entry(nf_ref.account).or_default() -=
+                            nf_ref.value as i64;
+                    }
+                }
             }
         }
-        for co in tx.outputs.iter() {
-            let od = to_output_description(co);
-            if let Some((note, _)) = try_sapling_compact_note_decryption(
-                c.chain.network(),
-                BlockHeight::from_u32(height),
-                ivk,
-                &od,
-            ) {
-                balance += note.value as i64; // value is incoming
+        let mut outputs: Vec<(SaplingDomain<Network>, CompactOutputDescription)> = vec![];
+        let mut output_tx_index: Vec<usize> = vec![];
+        for (tx_index, tx) in txs.iter().enumerate() {
+            for co in tx.outputs.iter() {
+                let od = to_output_description(co);
+                outputs.push((SaplingDomain::for_height(network, height), od));
+                output_tx_index.push(tx_index);
             }
         }
 
-        balance
+        if !outputs.is_empty() {
+            let notes = try_compact_note_decryption(&self.ivks(), &outputs);
+            for (pos, note) in notes.iter().enumerate() {
+                if let Some((note, _)) = note {
+                    let account = self.vks[pos / outputs.len()].0;
+                    let tx_index = output_tx_index[pos % outputs.len()];
+                    *balances[tx_index].entry(account).or_default() += note.value as i64;
+                    // value is incoming
+                }
+            }
+        }
+
+        Ok(balances)
+    }
+
+    fn ivks(&self) -> Vec<SaplingIvk> {
+        self.vks.iter().map(|(_, ivk)| ivk.clone()).collect()
     }
 }
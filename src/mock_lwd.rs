@@ -0,0 +1,898 @@
+use crate::chain_gen::ChainGenerator;
+use crate::lw_rpc::compact_tx_streamer_server::{CompactTxStreamer, CompactTxStreamerServer};
+use crate::lw_rpc::{
+    Address, AddressList, Balance, BlockId, BlockRange, ChainSpec, CompactBlock,
+    CompactSaplingOutput, CompactSaplingSpend, CompactTx, Empty, Exclude, GetAddressUtxosArg,
+    GetAddressUtxosReply, GetAddressUtxosReplyList, LightdInfo, PingResponse, RawTransaction,
+    SendResponse, TransparentAddressBlockFilter, TreeState, TxFilter,
+};
+use crate::{advance_tree, CTree};
+use blake2b_simd::Params;
+use ff::PrimeField;
+use futures::Stream;
+use prost::Message;
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::fs::File;
+use std::io::Read;
+use std::net::SocketAddr;
+use std::path::Path;
+use std::pin::Pin;
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+use tokio::net::TcpListener;
+use tokio::sync::mpsc;
+use tokio_stream::wrappers::{ReceiverStream, TcpListenerStream};
+use tonic::{Request, Response, Status, Streaming};
+use zcash_params::coin::get_branch;
+use zcash_primitives::consensus::Network;
+use zcash_primitives::sapling::Node;
+use zcash_primitives::transaction::Transaction;
+#[cfg(test)]
+use zcash_primitives::zip32::ExtendedFullViewingKey;
+
+const BATCH_SIZE: u32 = 100;
+const MIN_THROTTLE: Duration = Duration::from_millis(10);
+const MEMPOOL_POLL_INTERVAL: Duration = Duration::from_millis(100);
+
+type ResponseStream<T> = Pin<Box<dyn Stream<Item = Result<T, Status>> + Send>>;
+
+/// Blocks served by the mock server
+pub trait BlockSource: Send + Sync + 'static {
+    /// Height of the block before the first one, where the commitment tree is `initial_tree`
+    fn start_height(&self) -> u32;
+    fn tip_height(&self) -> u32;
+    fn initial_tree(&self) -> CTree {
+        CTree::new()
+    }
+    fn block_hash(&self, height: u32) -> [u8; 32];
+    fn block_time(&self, height: u32) -> u32;
+    fn block(&self, height: u32) -> CompactBlock;
+    fn blocks(&self, start: u32, end: u32) -> Vec<CompactBlock> {
+        (start..=end).map(|h| self.block(h)).collect()
+    }
+}
+
+impl BlockSource for ChainGenerator {
+    fn start_height(&self) -> u32 {
+        self.config.start_height
+    }
+
+    fn tip_height(&self) -> u32 {
+        ChainGenerator::tip_height(self)
+    }
+
+    fn block_hash(&self, height: u32) -> [u8; 32] {
+        ChainGenerator::block_hash(self, height)
+    }
+
+    fn block_time(&self, height: u32) -> u32 {
+        ChainGenerator::block_time(self, height)
+    }
+
+    fn block(&self, height: u32) -> CompactBlock {
+        ChainGenerator::block(self, height)
+    }
+
+    fn blocks(&self, start: u32, end: u32) -> Vec<CompactBlock> {
+        ChainGenerator::blocks(self, start, end)
+    }
+}
+
+/// Consecutive blocks recorded from a server
+///
+/// The file has the format of the bench fixtures: length delimited compact blocks
+pub struct BlockFixture {
+    tree: CTree,
+    blocks: Vec<CompactBlock>,
+}
+
+impl BlockFixture {
+    /// `tree` is the commitment tree before the first block
+    pub fn new(blocks: Vec<CompactBlock>, tree: CTree) -> anyhow::Result<Self> {
+        if blocks.is_empty() {
+            anyhow::bail!("No blocks in fixture");
+        }
+        for (a, b) in blocks.iter().zip(blocks.iter().skip(1)) {
+            if b.height != a.height + 1 || b.prev_hash != a.hash {
+                anyhow::bail!("Fixture blocks are not consecutive at {}", b.height);
+            }
+        }
+        Ok(BlockFixture { tree, blocks })
+    }
+
+    pub fn load(path: &Path, tree: CTree) -> anyhow::Result<Self> {
+        let mut data = vec![];
+        File::open(path)?.read_to_end(&mut data)?;
+        let mut buf = &data[..];
+        let mut blocks = vec![];
+        while !buf.is_empty() {
+            blocks.push(CompactBlock::decode_length_delimited(&mut buf)?);
+        }
+        Self::new(blocks, tree)
+    }
+
+    fn get(&self, height: u32) -> &CompactBlock {
+        &self.blocks[(height - self.start_height() - 1) as usize]
+    }
+}
+
+impl BlockSource for BlockFixture {
+    fn start_height(&self) -> u32 {
+        self.blocks[0].height as u32 - 1
+    }
+
+    fn tip_height(&self) -> u32 {
+        self.blocks.last().unwrap().height as u32
+    }
+
+    fn initial_tree(&self) -> CTree {
+        self.tree.clone()
+    }
+
+    fn block_hash(&self, height: u32) -> [u8; 32] {
+        let hash = if height == self.start_height() {
+            &self.blocks[0].prev_hash
+        } else {
+            &self.get(height).hash
+        };
+        let mut h = [0u8; 32];
+        h.copy_from_slice(hash);
+        h
+    }
+
+    fn block_time(&self, height: u32) -> u32 {
+        self.get(height.max(self.start_height() + 1)).time
+    }
+
+    fn block(&self, height: u32) -> CompactBlock {
+        self.get(height).clone()
+    }
+}
+
+/// Network conditions simulated by the mock server
+#[derive(Clone, Copy, Debug, Default)]
+pub struct NetworkConditions {
+    /// Delay before every response
+    pub latency: Duration,
+    /// Bytes per second of the block streams, 0 for no limit
+    pub bandwidth: u64,
+}
+
+#[derive(Default)]
+struct MockState {
+    conditions: NetworkConditions,
+    tip_height: u32,
+    /// (first height, fork id) of every injected reorg, in order
+    forks: Vec<(u32, u32)>,
+    transactions: HashMap<Vec<u8>, RawTransaction>,
+    mempool: Vec<CompactTx>,
+    utxos: Vec<GetAddressUtxosReply>,
+}
+
+/// Lightwalletd that serves blocks from a `BlockSource`
+///
+/// The server can be slowed down and reorgs injected while a client is
+/// connected. Reorgs change the hashes of the blocks but not their content
+pub struct MockLightwalletd {
+    network: Network,
+    source: Arc<dyn BlockSource>,
+    state: Arc<Mutex<MockState>>,
+    trees: Arc<Mutex<BTreeMap<u32, CTree>>>,
+}
+
+impl MockLightwalletd {
+    pub fn new(network: Network, source: Arc<dyn BlockSource>) -> Self {
+        let mut trees = BTreeMap::new();
+        trees.insert(source.start_height(), source.initial_tree());
+        let state = MockState {
+            tip_height: source.tip_height(),
+            ..MockState::default()
+        };
+        MockLightwalletd {
+            network,
+            source,
+            state: Arc::new(Mutex::new(state)),
+            trees: Arc::new(Mutex::new(trees)),
+        }
+    }
+
+    pub fn set_conditions(&self, conditions: NetworkConditions) {
+        self.state.lock().unwrap().conditions = conditions;
+    }
+
+    /// Only serve the blocks up to `height`, to simulate new blocks with later calls
+    pub fn set_tip_height(&self, height: u32) {
+        let height = height.clamp(self.source.start_height(), self.source.tip_height());
+        self.state.lock().unwrap().tip_height = height;
+    }
+
+    pub fn tip_height(&self) -> u32 {
+        self.state.lock().unwrap().tip_height
+    }
+
+    /// Replace the last `depth` blocks by blocks with other hashes
+    pub fn reorg(&self, depth: u32) {
+        let mut state = self.state.lock().unwrap();
+        let height = (state.tip_height + 1)
+            .saturating_sub(depth)
+            .max(self.source.start_height() + 1);
+        let fork = state.forks.len() as u32 + 1;
+        log::info!("Mock reorg from {} to {}", height, state.tip_height);
+        state.forks.push((height, fork));
+    }
+
+    /// Make a transaction available to `get_transaction`
+    pub fn add_transaction(&self, tx: RawTransaction) -> anyhow::Result<Vec<u8>> {
+        let height = (tx.height as u32).max(self.tip_height());
+        let parsed = Transaction::read(&*tx.data, get_branch(&self.network, height))?;
+        let txid = parsed.txid().as_ref().to_vec();
+        self.state
+            .lock()
+            .unwrap()
+            .transactions
+            .insert(txid.clone(), tx);
+        Ok(txid)
+    }
+
+    pub fn add_utxo(&self, utxo: GetAddressUtxosReply) {
+        self.state.lock().unwrap().utxos.push(utxo);
+    }
+
+    async fn delay(&self) {
+        let latency = self.state.lock().unwrap().conditions.latency;
+        if !latency.is_zero() {
+            tokio::time::sleep(latency).await;
+        }
+    }
+
+    fn check_height(&self, height: u64) -> Result<u32, Status> {
+        let height = height as u32;
+        if height < self.source.start_height() || height > self.tip_height() {
+            return Err(Status::out_of_range(format!("No block at {}", height)));
+        }
+        Ok(height)
+    }
+
+    fn forks(&self) -> Vec<(u32, u32)> {
+        self.state.lock().unwrap().forks.clone()
+    }
+
+    fn block_hash(&self, height: u32) -> [u8; 32] {
+        fork_hash(&self.forks(), height, self.source.block_hash(height))
+    }
+
+    /// Tree at `height`, continued from the closest tree computed before
+    fn tree_at(
+        source: &dyn BlockSource,
+        trees: &Mutex<BTreeMap<u32, CTree>>,
+        height: u32,
+    ) -> CTree {
+        let (from_height, mut tree) = {
+            let trees = trees.lock().unwrap();
+            let (&h, t) = trees.range(..=height).next_back().unwrap();
+            (h, t.clone())
+        };
+        let mut h = from_height + 1;
+        while h <= height {
+            let end = (h + BATCH_SIZE * 10 - 1).min(height);
+            let mut nodes: Vec<Node> = source
+                .blocks(h, end)
+                .iter()
+                .flat_map(|b| b.vtx.iter())
+                .flat_map(|tx| tx.outputs.iter())
+                .map(|co| {
+                    let mut cmu = [0u8; 32];
+                    cmu.copy_from_slice(&co.cmu);
+                    Node::new(cmu)
+                })
+                .collect();
+            let (t, _) = advance_tree(&tree, &[], &mut nodes, true);
+            let (t, _) = advance_tree(&t, &[], &mut [], false);
+            tree = t;
+            h = end + 1;
+        }
+        trees.lock().unwrap().insert(height, tree.clone());
+        tree
+    }
+}
+
+/// Hash of a block after the reorgs in `forks`
+fn fork_hash(forks: &[(u32, u32)], height: u32, hash: [u8; 32]) -> [u8; 32] {
+    let mut hash = hash;
+    for &(fork_height, fork) in forks.iter() {
+        if height >= fork_height {
+            let mut data = hash.to_vec();
+            data.extend_from_slice(&fork.to_le_bytes());
+            let h = Params::new()
+                .hash_length(32)
+                .personal(b"WarpMockLwdReorg")
+                .hash(&data);
+            hash.copy_from_slice(h.as_bytes());
+        }
+    }
+    hash
+}
+
+fn apply_forks(forks: &[(u32, u32)], mut block: CompactBlock) -> CompactBlock {
+    if forks.is_empty() {
+        return block;
+    }
+    let height = block.height as u32;
+    let mut hash = [0u8; 32];
+    hash.copy_from_slice(&block.hash);
+    let mut prev_hash = [0u8; 32];
+    prev_hash.copy_from_slice(&block.prev_hash);
+    block.hash = fork_hash(forks, height, hash).to_vec();
+    block.prev_hash = fork_hash(forks, height - 1, prev_hash).to_vec();
+    block
+}
+
+/// Compact form of a transaction for the mempool stream
+fn to_compact_tx(txid: &[u8], tx: &Transaction) -> CompactTx {
+    let mut ctx = CompactTx {
+        hash: txid.to_vec(),
+        ..CompactTx::default()
+    };
+    if let Some(bundle) = tx.sapling_bundle() {
+        ctx.spends = bundle
+            .shielded_spends
+            .iter()
+            .map(|s| CompactSaplingSpend {
+                nf: s.nullifier.0.to_vec(),
+            })
+            .collect();
+        ctx.outputs = bundle
+            .shielded_outputs
+            .iter()
+            .map(|o| CompactSaplingOutput {
+                cmu: o.cmu.to_repr().to_vec(),
+                epk: o.ephemeral_key.0.to_vec(),
+                ciphertext: o.enc_ciphertext[..52].to_vec(),
+            })
+            .collect();
+    }
+    ctx
+}
+
+#[tonic::async_trait]
+impl CompactTxStreamer for MockLightwalletd {
+    async fn get_latest_block(
+        &self,
+        _request: Request<ChainSpec>,
+    ) -> Result<Response<BlockId>, Status> {
+        self.delay().await;
+        let height = self.tip_height();
+        Ok(Response::new(BlockId {
+            height: height as u64,
+            hash: self.block_hash(height).to_vec(),
+        }))
+    }
+
+    async fn get_block(&self, request: Request<BlockId>) -> Result<Response<CompactBlock>, Status> {
+        self.delay().await;
+        let height = self.check_height(request.into_inner().height)?;
+        let source = self.source.clone();
+        let block = tokio::task::spawn_blocking(move || source.block(height))
+            .await
+            .map_err(|e| Status::internal(e.to_string()))?;
+        Ok(Response::new(apply_forks(&self.forks(), block)))
+    }
+
+    type GetBlockRangeStream = ResponseStream<CompactBlock>;
+
+    async fn get_block_range(
+        &self,
+        request: Request<BlockRange>,
+    ) -> Result<Response<Self::GetBlockRangeStream>, Status> {
+        self.delay().await;
+        let range = request.into_inner();
+        let start = self.check_height(range.start.map(|b| b.height).unwrap_or_default())?;
+        let end = self.check_height(range.end.map(|b| b.height).unwrap_or_default())?;
+        let source = self.source.clone();
+        let forks = self.forks();
+        let bandwidth = self.state.lock().unwrap().conditions.bandwidth;
+        let (tx, rx) = mpsc::channel(BATCH_SIZE as usize * 2);
+        tokio::task::spawn_blocking(move || {
+            let mut throttle = Duration::ZERO;
+            let mut height = start;
+            while height <= end {
+                let batch_end = (height + BATCH_SIZE - 1).min(end);
+                for block in source.blocks(height, batch_end) {
+                    if bandwidth != 0 {
+                        throttle +=
+                            Duration::from_secs_f64(block.encoded_len() as f64 / bandwidth as f64);
+                        if throttle >= MIN_THROTTLE {
+                            std::thread::sleep(throttle);
+                            throttle = Duration::ZERO;
+                        }
+                    }
+                    if tx.blocking_send(Ok(apply_forks(&forks, block))).is_err() {
+                        return; // client went away
+                    }
+                }
+                height = batch_end + 1;
+            }
+        });
+        let stream: Self::GetBlockRangeStream = Box::pin(ReceiverStream::new(rx));
+        Ok(Response::new(stream))
+    }
+
+    async fn get_transaction(
+        &self,
+        request: Request<TxFilter>,
+    ) -> Result<Response<RawTransaction>, Status> {
+        self.delay().await;
+        let hash = request.into_inner().hash;
+        let state = self.state.lock().unwrap();
+        match state.transactions.get(&hash) {
+            Some(tx) => Ok(Response::new(tx.clone())),
+            None => Err(Status::not_found(hex::encode(&hash))),
+        }
+    }
+
+    async fn send_transaction(
+        &self,
+        request: Request<RawTransaction>,
+    ) -> Result<Response<SendResponse>, Status> {
+        self.delay().await;
+        let raw_tx = request.into_inner();
+        let height = (raw_tx.height as u32).max(self.tip_height());
+        let tx = match Transaction::read(&*raw_tx.data, get_branch(&self.network, height)) {
+            Ok(tx) => tx,
+            Err(e) => {
+                return Ok(Response::new(SendResponse {
+                    error_code: -1,
+                    error_message: e.to_string(),
+                }))
+            }
+        };
+        let txid = tx.txid().as_ref().to_vec();
+        let mut state = self.state.lock().unwrap();
+        state.mempool.push(to_compact_tx(&txid, &tx));
+        state.transactions.insert(txid, raw_tx);
+        Ok(Response::new(SendResponse {
+            error_code: 0,
+            error_message: tx.txid().to_string(),
+        }))
+    }
+
+    type GetTaddressTxidsStream = ResponseStream<RawTransaction>;
+
+    async fn get_taddress_txids(
+        &self,
+        _request: Request<TransparentAddressBlockFilter>,
+    ) -> Result<Response<Self::GetTaddressTxidsStream>, Status> {
+        Err(Status::unimplemented("get_taddress_txids"))
+    }
+
+    async fn get_taddress_balance(
+        &self,
+        request: Request<AddressList>,
+    ) -> Result<Response<Balance>, Status> {
+        self.delay().await;
+        let addresses = request.into_inner().addresses;
+        let state = self.state.lock().unwrap();
+        let value_zat = state
+            .utxos
+            .iter()
+            .filter(|u| addresses.contains(&u.address))
+            .map(|u| u.value_zat)
+            .sum();
+        Ok(Response::new(Balance { value_zat }))
+    }
+
+    async fn get_taddress_balance_stream(
+        &self,
+        _request: Request<Streaming<Address>>,
+    ) -> Result<Response<Balance>, Status> {
+        Err(Status::unimplemented("get_taddress_balance_stream"))
+    }
+
+    type GetMempoolTxStream = ResponseStream<CompactTx>;
+
+    async fn get_mempool_tx(
+        &self,
+        request: Request<Exclude>,
+    ) -> Result<Response<Self::GetMempoolTxStream>, Status> {
+        self.delay().await;
+        let exclude = request.into_inner().txid;
+        let txs: Vec<Result<CompactTx, Status>> = {
+            let state = self.state.lock().unwrap();
+            state
+                .mempool
+                .iter()
+                .filter(|tx| !exclude.iter().any(|prefix| tx.hash.starts_with(prefix)))
+                .map(|tx| Ok(tx.clone()))
+                .collect()
+        };
+        let stream: Self::GetMempoolTxStream = Box::pin(futures::stream::iter(txs));
+        Ok(Response::new(stream))
+    }
+
+    type GetMempoolStreamStream = ResponseStream<RawTransaction>;
+
+    /// Stream the transactions of the mempool, then the new ones as they are sent,
+    /// until the next block
+    async fn get_mempool_stream(
+        &self,
+        _request: Request<Empty>,
+    ) -> Result<Response<Self::GetMempoolStreamStream>, Status> {
+        self.delay().await;
+        let state = self.state.clone();
+        let tip_height = self.tip_height();
+        let (tx, rx) = mpsc::channel(BATCH_SIZE as usize);
+        tokio::spawn(async move {
+            let mut sent: HashSet<Vec<u8>> = HashSet::new();
+            loop {
+                let (height, raw_txs) = {
+                    let state = state.lock().unwrap();
+                    let raw_txs: Vec<_> = state
+                        .mempool
+                        .iter()
+                        .filter(|ctx| !sent.contains(&ctx.hash))
+                        .filter_map(|ctx| {
+                            let raw_tx = state.transactions.get(&ctx.hash)?;
+                            Some((ctx.hash.clone(), raw_tx.clone()))
+                        })
+                        .collect();
+                    (state.tip_height, raw_txs)
+                };
+                for (txid, raw_tx) in raw_txs {
+                    sent.insert(txid);
+                    if tx.send(Ok(raw_tx)).await.is_err() {
+                        return; // client went away
+                    }
+                }
+                if height != tip_height {
+                    return; // new block
+                }
+                tokio::time::sleep(MEMPOOL_POLL_INTERVAL).await;
+            }
+        });
+        let stream: Self::GetMempoolStreamStream = Box::pin(ReceiverStream::new(rx));
+        Ok(Response::new(stream))
+    }
+
+    async fn get_tree_state(
+        &self,
+        request: Request<BlockId>,
+    ) -> Result<Response<TreeState>, Status> {
+        self.delay().await;
+        let height = self.check_height(request.into_inner().height)?;
+        let source = self.source.clone();
+        let trees = self.trees.clone();
+        let tree = tokio::task::spawn_blocking(move || Self::tree_at(&*source, &trees, height))
+            .await
+            .map_err(|e| Status::internal(e.to_string()))?;
+        let mut data = vec![];
+        tree.write(&mut data)
+            .map_err(|e| Status::internal(e.to_string()))?;
+        Ok(Response::new(TreeState {
+            network: "main".to_string(),
+            height: height as u64,
+            hash: hex::encode(self.block_hash(height)),
+            time: self.source.block_time(height),
+            sapling_tree: hex::encode(&data),
+            orchard_tree: String::new(),
+        }))
+    }
+
+    async fn get_address_utxos(
+        &self,
+        request: Request<GetAddressUtxosArg>,
+    ) -> Result<Response<GetAddressUtxosReplyList>, Status> {
+        self.delay().await;
+        let arg = request.into_inner();
+        let state = self.state.lock().unwrap();
+        let mut address_utxos: Vec<GetAddressUtxosReply> = state
+            .utxos
+            .iter()
+            .filter(|u| arg.addresses.contains(&u.address) && u.height >= arg.start_height)
+            .cloned()
+            .collect();
+        if arg.max_entries != 0 {
+            address_utxos.truncate(arg.max_entries as usize);
+        }
+        Ok(Response::new(GetAddressUtxosReplyList { address_utxos }))
+    }
+
+    type GetAddressUtxosStreamStream = ResponseStream<GetAddressUtxosReply>;
+
+    async fn get_address_utxos_stream(
+        &self,
+        _request: Request<GetAddressUtxosArg>,
+    ) -> Result<Response<Self::GetAddressUtxosStreamStream>, Status> {
+        Err(Status::unimplemented("get_address_utxos_stream"))
+    }
+
+    async fn get_lightd_info(
+        &self,
+        _request: Request<Empty>,
+    ) -> Result<Response<LightdInfo>, Status> {
+        self.delay().await;
+        let height = self.tip_height() as u64;
+        Ok(Response::new(LightdInfo {
+            vendor: "warp mock".to_string(),
+            chain_name: "main".to_string(),
+            sapling_activation_height: self.source.start_height() as u64,
+            block_height: height,
+            estimated_height: height,
+            ..LightdInfo::default()
+        }))
+    }
+
+    async fn ping(
+        &self,
+        _request: Request<crate::lw_rpc::Duration>,
+    ) -> Result<Response<PingResponse>, Status> {
+        Err(Status::unimplemented("ping"))
+    }
+}
+
+/// Serve `server` on `addr` until the task is dropped
+///
+/// Keep a clone of `server` to change its conditions or inject reorgs
+pub async fn serve_mock_lightwalletd(
+    server: Arc<MockLightwalletd>,
+    addr: SocketAddr,
+) -> anyhow::Result<()> {
+    let listener = TcpListener::bind(addr).await?;
+    serve_mock_lightwalletd_on(server, listener).await
+}
+
+/// Serve `server` on a listener that is already bound, e.g. to port 0
+pub async fn serve_mock_lightwalletd_on(
+    server: Arc<MockLightwalletd>,
+    listener: TcpListener,
+) -> anyhow::Result<()> {
+    log::info!(
+        "Mock lightwalletd on {} up to {}",
+        listener.local_addr()?,
+        server.tip_height()
+    );
+    tonic::transport::Server::builder()
+        .add_service(CompactTxStreamerServer::from_arc(server))
+        .serve_with_incoming(TcpListenerStream::new(listener))
+        .await?;
+    Ok(())
+}
+
+/// Serve `server` on a free local port and return its url
+#[cfg(test)]
+pub(crate) async fn spawn_mock_lightwalletd(
+    server: Arc<MockLightwalletd>,
+) -> anyhow::Result<String> {
+    let listener = TcpListener::bind("127.0.0.1:0").await?;
+    let url = format!("http://{}", listener.local_addr()?);
+    tokio::spawn(serve_mock_lightwalletd_on(server, listener));
+    Ok(url)
+}
+
+/// Create a wallet database with an account for each of `fvks`
+///
+/// Returns the ids of the accounts
+#[cfg(test)]
+pub(crate) fn create_test_wallet(
+    network: Network,
+    db_path: &str,
+    fvks: &[ExtendedFullViewingKey],
+) -> anyhow::Result<Vec<u32>> {
+    use zcash_client_backend::encoding::{
+        encode_extended_full_viewing_key, encode_payment_address,
+    };
+    use zcash_primitives::consensus::Parameters;
+
+    let _ = std::fs::remove_file(db_path);
+    let db = crate::DbAdapter::new(zcash_params::coin::CoinType::Zcash, db_path)?;
+    db.init_db()?;
+    let mut accounts = vec![];
+    for (i, fvk) in fvks.iter().enumerate() {
+        let efvk =
+            encode_extended_full_viewing_key(network.hrp_sapling_extended_full_viewing_key(), fvk);
+        let (_, pa) = fvk.default_address();
+        let address = encode_payment_address(network.hrp_sapling_payment_address(), &pa);
+        let (id_account, _) =
+            db.store_account(&format!("test-{}", i), None, 0, None, &efvk, &address)?;
+        accounts.push(id_account);
+    }
+    Ok(accounts)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chain_gen::ChainGenConfig;
+    use crate::{
+        connect_lightwalletd, download_chain, sync_async, ChainError, CheckpointPolicy,
+        SyncProgress,
+    };
+    use rusqlite::Connection;
+    use std::sync::atomic::AtomicBool;
+    use zcash_params::coin::CoinType;
+
+    static CANCEL: AtomicBool = AtomicBool::new(false);
+
+    async fn download(
+        url: &str,
+        start: u32,
+        end: u32,
+        prev_hash: Option<[u8; 32]>,
+        stored_blocks: Vec<(u32, Vec<u8>)>,
+    ) -> anyhow::Result<Vec<CompactBlock>> {
+        let mut client = connect_lightwalletd(url).await?;
+        let (blocks_tx, mut blocks_rx) = mpsc::channel(1);
+        let downloader = tokio::spawn(async move {
+            download_chain(
+                &mut client,
+                start,
+                end,
+                prev_hash,
+                &stored_blocks,
+                &CheckpointPolicy::default(),
+                blocks_tx,
+                &CANCEL,
+            )
+            .await
+        });
+        let mut blocks = vec![];
+        while let Some(chunk) = blocks_rx.recv().await {
+            blocks.extend(chunk.0);
+        }
+        downloader.await??;
+        Ok(blocks)
+    }
+
+    #[tokio::test(flavor = "multi_thread")]
+    async fn test_mock_reorg() -> anyhow::Result<()> {
+        let config = ChainGenConfig {
+            block_count: 200,
+            outputs_per_block: 4,
+            ..ChainGenConfig::default()
+        };
+        let chain = Arc::new(ChainGenerator::new(Network::MainNetwork, config, vec![]));
+        let start = chain.config.start_height;
+        let server = Arc::new(MockLightwalletd::new(Network::MainNetwork, chain));
+        server.set_tip_height(start + 100);
+        let url = spawn_mock_lightwalletd(server.clone()).await?;
+
+        let blocks = download(&url, start, start + 100, None, vec![]).await?;
+        assert_eq!(blocks.len(), 100);
+        let mut last_hash = [0u8; 32];
+        last_hash.copy_from_slice(&blocks[99].hash);
+
+        // the last 10 blocks change while the client is away
+        server.reorg(10);
+        server.set_tip_height(start + 200);
+        let stored_blocks = blocks
+            .iter()
+            .rev()
+            .map(|b| (b.height as u32, b.hash.clone()))
+            .collect();
+        let r = download(
+            &url,
+            start + 100,
+            start + 200,
+            Some(last_hash),
+            stored_blocks,
+        )
+        .await;
+        assert!(matches!(
+            r.unwrap_err().downcast_ref::<ChainError>(),
+            Some(ChainError::Reorg(Some(h))) if *h == start + 90
+        ));
+
+        let mut fork_point = [0u8; 32];
+        fork_point.copy_from_slice(&blocks[89].hash);
+        let blocks = download(&url, start + 90, start + 200, Some(fork_point), vec![]).await?;
+        assert_eq!(blocks.len(), 110);
+        Ok(())
+    }
+
+    /// Transaction without inputs or outputs, told apart by its lock time
+    fn empty_transaction(height: u32, lock_time: u32) -> RawTransaction {
+        use zcash_primitives::consensus::{BlockHeight, BranchId};
+        use zcash_primitives::transaction::{Authorized, TransactionData, TxVersion};
+
+        let branch_id = BranchId::for_height(&Network::MainNetwork, BlockHeight::from_u32(height));
+        let tx = TransactionData::<Authorized>::from_parts(
+            TxVersion::suggested_for_branch(branch_id),
+            branch_id,
+            lock_time,
+            BlockHeight::from_u32(height + 20),
+            None,
+            None,
+            None,
+            None,
+        )
+        .freeze()
+        .unwrap();
+        let mut data = vec![];
+        tx.write(&mut data).unwrap();
+        RawTransaction {
+            data,
+            height: height as u64,
+        }
+    }
+
+    #[tokio::test]
+    async fn test_mempool_stream() -> anyhow::Result<()> {
+        let config = ChainGenConfig {
+            block_count: 20,
+            ..ChainGenConfig::default()
+        };
+        let chain = Arc::new(ChainGenerator::new(Network::MainNetwork, config, vec![]));
+        let server = Arc::new(MockLightwalletd::new(Network::MainNetwork, chain.clone()));
+        let height = chain.tip_height() - 10;
+        server.set_tip_height(height);
+        let url = spawn_mock_lightwalletd(server.clone()).await?;
+        let mut client = connect_lightwalletd(&url).await?;
+
+        let tx1 = empty_transaction(height, 1);
+        client.send_transaction(Request::new(tx1.clone())).await?;
+        let mut txs = client
+            .get_mempool_stream(Request::new(Empty {}))
+            .await?
+            .into_inner();
+        assert_eq!(txs.message().await?.map(|tx| tx.data), Some(tx1.data));
+
+        // sent while the stream is open
+        let tx2 = empty_transaction(height, 2);
+        client.send_transaction(Request::new(tx2.clone())).await?;
+        assert_eq!(txs.message().await?.map(|tx| tx.data), Some(tx2.data));
+
+        // a new block closes the stream
+        server.set_tip_height(height + 1);
+        assert!(txs.message().await?.is_none());
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_sync_with_mock() -> anyhow::Result<()> {
+        let config = ChainGenConfig {
+            block_count: 100,
+            outputs_per_block: 20,
+            spends_per_block: 5,
+            wallet_output_rate: 0.05,
+            wallet_spend_delay: 10,
+            ..ChainGenConfig::default()
+        };
+        let fvks = ChainGenerator::test_fvks(2);
+        let chain = Arc::new(ChainGenerator::new(
+            Network::MainNetwork,
+            config,
+            fvks.clone(),
+        ));
+        let server = Arc::new(MockLightwalletd::new(Network::MainNetwork, chain.clone()));
+        let url = spawn_mock_lightwalletd(server).await?;
+
+        let db_path =
+            std::env::temp_dir().join(format!("warp-mock-sync-{}.db", std::process::id()));
+        let db_path = db_path.to_string_lossy().to_string();
+        create_test_wallet(Network::MainNetwork, &db_path, &fvks)?;
+        sync_async(
+            CoinType::Zcash,
+            0,
+            false,
+            &db_path,
+            0,
+            Arc::new(tokio::sync::Mutex::new(|_: &SyncProgress| {})),
+            &CANCEL,
+            &url,
+        )
+        .await?;
+
+        let connection = Connection::open(&db_path)?;
+        let received: usize =
+            connection.query_row("SELECT COUNT(*) FROM received_notes", [], |row| row.get(0))?;
+        let spent: usize = connection.query_row(
+            "SELECT COUNT(*) FROM received_notes WHERE spent IS NOT NULL",
+            [],
+            |row| row.get(0),
+        )?;
+        assert!(chain.wallet_spent_count() > 0);
+        assert_eq!(received, chain.wallet_note_count(chain.tip_height()));
+        assert_eq!(spent, chain.wallet_spent_count());
+        let _ = std::fs::remove_file(&db_path);
+        Ok(())
+    }
+}
@@ -0,0 +1,186 @@
+use crate::address_cache::AddressCache;
+use crate::chain::DecryptedNote;
+use crate::db::{DbAdapter, SpendableNote};
+use crate::Witness;
+use std::collections::{BTreeMap, HashMap};
+use zcash_primitives::merkle_tree::IncrementalWitness;
+use zcash_primitives::sapling::{Node, Rseed};
+
+const MAX_CACHED_CHECKPOINTS: usize = 4;
+
+/// Notes with their payment address and witness, by id
+type Checkpoint = HashMap<u32, SpendableNote>;
+
+/// Spendable notes of every account, ready to be used by the transaction builder
+///
+/// The notes are kept for the most recent checkpoints, i.e. the heights at which
+/// the sync stores the witnesses. A cached checkpoint has every note that had a witness
+/// at its height. Spent notes are removed as the sync finds them but whether a note
+/// can be spent is still checked against the database because the app
+/// may exclude notes or cancel spends on its own
+#[derive(Default)]
+pub struct NoteCache {
+    checkpoints: BTreeMap<u32, Checkpoint>,
+}
+
+impl NoteCache {
+    /// Same as `DbAdapter::get_spendable_notes` but without rebuilding
+    /// the notes and witnesses of a cached checkpoint
+    pub fn get_spendable_notes(
+        &mut self,
+        db: &DbAdapter,
+        addresses: &mut AddressCache,
+        account: u32,
+        anchor_height: u32,
+    ) -> anyhow::Result<Vec<SpendableNote>> {
+        let height = match db.get_checkpoint_height(anchor_height)? {
+            Some(height) => height,
+            None => return Ok(vec![]),
+        };
+        if !self.checkpoints.contains_key(&height) {
+            let notes = db.get_checkpoint_notes(height, addresses)?;
+            self.insert(height, notes);
+        }
+        let checkpoint = &self.checkpoints[&height];
+        let notes = db
+            .get_spendable_note_ids(account)?
+            .iter()
+            .filter_map(|id_note| checkpoint.get(id_note).cloned())
+            .collect();
+        Ok(notes)
+    }
+
+    /// Add the checkpoint stored by the sync at `height`
+    ///
+    /// The notes that already had a witness are taken from the previous checkpoint.
+    /// If it is not cached, the new checkpoint is left to be loaded on demand
+    pub fn add_checkpoint(
+        &mut self,
+        prev_height: u32,
+        height: u32,
+        witnesses: &[Witness],
+    ) -> anyhow::Result<()> {
+        let prev = self.checkpoints.get(&prev_height);
+        if prev.is_none() && witnesses.iter().any(|w| w.note.is_none()) {
+            return Ok(());
+        }
+        let mut checkpoint = Checkpoint::new();
+        for w in witnesses.iter() {
+            let witness = to_incremental_witness(w)?;
+            let note = match (&w.note, prev.and_then(|p| p.get(&w.id_note))) {
+                (Some(n), _) => Some(new_spendable_note(w.id_note, n, witness)),
+                (None, Some(n)) => Some(SpendableNote {
+                    witness,
+                    ..n.clone()
+                }),
+                (None, None) => None, // spent since the previous checkpoint
+            };
+            if let Some(note) = note {
+                checkpoint.insert(w.id_note, note);
+            }
+        }
+        self.insert(height, checkpoint);
+        Ok(())
+    }
+
+    /// Drop the notes spent by the sync
+    pub fn remove_spent(&mut self, id_notes: &[u32]) {
+        for checkpoint in self.checkpoints.values_mut() {
+            for id_note in id_notes.iter() {
+                checkpoint.remove(id_note);
+            }
+        }
+    }
+
+    /// Drop the checkpoints deleted by a rewind to `height`
+    ///
+    /// The notes whose spend was rolled back are missing from the older checkpoints,
+    /// if there are any, these checkpoints are dropped too and reloaded on demand
+    pub fn rewind(&mut self, height: u32, unspent_notes: bool) {
+        if unspent_notes {
+            self.checkpoints.clear();
+        } else {
+            self.checkpoints.split_off(&height);
+        }
+    }
+
+    pub fn invalidate(&mut self) {
+        self.checkpoints.clear();
+    }
+
+    fn insert(&mut self, height: u32, checkpoint: Checkpoint) {
+        self.checkpoints.insert(height, checkpoint);
+        while self.checkpoints.len() > MAX_CACHED_CHECKPOINTS {
+            let oldest = *self.checkpoints.keys().next().unwrap();
+            self.checkpoints.remove(&oldest);
+        }
+    }
+}
+
+fn new_spendable_note(
+    id_note: u32,
+    n: &DecryptedNote,
+    witness: IncrementalWitness<Node>,
+) -> SpendableNote {
+    // notes are spent with their rcm, like the ones loaded from the database
+    let rseed = Rseed::BeforeZip212(n.note.rcm());
+    SpendableNote {
+        id: id_note,
+        note: n.pa.create_note(n.note.value, rseed).unwrap(),
+        diversifier: *n.pa.diversifier(),
+        witness,
+    }
+}
+
+fn to_incremental_witness(w: &Witness) -> anyhow::Result<IncrementalWitness<Node>> {
+    let mut bb: Vec<u8> = vec![];
+    w.write(&mut bb)?;
+    Ok(IncrementalWitness::<Node>::read(&*bb)?)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::pay::TxBuilder;
+    use crate::{advance_tree, CTree};
+    use ff::PrimeField;
+    use zcash_params::coin::CoinType;
+    use zcash_primitives::zip32::{ExtendedFullViewingKey, ExtendedSpendingKey};
+
+    #[test]
+    fn test_cached_post_canopy_note_is_spendable() {
+        let height = 1_700_000;
+        let fvk = ExtendedFullViewingKey::from(&ExtendedSpendingKey::master(&[1u8; 32]));
+        let (_, pa) = fvk.default_address();
+        let note = pa
+            .create_note(100_000, Rseed::AfterZip212([2u8; 32]))
+            .unwrap();
+        let cmu = Node::new(note.cmu().to_repr());
+        let decrypted = DecryptedNote {
+            account: 0,
+            ivk: fvk.clone(),
+            note,
+            pa,
+            position_in_block: 0,
+            viewonly: false,
+            height,
+            txid: vec![0u8; 32],
+            tx_index: 0,
+            output_index: 0,
+        };
+        let witnesses = [Witness::new(0, 1, Some(decrypted))];
+        let (tree, witnesses) = advance_tree(&CTree::new(), &witnesses, &mut [cmu], true);
+        let (_, witnesses) = advance_tree(&tree, &witnesses, &mut [], false);
+
+        let mut cache = NoteCache::default();
+        cache
+            .add_checkpoint(height - 1, height, &witnesses)
+            .unwrap();
+        let notes: Vec<_> = cache.checkpoints[&height].values().cloned().collect();
+        assert_eq!(notes.len(), 1);
+
+        let mut tx_builder = TxBuilder::new(CoinType::Zcash, height);
+        let selected = tx_builder.select_inputs(&fvk, &notes, &[], 50_000).unwrap();
+        assert_eq!(selected, vec![1]);
+    }
+}
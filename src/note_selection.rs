@@ -0,0 +1,265 @@
+use rand::prelude::SliceRandom;
+use rand::rngs::OsRng;
+use serde::{Deserialize, Serialize};
+
+const MAX_BNB_TRIES: usize = 100_000;
+
+/// How the notes of a payment are picked
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Serialize, Deserialize)]
+pub enum NoteSelectionStrategy {
+    /// Shuffle the notes and take them until the amount is covered
+    Random,
+    /// Take the largest notes first
+    LargestFirst,
+    /// Use as few notes as possible, then the smallest last note that still covers
+    /// the amount to keep the change low
+    MinInputs,
+    /// Look for a set of notes that pays the amount exactly so that
+    /// no change output is needed. Falls back to MinInputs if it is cheaper
+    BranchAndBound,
+}
+
+impl Default for NoteSelectionStrategy {
+    fn default() -> Self {
+        NoteSelectionStrategy::Random
+    }
+}
+
+/// Marginal cost of the parts of a transaction, in zats
+///
+/// Defaults to the ZIP 317 marginal fee. Like the proving time and the
+/// size of the transaction, it grows with every spend and output
+#[derive(Clone, Copy, Debug)]
+pub struct CostModel {
+    pub spend_cost: u64,
+    pub output_cost: u64,
+}
+
+impl Default for CostModel {
+    fn default() -> Self {
+        CostModel {
+            spend_cost: 5_000,
+            output_cost: 5_000,
+        }
+    }
+}
+
+impl CostModel {
+    fn cost(&self, values: &[u64], selection: &[usize], target: u64) -> u64 {
+        let total: u64 = selection.iter().map(|&i| values[i]).sum();
+        let change_cost = if total > target { self.output_cost } else { 0 };
+        selection.len() as u64 * self.spend_cost + change_cost
+    }
+}
+
+/// Select notes whose values add up to at least `target`
+///
+/// Returns the indices of the selected values or None if they are not
+/// enough to cover the target
+pub fn select_notes(
+    strategy: NoteSelectionStrategy,
+    values: &[u64],
+    target: u64,
+    cost_model: &CostModel,
+) -> Option<Vec<usize>> {
+    let total: u64 = values.iter().sum();
+    if total < target {
+        return None;
+    }
+    let selection = match strategy {
+        NoteSelectionStrategy::Random => {
+            let mut order: Vec<usize> = (0..values.len()).collect();
+            order.shuffle(&mut OsRng);
+            take_until(values, &order, target)
+        }
+        NoteSelectionStrategy::LargestFirst => take_until(values, &largest_first(values), target),
+        NoteSelectionStrategy::MinInputs => min_inputs(values, target),
+        NoteSelectionStrategy::BranchAndBound => {
+            let fallback = min_inputs(values, target);
+            match branch_and_bound(values, target) {
+                Some(exact)
+                    if cost_model.cost(values, &exact, target)
+                        <= cost_model.cost(values, &fallback, target) =>
+                {
+                    exact
+                }
+                _ => fallback,
+            }
+        }
+    };
+    Some(selection)
+}
+
+fn largest_first(values: &[u64]) -> Vec<usize> {
+    let mut order: Vec<usize> = (0..values.len()).collect();
+    order.sort_by(|&a, &b| values[b].cmp(&values[a]));
+    order
+}
+
+fn take_until(values: &[u64], order: &[usize], target: u64) -> Vec<usize> {
+    let mut selection = vec![];
+    let mut amount = 0u64;
+    for &i in order.iter() {
+        if amount >= target {
+            break;
+        }
+        amount += values[i];
+        selection.push(i);
+    }
+    selection
+}
+
+fn min_inputs(values: &[u64], target: u64) -> Vec<usize> {
+    let order = largest_first(values);
+    let mut selection = take_until(values, &order, target);
+    if let Some(last) = selection.pop() {
+        // with the same number of notes, swap the last one for the
+        // smallest note that still covers the target
+        let base: u64 = selection.iter().map(|&i| values[i]).sum();
+        let needed = target - base;
+        let k = selection.len();
+        let smallest = order[k..]
+            .iter()
+            .rev()
+            .find(|&&i| values[i] >= needed)
+            .copied()
+            .unwrap_or(last);
+        selection.push(smallest);
+    }
+    selection
+}
+
+/// Depth first search for a subset that sums to `target` exactly,
+/// preferring the fewest notes
+fn branch_and_bound(values: &[u64], target: u64) -> Option<Vec<usize>> {
+    let order = largest_first(values);
+    let n = order.len();
+    let mut remaining = vec![0u64; n + 1];
+    for i in (0..n).rev() {
+        remaining[i] = remaining[i + 1] + values[order[i]];
+    }
+
+    let mut selected = vec![false; n];
+    let mut count = 0usize;
+    let mut sum = 0u64;
+    let mut best: Option<Vec<usize>> = None;
+    let mut i = 0usize;
+    for _ in 0..MAX_BNB_TRIES {
+        let too_many = best.as_ref().map_or(false, |b| count >= b.len());
+        let backtrack = if sum == target {
+            best = Some((0..n).filter(|&j| selected[j]).map(|j| order[j]).collect());
+            true
+        } else {
+            sum > target || sum + remaining[i] < target || too_many
+        };
+
+        if backtrack {
+            // drop the last selected note and explore without it
+            match (0..i).rev().find(|&j| selected[j]) {
+                Some(j) => {
+                    selected[j] = false;
+                    sum -= values[order[j]];
+                    count -= 1;
+                    i = j + 1;
+                }
+                None => break,
+            }
+        } else {
+            selected[i] = true;
+            sum += values[order[i]];
+            count += 1;
+            i += 1;
+        }
+    }
+    best
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn total(values: &[u64], selection: &[usize]) -> u64 {
+        selection.iter().map(|&i| values[i]).sum()
+    }
+
+    #[test]
+    fn test_insufficient_funds() {
+        let values = [1_000, 2_000];
+        for strategy in [
+            NoteSelectionStrategy::Random,
+            NoteSelectionStrategy::LargestFirst,
+            NoteSelectionStrategy::MinInputs,
+            NoteSelectionStrategy::BranchAndBound,
+        ]
+        .iter()
+        {
+            assert!(select_notes(*strategy, &values, 3_001, &CostModel::default()).is_none());
+        }
+    }
+
+    #[test]
+    fn test_min_inputs() {
+        let values = [100, 50_000, 70_000, 30_000, 200];
+        let selection = select_notes(
+            NoteSelectionStrategy::MinInputs,
+            &values,
+            60_000,
+            &CostModel::default(),
+        )
+        .unwrap();
+        assert_eq!(selection, vec![2]);
+
+        let selection = select_notes(
+            NoteSelectionStrategy::MinInputs,
+            &values,
+            90_000,
+            &CostModel::default(),
+        )
+        .unwrap();
+        assert_eq!(selection.len(), 2);
+        assert_eq!(total(&values, &selection), 100_000);
+    }
+
+    #[test]
+    fn test_branch_and_bound_exact() {
+        let values = [10_000, 25_000, 7_000, 3_000, 60_000];
+        let selection = select_notes(
+            NoteSelectionStrategy::BranchAndBound,
+            &values,
+            35_000,
+            &CostModel::default(),
+        )
+        .unwrap();
+        assert_eq!(total(&values, &selection), 35_000);
+        assert_eq!(selection.len(), 2);
+    }
+
+    #[test]
+    fn test_branch_and_bound_fallback() {
+        // an exact match needs many more spends than a single note with change
+        let values = [100_000, 1_000, 1_000, 1_000, 1_000, 1_000];
+        let selection = select_notes(
+            NoteSelectionStrategy::BranchAndBound,
+            &values,
+            5_000,
+            &CostModel::default(),
+        )
+        .unwrap();
+        assert_eq!(selection, vec![0]);
+    }
+
+    #[test]
+    fn test_random_covers_target() {
+        let values: Vec<u64> = (1..=50).map(|v| v * 1_000).collect();
+        for _ in 0..10 {
+            let selection = select_notes(
+                NoteSelectionStrategy::Random,
+                &values,
+                123_456,
+                &CostModel::default(),
+            )
+            .unwrap();
+            assert!(total(&values, &selection) >= 123_456);
+        }
+    }
+}
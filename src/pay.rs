@@ -1,32 +1,40 @@
 use crate::db::SpendableNote;
 // use crate::wallet::RecipientMemo;
+use crate::address_cache::DiversifiedAddress;
 use crate::api::payment::RecipientMemo;
 use crate::coinconfig::CoinConfig;
-use crate::{get_latest_height, hex_to_hash, GetAddressUtxosReply, RawTransaction};
+use crate::note_selection::{select_notes, CostModel, NoteSelectionStrategy};
+use crate::prover::{DeferredProver, SaplingProver};
+use crate::{
+    get_latest_height, hex_to_hash, CompactTxStreamerClient, GetAddressUtxosReply, RawTransaction,
+};
 use anyhow::anyhow;
+use blake2b_simd::Params;
+use byteorder::{ReadBytesExt, WriteBytesExt, LE};
 use jubjub::Fr;
-use rand::prelude::SliceRandom;
-use rand::rngs::OsRng;
 use secp256k1::SecretKey;
 use serde::{Deserialize, Serialize};
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::io::{Cursor, Read, Write};
 use std::sync::mpsc;
+use tonic::transport::Channel;
 use tonic::Request;
 use zcash_client_backend::address::RecipientAddress;
 use zcash_client_backend::encoding::{
-    decode_extended_full_viewing_key, decode_payment_address, encode_extended_full_viewing_key,
-    encode_payment_address,
+    decode_payment_address, encode_extended_full_viewing_key, encode_payment_address,
 };
-use zcash_params::coin::{get_coin_chain, CoinChain, CoinType};
-use zcash_primitives::consensus::{BlockHeight, Parameters};
+use zcash_params::coin::{get_coin_chain, get_coin_id, get_coin_type, CoinChain, CoinType};
+use zcash_primitives::consensus::{BlockHeight, BranchId, Parameters};
 use zcash_primitives::keys::OutgoingViewingKey;
 use zcash_primitives::legacy::Script;
 use zcash_primitives::memo::{Memo, MemoBytes};
 use zcash_primitives::merkle_tree::IncrementalWitness;
-use zcash_primitives::sapling::prover::TxProver;
 use zcash_primitives::sapling::{Diversifier, Node, PaymentAddress, Rseed};
 use zcash_primitives::transaction::builder::{Builder, Progress};
 use zcash_primitives::transaction::components::amount::{DEFAULT_FEE, MAX_MONEY};
 use zcash_primitives::transaction::components::{Amount, OutPoint, TxOut as ZTxOut};
+use zcash_primitives::transaction::TxVersion;
 use zcash_primitives::zip32::{ExtendedFullViewingKey, ExtendedSpendingKey};
 
 #[derive(Serialize, Deserialize, Debug)]
@@ -52,6 +60,177 @@ impl Tx {
             ovk: "".to_string(),
         }
     }
+
+    /// Parse a transaction in either the JSON or the base64 binary format
+    pub fn parse(s: &str) -> anyhow::Result<Tx> {
+        let s = s.trim();
+        if s.starts_with('{') {
+            Ok(serde_json::from_str(s)?)
+        } else {
+            Tx::from_bytes(&base64::decode(s)?)
+        }
+    }
+
+    /// Compact binary format for offline signing
+    ///
+    /// magic | version | body | checksum
+    ///
+    /// The hex fields are stored as raw bytes, the memos without their zero padding
+    /// and the viewing keys of the inputs only once
+    pub fn to_bytes(&self) -> anyhow::Result<Vec<u8>> {
+        let mut data = vec![];
+        data.write_all(TX_MAGIC)?;
+        data.write_u8(TX_FORMAT_VERSION)?;
+        data.write_u8(get_coin_id(self.coin_type))?;
+        data.write_u32::<LE>(self.height)?;
+
+        data.write_u16::<LE>(self.t_inputs.len().try_into()?)?;
+        for txin in self.t_inputs.iter() {
+            data.write_all(&hex_to_hash(&txin.op)?)?;
+            data.write_u32::<LE>(txin.n)?;
+            data.write_u64::<LE>(txin.amount)?;
+            write_blob(&mut data, &hex::decode(&txin.script)?)?;
+        }
+
+        let mut fvks: Vec<&str> = vec![];
+        for txin in self.inputs.iter() {
+            if !fvks.contains(&txin.fvk.as_str()) {
+                fvks.push(&txin.fvk);
+            }
+        }
+        data.write_u16::<LE>(fvks.len().try_into()?)?;
+        for fvk in fvks.iter() {
+            write_blob(&mut data, fvk.as_bytes())?;
+        }
+        data.write_u16::<LE>(self.inputs.len().try_into()?)?;
+        for txin in self.inputs.iter() {
+            let mut diversifier = [0u8; 11];
+            hex::decode_to_slice(&txin.diversifier, &mut diversifier)?;
+            data.write_all(&diversifier)?;
+            let fvk_index = fvks.iter().position(|&fvk| fvk == txin.fvk).unwrap();
+            data.write_u16::<LE>(fvk_index as u16)?;
+            data.write_u64::<LE>(txin.amount)?;
+            data.write_all(&hex_to_hash(&txin.rseed)?)?;
+            write_blob(&mut data, &hex::decode(&txin.witness)?)?;
+        }
+
+        data.write_u16::<LE>(self.outputs.len().try_into()?)?;
+        for txout in self.outputs.iter() {
+            write_blob(&mut data, txout.addr.as_bytes())?;
+            data.write_u64::<LE>(txout.amount)?;
+            write_blob(&mut data, &hex::decode(&txout.ovk)?)?;
+            let memo = hex::decode(&txout.memo)?;
+            let memo_len = memo.iter().rposition(|&b| b != 0).map_or(0, |p| p + 1);
+            write_blob(&mut data, &memo[..memo_len])?;
+        }
+
+        write_blob(&mut data, self.change.as_bytes())?;
+        write_blob(&mut data, &hex::decode(&self.ovk)?)?;
+
+        let checksum = tx_checksum(&data);
+        data.write_all(&checksum)?;
+        Ok(data)
+    }
+
+    pub fn from_bytes(data: &[u8]) -> anyhow::Result<Tx> {
+        if data.len() < TX_MAGIC.len() + 1 + TX_CHECKSUM_LEN || &data[..TX_MAGIC.len()] != TX_MAGIC
+        {
+            anyhow::bail!("Not a transaction");
+        }
+        let (data, checksum) = data.split_at(data.len() - TX_CHECKSUM_LEN);
+        if tx_checksum(data) != checksum {
+            anyhow::bail!("Invalid transaction checksum");
+        }
+        let mut r = Cursor::new(&data[TX_MAGIC.len()..]);
+        let version = r.read_u8()?;
+        if version != TX_FORMAT_VERSION {
+            anyhow::bail!("Unsupported transaction format version {}", version);
+        }
+        let coin_type = get_coin_type(r.read_u8()?);
+        let height = r.read_u32::<LE>()?;
+        let mut tx = Tx::new(coin_type, height);
+
+        for _ in 0..r.read_u16::<LE>()? {
+            let mut op = [0u8; 32];
+            r.read_exact(&mut op)?;
+            let n = r.read_u32::<LE>()?;
+            let amount = r.read_u64::<LE>()?;
+            let script = read_blob(&mut r)?;
+            tx.t_inputs.push(TTxIn {
+                op: hex::encode(op),
+                n,
+                amount,
+                script: hex::encode(script),
+            });
+        }
+
+        let mut fvks = vec![];
+        for _ in 0..r.read_u16::<LE>()? {
+            fvks.push(String::from_utf8(read_blob(&mut r)?)?);
+        }
+        for _ in 0..r.read_u16::<LE>()? {
+            let mut diversifier = [0u8; 11];
+            r.read_exact(&mut diversifier)?;
+            let fvk_index = r.read_u16::<LE>()? as usize;
+            let fvk = fvks
+                .get(fvk_index)
+                .ok_or_else(|| anyhow!("Invalid viewing key index"))?;
+            let amount = r.read_u64::<LE>()?;
+            let mut rseed = [0u8; 32];
+            r.read_exact(&mut rseed)?;
+            let witness = read_blob(&mut r)?;
+            tx.inputs.push(TxIn {
+                diversifier: hex::encode(diversifier),
+                fvk: fvk.clone(),
+                amount,
+                rseed: hex::encode(rseed),
+                witness: hex::encode(witness),
+            });
+        }
+
+        for _ in 0..r.read_u16::<LE>()? {
+            let addr = String::from_utf8(read_blob(&mut r)?)?;
+            let amount = r.read_u64::<LE>()?;
+            let ovk = read_blob(&mut r)?;
+            let memo = read_blob(&mut r)?;
+            tx.outputs.push(TxOut {
+                addr,
+                amount,
+                ovk: hex::encode(ovk),
+                memo: hex::encode(memo),
+            });
+        }
+
+        tx.change = String::from_utf8(read_blob(&mut r)?)?;
+        tx.ovk = hex::encode(read_blob(&mut r)?);
+        Ok(tx)
+    }
+}
+
+const TX_MAGIC: &[u8; 4] = b"WTX\0";
+const TX_FORMAT_VERSION: u8 = 1;
+const TX_CHECKSUM_LEN: usize = 4;
+
+fn tx_checksum(data: &[u8]) -> Vec<u8> {
+    Params::new()
+        .personal(b"WarpTxChecksum")
+        .hash_length(TX_CHECKSUM_LEN)
+        .hash(data)
+        .as_bytes()
+        .to_vec()
+}
+
+fn write_blob(w: &mut impl Write, data: &[u8]) -> anyhow::Result<()> {
+    w.write_u16::<LE>(data.len().try_into()?)?;
+    w.write_all(data)?;
+    Ok(())
+}
+
+fn read_blob(r: &mut impl Read) -> anyhow::Result<Vec<u8>> {
+    let len = r.read_u16::<LE>()? as usize;
+    let mut data = vec![0u8; len];
+    r.read_exact(&mut data)?;
+    Ok(data)
 }
 
 #[derive(Serialize, Deserialize, Debug)]
@@ -93,6 +272,7 @@ pub struct RecipientSummary {
 pub struct TxBuilder {
     pub tx: Tx,
     coin_type: CoinType,
+    strategy: NoteSelectionStrategy,
 }
 
 impl TxBuilder {
@@ -100,9 +280,14 @@ impl TxBuilder {
         TxBuilder {
             coin_type,
             tx: Tx::new(coin_type, height),
+            strategy: NoteSelectionStrategy::default(),
         }
     }
 
+    pub fn set_note_selection(&mut self, strategy: NoteSelectionStrategy) {
+        self.strategy = strategy;
+    }
+
     fn add_t_input(&mut self, op: OutPoint, amount: u64, script: &[u8]) {
         self.tx.t_inputs.push(TTxIn {
             op: hex::encode(op.hash()),
@@ -207,42 +392,48 @@ impl TxBuilder {
             (target_amount + DEFAULT_FEE).ok_or(anyhow!("Invalid amount"))?;
         if target_amount_with_fee > t_amount {
             // We need to use some shielded notes because the transparent balance is not enough
-            let mut amount = (target_amount_with_fee - t_amount).unwrap();
-
-            // Pick spendable notes until we exceed the target_amount_with_fee or we ran out of notes
-            let mut notes = notes.to_vec();
-            notes.shuffle(&mut OsRng);
-
-            for n in notes.iter() {
-                if amount.is_positive() {
-                    let a = amount.min(
-                        Amount::from_u64(n.note.value)
-                            .map_err(|_| anyhow::anyhow!("Invalid amount"))?,
+            let amount = (target_amount_with_fee - t_amount).unwrap();
+
+            // Only the notes with a pre-zip212 rseed can be spent
+            let notes: Vec<_> = notes
+                .iter()
+                .filter(|n| matches!(n.note.rseed, Rseed::BeforeZip212(_)))
+                .collect();
+            let values: Vec<_> = notes.iter().map(|n| n.note.value).collect();
+            let selection = select_notes(
+                self.strategy,
+                &values,
+                u64::from(amount),
+                &CostModel::default(),
+            );
+            let selection = match selection {
+                Some(selection) => selection,
+                None => {
+                    let missing = u64::from(amount) - values.iter().sum::<u64>();
+                    log::info!("Not enough balance");
+                    anyhow::bail!(
+                        "Not enough balance, need {} zats, missing {} zats",
+                        u64::from(target_amount_with_fee),
+                        missing
                     );
-                    amount -= a;
-                    let mut witness_bytes: Vec<u8> = vec![];
-                    n.witness.write(&mut witness_bytes)?;
-                    if let Rseed::BeforeZip212(rseed) = n.note.rseed {
-                        // rseed are stored as pre-zip212
-                        self.add_z_input(
-                            &n.diversifier,
-                            fvk,
-                            Amount::from_u64(n.note.value).unwrap(),
-                            &rseed.to_bytes(),
-                            &witness_bytes,
-                        )?;
-                        selected_notes.push(n.id);
-                    }
                 }
-            }
+            };
 
-            if amount.is_positive() {
-                log::info!("Not enough balance");
-                anyhow::bail!(
-                    "Not enough balance, need {} zats, missing {} zats",
-                    u64::from(target_amount_with_fee),
-                    u64::from(amount)
-                );
+            for i in selection {
+                let n = notes[i];
+                let mut witness_bytes: Vec<u8> = vec![];
+                n.witness.write(&mut witness_bytes)?;
+                if let Rseed::BeforeZip212(rseed) = n.note.rseed {
+                    // rseed are stored as pre-zip212
+                    self.add_z_input(
+                        &n.diversifier,
+                        fvk,
+                        Amount::from_u64(n.note.value).unwrap(),
+                        &rseed.to_bytes(),
+                        &witness_bytes,
+                    )?;
+                    selected_notes.push(n.id);
+                }
             }
         }
 
@@ -310,13 +501,18 @@ impl Tx {
         &self,
         tsk: Option<SecretKey>,
         zsk: &ExtendedSpendingKey,
-        prover: &impl TxProver,
+        prover: &SaplingProver,
         progress_callback: impl Fn(Progress) + Send + 'static,
     ) -> anyhow::Result<Vec<u8>> {
         let chain = get_coin_chain(self.coin_type);
         let last_height = BlockHeight::from_u32(self.height as u32);
         let mut builder = Builder::new(*chain.network(), last_height);
         let efvk = ExtendedFullViewingKey::from(zsk);
+        // compare the encoded keys rather than decoding the key of every input
+        let fvk = encode_extended_full_viewing_key(
+            chain.network().hrp_sapling_extended_full_viewing_key(),
+            &efvk,
+        );
 
         let ovk = hex_to_hash(&self.ovk)?;
         builder.send_change_to(
@@ -343,25 +539,26 @@ impl Tx {
             anyhow::bail!("Missing secret key of transparent account");
         }
 
+        // most notes are received on the same few addresses
+        let ivk = efvk.fvk.vk.ivk();
+        let mut addresses: HashMap<[u8; 11], DiversifiedAddress> = HashMap::new();
         for txin in self.inputs.iter() {
             let mut diversifier = [0u8; 11];
             hex::decode_to_slice(&txin.diversifier, &mut diversifier)?;
             let diversifier = Diversifier(diversifier);
-            let fvk = decode_extended_full_viewing_key(
-                chain.network().hrp_sapling_extended_full_viewing_key(),
-                &txin.fvk,
-            )?
-            .unwrap();
-            if fvk != efvk {
+            if txin.fvk != fvk {
                 anyhow::bail!("Incorrect account - Secret key mismatch")
             }
-            let pa = fvk.fvk.vk.to_payment_address(diversifier).unwrap();
+            if !addresses.contains_key(&diversifier.0) {
+                let address = DiversifiedAddress::derive(&ivk, diversifier)
+                    .ok_or_else(|| anyhow!("Invalid diversifier"))?;
+                addresses.insert(diversifier.0, address);
+            }
+            let address = &addresses[&diversifier.0];
             let mut rseed_bytes = [0u8; 32];
             hex::decode_to_slice(&txin.rseed, &mut rseed_bytes)?;
             let rseed = Fr::from_bytes(&rseed_bytes).unwrap();
-            let note = pa
-                .create_note(txin.amount, Rseed::BeforeZip212(rseed))
-                .unwrap();
+            let note = address.create_note(txin.amount, Rseed::BeforeZip212(rseed));
             let w = hex::decode(&txin.witness)?;
             let witness = IncrementalWitness::<Node>::read(&*w)?;
             let merkle_path = witness.path().unwrap();
@@ -389,18 +586,30 @@ impl Tx {
             }
         }
 
+        // v5 sighashes do not cover the proofs: they can be made in parallel
+        // after the transaction is signed
+        let branch_id = BranchId::for_height(chain.network(), last_height);
+        let defer = matches!(
+            TxVersion::suggested_for_branch(branch_id),
+            TxVersion::Zip225
+        );
+        let prover = DeferredProver::new(prover, defer);
+
         let (progress_tx, progress_rx) = mpsc::channel::<Progress>();
 
-        builder.with_progress_notifier(progress_tx);
-        tokio::spawn(async move {
+        if !prover.is_deferred() {
+            builder.with_progress_notifier(progress_tx.clone());
+        }
+        std::thread::spawn(move || {
             while let Ok(progress) = progress_rx.recv() {
                 log::info!("Progress: {}", progress.cur());
                 progress_callback(progress);
             }
         });
-        let (tx, _) = builder.build(prover)?;
+        let (tx, _) = builder.build(&prover)?;
         let mut raw_tx = vec![];
         tx.write(&mut raw_tx)?;
+        prover.prove_deferred(&mut raw_tx, progress_tx)?;
 
         Ok(raw_tx)
     }
@@ -410,6 +619,15 @@ pub async fn broadcast_tx(tx: &[u8]) -> anyhow::Result<String> {
     let c = CoinConfig::get_active();
     let mut client = c.connect_lwd().await?;
     let latest_height = get_latest_height(&mut client).await?;
+    send_raw_tx(&mut client, latest_height, tx).await
+}
+
+/// Broadcast a transaction over an existing connection
+pub async fn send_raw_tx(
+    client: &mut CompactTxStreamerClient<Channel>,
+    latest_height: u32,
+    tx: &[u8],
+) -> anyhow::Result<String> {
     let raw_tx = RawTransaction {
         data: tx.to_vec(),
         height: latest_height as u64,
@@ -436,3 +654,55 @@ pub fn get_tx_summary(tx: &Tx) -> anyhow::Result<TxSummary> {
     }
     Ok(TxSummary { recipients })
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_tx_binary_roundtrip() {
+        let mut tx = Tx::new(CoinType::Zcash, 1_700_000);
+        tx.t_inputs.push(TTxIn {
+            op: hex::encode([1u8; 32]),
+            n: 2,
+            amount: 50_000,
+            script: hex::encode([0x76, 0xa9, 0x14]),
+        });
+        for amount in [10_000u64, 20_000].iter() {
+            tx.inputs.push(TxIn {
+                diversifier: hex::encode([3u8; 11]),
+                fvk: "zxviews1test".to_string(),
+                amount: *amount,
+                rseed: hex::encode([4u8; 32]),
+                witness: hex::encode([5u8; 100]),
+            });
+        }
+        let mut memo = vec![0u8; 512];
+        memo[..5].copy_from_slice(b"hello");
+        tx.outputs.push(TxOut {
+            addr: "zs1test".to_string(),
+            amount: 25_000,
+            ovk: hex::encode([6u8; 32]),
+            memo: hex::encode(&memo),
+        });
+        tx.change = "zs1change".to_string();
+        tx.ovk = hex::encode([7u8; 32]);
+
+        let data = tx.to_bytes().unwrap();
+        let tx2 = Tx::from_bytes(&data).unwrap();
+        assert_eq!(tx2.height, tx.height);
+        assert_eq!(tx2.t_inputs[0].op, tx.t_inputs[0].op);
+        assert_eq!(tx2.t_inputs[0].script, tx.t_inputs[0].script);
+        assert_eq!(tx2.inputs.len(), 2);
+        assert_eq!(tx2.inputs[1].fvk, tx.inputs[1].fvk);
+        assert_eq!(tx2.inputs[1].witness, tx.inputs[1].witness);
+        assert_eq!(tx2.outputs[0].memo, hex::encode(b"hello"));
+        assert_eq!(tx2.change, tx.change);
+        assert_eq!(tx2.ovk, tx.ovk);
+        assert!(data.len() < serde_json::to_string(&tx).unwrap().len() / 2);
+
+        let mut corrupted = data.clone();
+        corrupted[10] ^= 1;
+        assert!(Tx::from_bytes(&corrupted).is_err());
+    }
+}
@@ -0,0 +1,381 @@
+use bellman::gadgets::multipack;
+use bellman::groth16::{
+    create_random_proof, prepare_verifying_key, verify_proof, Parameters, PreparedVerifyingKey,
+    Proof,
+};
+use blake2b_simd::Params;
+use bls12_381::Bls12;
+use ff::Field;
+use group::Group;
+use memmap2::Mmap;
+use rand::rngs::OsRng;
+use rand::RngCore;
+use rayon::prelude::*;
+use std::fs::File;
+use std::io::Write;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::mpsc::Sender;
+use std::sync::Mutex;
+use zcash_primitives::constants::{SPENDING_KEY_GENERATOR, VALUE_COMMITMENT_RANDOMNESS_GENERATOR};
+use zcash_primitives::merkle_tree::MerklePath;
+use zcash_primitives::sapling::prover::TxProver;
+use zcash_primitives::sapling::redjubjub::{PrivateKey, PublicKey, Signature};
+use zcash_primitives::sapling::{
+    Diversifier, Node, PaymentAddress, ProofGenerationKey, Rseed, ValueCommitment,
+};
+use zcash_primitives::transaction::builder::Progress;
+use zcash_primitives::transaction::components::{Amount, GROTH_PROOF_SIZE};
+use zcash_proofs::circuit::sapling::{Output, Spend};
+use zcash_proofs::parse_parameters;
+use zcash_proofs::sapling::compute_value_balance;
+
+const CACHE_MAGIC: &[u8; 8] = b"WARPPRV2";
+const CACHE_HASH_LEN: usize = 32;
+
+/// Groth16 parameters of the Sapling spend and output circuits
+pub struct SaplingProver {
+    spend_params: Parameters<Bls12>,
+    spend_vk: PreparedVerifyingKey<Bls12>,
+    output_params: Parameters<Bls12>,
+}
+
+impl SaplingProver {
+    pub fn from_bytes(spend_params: &[u8], output_params: &[u8]) -> Self {
+        let params = parse_parameters(spend_params, output_params, None);
+        SaplingProver {
+            spend_params: params.spend_params,
+            spend_vk: params.spend_vk,
+            output_params: params.output_params,
+        }
+    }
+
+    /// Load the parameters saved by `write_cache`
+    ///
+    /// The file is memory mapped and read in place. The points were validated
+    /// before they were cached so they are read without subgroup checks.
+    /// The cache is only used if it was made from the parameters with the hash
+    /// `params_hash` and a hash of the content guards against a corrupted file
+    pub fn from_cache(path: &str, params_hash: &[u8]) -> anyhow::Result<Self> {
+        let file = File::open(path)?;
+        let mmap = unsafe { Mmap::map(&file)? };
+        let params_end = CACHE_MAGIC.len() + CACHE_HASH_LEN;
+        let header_len = params_end + CACHE_HASH_LEN;
+        if mmap.len() < header_len || &mmap[..CACHE_MAGIC.len()] != CACHE_MAGIC {
+            anyhow::bail!("Invalid prover cache");
+        }
+        if &mmap[CACHE_MAGIC.len()..params_end] != params_hash {
+            anyhow::bail!("Prover cache made from other parameters");
+        }
+        let body = &mmap[header_len..];
+        let hash = cache_hash(body);
+        if hash.as_bytes() != &mmap[params_end..header_len] {
+            anyhow::bail!("Corrupted prover cache");
+        }
+        let mut reader = body;
+        let spend_params = Parameters::read(&mut reader, false)?;
+        let output_params = Parameters::read(&mut reader, false)?;
+        let spend_vk = prepare_verifying_key(&spend_params.vk);
+        Ok(SaplingProver {
+            spend_params,
+            spend_vk,
+            output_params,
+        })
+    }
+
+    /// Save the parameters for `from_cache`
+    ///
+    /// `params_hash` identifies the parameters the prover was loaded from
+    pub fn write_cache(&self, path: &str, params_hash: &[u8]) -> anyhow::Result<()> {
+        if params_hash.len() != CACHE_HASH_LEN {
+            anyhow::bail!("Invalid parameter hash");
+        }
+        let mut body = vec![];
+        self.spend_params.write(&mut body)?;
+        self.output_params.write(&mut body)?;
+        let hash = cache_hash(&body);
+        let tmp_path = format!("{}.tmp", path);
+        let mut file = File::create(&tmp_path)?;
+        file.write_all(CACHE_MAGIC)?;
+        file.write_all(params_hash)?;
+        file.write_all(hash.as_bytes())?;
+        file.write_all(&body)?;
+        file.sync_all()?;
+        std::fs::rename(&tmp_path, path)?;
+        Ok(())
+    }
+
+    /// Prove the circuit and, for a spend, check the proof against its public inputs
+    ///
+    /// A stale witness or anchor gives a proof that the network rejects,
+    /// so it is caught before the transaction gets signed
+    fn prove(
+        &self,
+        circuit: Circuit,
+        spend_inputs: Option<&SpendInputs>,
+    ) -> anyhow::Result<[u8; GROTH_PROOF_SIZE]> {
+        let proof = match circuit {
+            Circuit::Spend(spend) => create_random_proof(spend, &self.spend_params, &mut OsRng),
+            Circuit::Output(output) => create_random_proof(output, &self.output_params, &mut OsRng),
+        }
+        .expect("proving should not fail");
+        if let Some(inputs) = spend_inputs {
+            self.verify_spend(&proof, inputs)?;
+        }
+        let mut zkproof = [0u8; GROTH_PROOF_SIZE];
+        proof
+            .write(&mut zkproof[..])
+            .expect("should be able to serialize a proof");
+        Ok(zkproof)
+    }
+
+    fn verify_spend(&self, proof: &Proof<Bls12>, inputs: &SpendInputs) -> anyhow::Result<()> {
+        verify_proof(&self.spend_vk, proof, &inputs[..])
+            .map_err(|_| anyhow::anyhow!("Invalid spend proof"))
+    }
+}
+
+/// Public inputs of the spend circuit: rk, cv, anchor and nullifier
+type SpendInputs = [bls12_381::Scalar; 7];
+
+fn spend_inputs(
+    rk: &PublicKey,
+    cv: &jubjub::ExtendedPoint,
+    anchor: bls12_381::Scalar,
+    nf: &[u8; 32],
+) -> SpendInputs {
+    let mut inputs = [bls12_381::Scalar::zero(); 7];
+    let rk = rk.0.to_affine();
+    inputs[0] = rk.get_u();
+    inputs[1] = rk.get_v();
+    let cv = cv.to_affine();
+    inputs[2] = cv.get_u();
+    inputs[3] = cv.get_v();
+    inputs[4] = anchor;
+    let nf = multipack::compute_multipacking(&multipack::bytes_to_bits_le(nf));
+    inputs[5] = nf[0];
+    inputs[6] = nf[1];
+    inputs
+}
+
+fn cache_hash(data: &[u8]) -> blake2b_simd::Hash {
+    Params::new().hash_length(CACHE_HASH_LEN).hash(data)
+}
+
+/// Hash of the serialized spend and output parameters, for `from_cache`
+pub fn params_hash(spend_params: &[u8], output_params: &[u8]) -> blake2b_simd::Hash {
+    Params::new()
+        .hash_length(CACHE_HASH_LEN)
+        .to_state()
+        .update(spend_params)
+        .update(output_params)
+        .finalize()
+}
+
+enum Circuit {
+    Spend(Spend),
+    Output(Output),
+}
+
+struct ProofJob {
+    marker: [u8; GROTH_PROOF_SIZE],
+    circuit: Circuit,
+    spend_inputs: Option<SpendInputs>,
+}
+
+pub struct ProvingContext {
+    bsk: jubjub::Fr,
+    cv_sum: jubjub::ExtendedPoint,
+}
+
+/// Sapling prover that can postpone the Groth16 proofs until the
+/// transaction is built
+///
+/// The value commitments and randomized keys are computed when the builder
+/// asks for them but, when deferred, each proof is replaced by a random marker.
+/// `prove_deferred` then creates all the proofs in parallel and patches them
+/// into the serialized transaction.
+/// Only valid when the proofs are not part of the sighash, i.e. for v5 transactions
+pub struct DeferredProver<'a> {
+    prover: &'a SaplingProver,
+    defer: bool,
+    jobs: Mutex<Vec<ProofJob>>,
+}
+
+impl<'a> DeferredProver<'a> {
+    pub fn new(prover: &'a SaplingProver, defer: bool) -> Self {
+        DeferredProver {
+            prover,
+            defer,
+            jobs: Mutex::new(vec![]),
+        }
+    }
+
+    pub fn is_deferred(&self) -> bool {
+        self.defer
+    }
+
+    fn submit(
+        &self,
+        circuit: Circuit,
+        spend_inputs: Option<SpendInputs>,
+    ) -> anyhow::Result<[u8; GROTH_PROOF_SIZE]> {
+        if !self.defer {
+            return self.prover.prove(circuit, spend_inputs.as_ref());
+        }
+        let mut marker = [0u8; GROTH_PROOF_SIZE];
+        OsRng.fill_bytes(&mut marker);
+        self.jobs.lock().unwrap().push(ProofJob {
+            marker,
+            circuit,
+            spend_inputs,
+        });
+        Ok(marker)
+    }
+
+    /// Create the postponed proofs on the rayon pool and replace their
+    /// markers in `raw_tx`
+    ///
+    /// Fails if a spend proof does not verify
+    pub fn prove_deferred(
+        &self,
+        raw_tx: &mut [u8],
+        progress_tx: Sender<Progress>,
+    ) -> anyhow::Result<()> {
+        let jobs: Vec<_> = self.jobs.lock().unwrap().drain(..).collect();
+        let total = jobs.len() as u32;
+        let done = AtomicU32::new(0);
+        let proofs = jobs
+            .into_par_iter()
+            .map_with(progress_tx, |progress_tx, job| {
+                let zkproof = self.prover.prove(job.circuit, job.spend_inputs.as_ref())?;
+                let cur = done.fetch_add(1, Ordering::AcqRel) + 1;
+                let _ = progress_tx.send(Progress::new(cur, Some(total)));
+                Ok((job.marker, zkproof))
+            })
+            .collect::<anyhow::Result<Vec<_>>>()?;
+
+        for (marker, zkproof) in proofs.iter() {
+            let pos = raw_tx
+                .windows(GROTH_PROOF_SIZE)
+                .position(|w| w == &marker[..])
+                .ok_or_else(|| anyhow::anyhow!("Proof placeholder not found"))?;
+            raw_tx[pos..pos + GROTH_PROOF_SIZE].copy_from_slice(zkproof);
+        }
+        Ok(())
+    }
+}
+
+impl TxProver for DeferredProver<'_> {
+    type SaplingProvingContext = ProvingContext;
+
+    fn new_sapling_proving_context(&self) -> Self::SaplingProvingContext {
+        ProvingContext {
+            bsk: jubjub::Fr::zero(),
+            cv_sum: jubjub::ExtendedPoint::identity(),
+        }
+    }
+
+    fn spend_proof(
+        &self,
+        ctx: &mut Self::SaplingProvingContext,
+        proof_generation_key: ProofGenerationKey,
+        diversifier: Diversifier,
+        rseed: Rseed,
+        ar: jubjub::Fr,
+        value: u64,
+        anchor: bls12_381::Scalar,
+        merkle_path: MerklePath<Node>,
+    ) -> Result<([u8; GROTH_PROOF_SIZE], jubjub::ExtendedPoint, PublicKey), ()> {
+        let rcv = jubjub::Fr::random(&mut OsRng);
+        ctx.bsk += rcv;
+        let value_commitment = ValueCommitment {
+            value,
+            randomness: rcv,
+        };
+
+        let viewing_key = proof_generation_key.to_viewing_key();
+        let payment_address = viewing_key.to_payment_address(diversifier).ok_or(())?;
+        let note = payment_address.create_note(value, rseed).ok_or(())?;
+        let nf = note.nf(&viewing_key, merkle_path.position);
+        let rk = PublicKey(proof_generation_key.ak.into()).randomize(ar, SPENDING_KEY_GENERATOR);
+
+        let cv: jubjub::ExtendedPoint = value_commitment.commitment().into();
+        ctx.cv_sum += cv;
+        let inputs = spend_inputs(&rk, &cv, anchor, &nf.0);
+
+        let circuit = Spend {
+            value_commitment: Some(value_commitment),
+            proof_generation_key: Some(proof_generation_key),
+            payment_address: Some(payment_address),
+            commitment_randomness: Some(note.rcm()),
+            ar: Some(ar),
+            auth_path: merkle_path
+                .auth_path
+                .iter()
+                .map(|(node, b)| Some(((*node).into(), *b)))
+                .collect(),
+            anchor: Some(anchor),
+        };
+        let zkproof = self
+            .submit(Circuit::Spend(circuit), Some(inputs))
+            .map_err(|err| {
+                log::error!("{}", err);
+            })?;
+        Ok((zkproof, cv, rk))
+    }
+
+    fn output_proof(
+        &self,
+        ctx: &mut Self::SaplingProvingContext,
+        esk: jubjub::Fr,
+        payment_address: PaymentAddress,
+        rcm: jubjub::Fr,
+        value: u64,
+    ) -> ([u8; GROTH_PROOF_SIZE], jubjub::ExtendedPoint) {
+        let rcv = jubjub::Fr::random(&mut OsRng);
+        ctx.bsk -= rcv;
+        let value_commitment = ValueCommitment {
+            value,
+            randomness: rcv,
+        };
+
+        let cv: jubjub::ExtendedPoint = value_commitment.commitment().into();
+        ctx.cv_sum -= cv;
+
+        let circuit = Output {
+            value_commitment: Some(value_commitment),
+            payment_address: Some(payment_address),
+            commitment_randomness: Some(rcm),
+            esk: Some(esk),
+        };
+        let zkproof = self
+            .submit(Circuit::Output(circuit), None)
+            .expect("output proofs are not verified");
+        (zkproof, cv)
+    }
+
+    fn binding_sig(
+        &self,
+        ctx: &mut Self::SaplingProvingContext,
+        value_balance: Amount,
+        sighash: &[u8; 32],
+    ) -> Result<Signature, ()> {
+        let bsk = PrivateKey(ctx.bsk);
+        let bvk = PublicKey::from_private(&bsk, VALUE_COMMITMENT_RANDOMNESS_GENERATOR);
+
+        // the value commitments must add up to the value balance
+        let value_balance = compute_value_balance(value_balance).ok_or(())?;
+        if bvk.0 != ctx.cv_sum - value_balance {
+            return Err(());
+        }
+
+        let mut data_to_be_signed = [0u8; 64];
+        data_to_be_signed[0..32].copy_from_slice(&bvk.0.to_bytes());
+        data_to_be_signed[32..64].copy_from_slice(&sighash[..]);
+        Ok(bsk.sign(
+            &data_to_be_signed,
+            &mut OsRng,
+            VALUE_COMMITMENT_RANDOMNESS_GENERATOR,
+        ))
+    }
+}
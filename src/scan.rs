@@ -1,26 +1,53 @@
 use crate::builder::BlockProcessor;
-use crate::chain::{Nf, NfRef};
+use crate::chain::{get_block_tree_state, ChainError, Nf, NfIndex, NfRef};
+use crate::checkpoint::CheckpointPolicy;
+use crate::coinconfig::CoinConfig;
 use crate::db::{DbAdapter, ReceivedNote};
+use crate::note_cache::NoteCache;
+use crate::sync_metrics::{ChunkMetrics, ProgressTracker, SyncProgress, SyncStage};
 
 use crate::transaction::retrieve_tx_info;
 use crate::{
-    connect_lightwalletd, download_chain, get_latest_height, CompactBlock, DecryptNode, Witness,
+    connect_lightwalletd, download_chain, get_latest_height, CompactBlock, CompactTxStreamerClient,
+    DecryptNode, Witness,
 };
 use ff::PrimeField;
 
 use std::cmp::Ordering;
 use std::collections::HashMap;
 use std::panic;
-use std::sync::atomic::AtomicBool;
+use std::sync::atomic::{self, AtomicBool};
 use std::sync::Arc;
 use std::time::Instant;
 use tokio::sync::mpsc;
 use tokio::sync::Mutex;
-use zcash_params::coin::{get_coin_chain, CoinType};
+use tonic::transport::Channel;
+use zcash_params::coin::{get_coin_chain, get_coin_id, CoinType};
 
+use zcash_primitives::consensus::{Network, NetworkUpgrade, Parameters};
 use zcash_primitives::sapling::Node;
 
-pub struct Blocks(pub Vec<CompactBlock>);
+/// A chunk of downloaded blocks
+pub struct Blocks(pub Vec<CompactBlock>, pub DownloadInfo);
+
+/// Size of a chunk on the wire and when its download ended
+#[derive(Clone, Copy, Debug)]
+pub struct DownloadInfo {
+    pub bytes: usize,
+    pub downloaded_at: Instant,
+}
+
+impl Blocks {
+    pub fn new(blocks: Vec<CompactBlock>, bytes: usize) -> Self {
+        Blocks(
+            blocks,
+            DownloadInfo {
+                bytes,
+                downloaded_at: Instant::now(),
+            },
+        )
+    }
+}
 
 #[derive(Debug)]
 struct TxIdSet(Vec<u32>);
@@ -31,7 +58,7 @@ impl std::fmt::Debug for Blocks {
     }
 }
 
-pub type ProgressCallback = dyn Fn(u32) + Send;
+pub type ProgressCallback = dyn Fn(&SyncProgress) + Send;
 pub type AMProgressCallback = Arc<Mutex<ProgressCallback>>;
 
 #[derive(PartialEq, PartialOrd, Debug, Hash, Eq)]
@@ -42,6 +69,40 @@ pub struct TxIdHeight {
 }
 
 pub const MAX_OUTPUTS_PER_CHUNK: usize = 200_000;
+pub const RECENT_FIRST_BLOCKS: u32 = 10_000;
+
+/// Start an empty database at the block before the earliest account birthday
+///
+/// The tree state of that block is fetched from the server so that the blocks
+/// before the birthday are neither downloaded nor decrypted
+async fn start_from_birthday(
+    coin_type: CoinType,
+    db_path: &str,
+    network: &Network,
+    client: &mut CompactTxStreamerClient<Channel>,
+) -> anyhow::Result<()> {
+    let birth_height = {
+        let db = DbAdapter::new(coin_type, db_path)?;
+        match db.get_last_sync_height()? {
+            Some(_) => None,
+            None => db.get_birth_height()?,
+        }
+    };
+    let activation_height: u32 = network
+        .activation_height(NetworkUpgrade::Sapling)
+        .unwrap()
+        .into();
+    if let Some(birth_height) = birth_height {
+        let height = birth_height.saturating_sub(1);
+        if height > activation_height {
+            let (hash, time, tree) = get_block_tree_state(client, height).await?;
+            let db = DbAdapter::new(coin_type, db_path)?;
+            DbAdapter::store_block(&db.connection, height, &hash, time, &tree)?;
+            log::info!("Starting from birthday {}", birth_height);
+        }
+    }
+    Ok(())
+}
 
 pub async fn sync_async(
     coin_type: CoinType,
@@ -52,6 +113,250 @@ pub async fn sync_async(
     progress_callback: AMProgressCallback,
     cancel: &'static AtomicBool,
     ld_url: &str,
+) -> anyhow::Result<()> {
+    let network = {
+        let chain = get_coin_chain(coin_type);
+        *chain.network()
+    };
+
+    let mut client = connect_lightwalletd(ld_url).await?;
+    let c = CoinConfig::get(get_coin_id(coin_type));
+    let checkpoint_policy = c.checkpoint_policy;
+    start_from_birthday(coin_type, db_path, &network, &mut client).await?;
+    let end_height = get_latest_height(&mut client).await?;
+    let end_height = end_height.saturating_sub(target_height_offset);
+    start_recent_first(
+        coin_type,
+        db_path,
+        c.recent_first_blocks,
+        end_height,
+        &mut client,
+    )
+    .await?;
+
+    let (start_height, backfill) = {
+        let db = DbAdapter::new(coin_type, db_path)?;
+        (db.get_db_height()?, db.get_backfill()?)
+    };
+    let range = ScanRange {
+        start_height,
+        end_height: end_height.max(start_height),
+        decrypt: true,
+        final_pass: backfill.is_none(),
+    };
+    scan_range(
+        coin_type,
+        get_tx,
+        db_path,
+        ld_url,
+        &range,
+        &checkpoint_policy,
+        progress_callback.clone(),
+        cancel,
+    )
+    .await?;
+
+    if let Some((start_height, frontier_height)) = backfill {
+        run_backfill(
+            coin_type,
+            get_tx,
+            db_path,
+            ld_url,
+            start_height,
+            frontier_height,
+            &checkpoint_policy,
+            progress_callback,
+            cancel,
+        )
+        .await?;
+    }
+    Ok(())
+}
+
+/// Jump to `recent_blocks` before `end_height` when the database is further behind
+///
+/// The tree state at the jump comes from the server. The blocks that are
+/// skipped are scanned by `run_backfill` after the recent ones
+async fn start_recent_first(
+    coin_type: CoinType,
+    db_path: &str,
+    recent_blocks: u32,
+    end_height: u32,
+    client: &mut CompactTxStreamerClient<Channel>,
+) -> anyhow::Result<()> {
+    if recent_blocks == 0 {
+        return Ok(());
+    }
+    let start_height = {
+        let db = DbAdapter::new(coin_type, db_path)?;
+        if db.get_backfill()?.is_some() {
+            return Ok(());
+        }
+        match db.get_last_sync_height()? {
+            Some(height) => height,
+            None => return Ok(()),
+        }
+    };
+    if end_height <= start_height.saturating_add(recent_blocks.saturating_mul(2)) {
+        return Ok(());
+    }
+    let frontier_height = end_height - recent_blocks;
+    let (hash, time, tree) = get_block_tree_state(client, frontier_height).await?;
+    let mut db = DbAdapter::new(coin_type, db_path)?;
+    let db_tx = db.begin_transaction()?;
+    DbAdapter::store_block(&db_tx, frontier_height, &hash, time, &tree)?;
+    DbAdapter::store_backfill(&db_tx, start_height, frontier_height)?;
+    db_tx.commit()?;
+    log::info!(
+        "Scanning from {} first, backfilling from {}",
+        frontier_height,
+        start_height
+    );
+    Ok(())
+}
+
+/// Scan the blocks skipped by `start_recent_first`
+///
+/// The blocks up to the frontier are scanned from the last stored block before it
+/// and must end with the tree given by the server. Then the witnesses of the notes
+/// found so far are brought up to the latest block, without decrypting the recent
+/// blocks again. The blocks stored in between only have the witnesses of one of
+/// the two passes and are deleted.
+/// A canceled pass leaves the backfill to resume with the next sync
+async fn run_backfill(
+    coin_type: CoinType,
+    get_tx: bool,
+    db_path: &str,
+    ld_url: &str,
+    start_height: u32,
+    frontier_height: u32,
+    checkpoint_policy: &CheckpointPolicy,
+    progress_callback: AMProgressCallback,
+    cancel: &'static AtomicBool,
+) -> anyhow::Result<()> {
+    let canceled = || cancel.load(atomic::Ordering::Acquire);
+    if canceled() {
+        return Ok(());
+    }
+    if start_height < frontier_height {
+        let start_height = DbAdapter::new(coin_type, db_path)?
+            .get_checkpoint_height(frontier_height - 1)?
+            .unwrap_or(start_height);
+        log::info!("Backfilling {}-{}", start_height, frontier_height);
+        let range = ScanRange {
+            start_height,
+            end_height: frontier_height,
+            decrypt: true,
+            final_pass: false,
+        };
+        let res = scan_range(
+            coin_type,
+            get_tx,
+            db_path,
+            ld_url,
+            &range,
+            checkpoint_policy,
+            progress_callback.clone(),
+            cancel,
+        )
+        .await;
+        abandon_backfill_on_mismatch(coin_type, db_path, res)?;
+        if canceled() {
+            return Ok(());
+        }
+        let db = DbAdapter::new(coin_type, db_path)?;
+        DbAdapter::store_backfill(&db.connection, frontier_height, frontier_height)?;
+    }
+
+    let end_height = {
+        let mut db = DbAdapter::new(coin_type, db_path)?;
+        let end_height = db.get_db_height()?;
+        db.delete_blocks_between(frontier_height, end_height)?;
+        end_height
+    };
+    log::info!("Updating witnesses {}-{}", frontier_height, end_height);
+    let range = ScanRange {
+        start_height: frontier_height,
+        end_height,
+        decrypt: false,
+        final_pass: true,
+    };
+    let res = scan_range(
+        coin_type,
+        get_tx,
+        db_path,
+        ld_url,
+        &range,
+        checkpoint_policy,
+        progress_callback,
+        cancel,
+    )
+    .await;
+    abandon_backfill_on_mismatch(coin_type, db_path, res)?;
+    if canceled() {
+        return Ok(());
+    }
+
+    let mut db = DbAdapter::new(coin_type, db_path)?;
+    db.delete_blocks_between(frontier_height, end_height)?;
+    db.delete_backfill()?;
+    shared_note_cache(coin_type, db_path)
+        .lock()
+        .unwrap()
+        .invalidate();
+    log::info!("Backfill completed");
+    Ok(())
+}
+
+/// If the scanned tree does not match the stored one, go back to the last
+/// complete block and sync from there
+fn abandon_backfill_on_mismatch(
+    coin_type: CoinType,
+    db_path: &str,
+    res: anyhow::Result<()>,
+) -> anyhow::Result<()> {
+    if let Err(err) = &res {
+        if matches!(
+            err.downcast_ref::<ChainError>(),
+            Some(ChainError::TreeMismatch)
+        ) {
+            log::warn!("Backfill abandoned: {}", err);
+            let mut db = DbAdapter::new(coin_type, db_path)?;
+            if let Some((start_height, _)) = db.get_backfill()? {
+                db.trim_to_height(start_height + 1)?;
+            }
+            shared_nf_index(coin_type, db_path)
+                .lock()
+                .unwrap()
+                .invalidate();
+            shared_note_cache(coin_type, db_path)
+                .lock()
+                .unwrap()
+                .invalidate();
+        }
+    }
+    res
+}
+
+/// Blocks scanned by one pass of the sync
+struct ScanRange {
+    start_height: u32,
+    end_height: u32,
+    /// Look for new notes, otherwise only spends and witnesses are updated
+    decrypt: bool,
+    /// Last pass of the sync, reports the end of the sync when it completes
+    final_pass: bool,
+}
+
+async fn scan_range(
+    coin_type: CoinType,
+    get_tx: bool,
+    db_path: &str,
+    ld_url: &str,
+    range: &ScanRange,
+    checkpoint_policy: &CheckpointPolicy,
+    progress_callback: AMProgressCallback,
+    cancel: &'static AtomicBool,
 ) -> anyhow::Result<()> {
     let ld_url = ld_url.to_owned();
     let db_path = db_path.to_string();
@@ -59,26 +364,36 @@ pub async fn sync_async(
         let chain = get_coin_chain(coin_type);
         *chain.network()
     };
+    let checkpoint_policy = *checkpoint_policy;
+    let (start_height, end_height) = (range.start_height, range.end_height);
+    let final_pass = range.final_pass;
+    if start_height >= end_height {
+        return Ok(());
+    }
 
     let mut client = connect_lightwalletd(&ld_url).await?;
-    let (start_height, prev_hash, vks) = {
+    let (prev_hash, stored_blocks, vks) = {
         let db = DbAdapter::new(coin_type, &db_path)?;
-        let height = db.get_db_height()?;
-        let hash = db.get_db_hash(height)?;
-        let vks = db.get_fvks()?;
-        (height, hash, vks)
+        let hash = db.get_db_hash(start_height)?;
+        let stored_blocks = db.get_checkpoints()?;
+        let vks = if range.decrypt {
+            db.get_fvks()?
+        } else {
+            HashMap::new()
+        };
+        (hash, stored_blocks, vks)
     };
-    let end_height = get_latest_height(&mut client).await?;
-    let end_height = (end_height - target_height_offset).max(start_height);
-    if start_height >= end_height {
-        return Ok(());
-    }
 
     let decrypter = DecryptNode::new(vks);
 
     let (processor_tx, mut processor_rx) = mpsc::channel::<Blocks>(1);
 
     let db_path2 = db_path.clone();
+    let nf_index = shared_nf_index(coin_type, &db_path);
+    let nf_index2 = nf_index.clone();
+    let note_cache = shared_note_cache(coin_type, &db_path);
+    let note_cache2 = note_cache.clone();
+    let sync_metrics = CoinConfig::get(get_coin_id(coin_type)).sync_metrics;
 
     let downloader = tokio::spawn(async move {
         log::info!("download_scheduler");
@@ -87,6 +402,8 @@ pub async fn sync_async(
             start_height,
             end_height,
             prev_hash,
+            &stored_blocks,
+            &checkpoint_policy,
             processor_tx,
             cancel,
         )
@@ -98,13 +415,30 @@ pub async fn sync_async(
 
     let processor = tokio::spawn(async move {
         let mut db = DbAdapter::new(coin_type, &db_path2)?;
-        let mut nfs = db.get_nullifiers()?;
+        nf_index.lock().unwrap().load(&db)?;
+        let mut prev_height = start_height;
+        let mut wait_start = Instant::now();
+        let mut tracker = ProgressTracker::new(start_height, end_height);
 
         while let Some(blocks) = processor_rx.recv().await {
+            let download_wait_ms = wait_start.elapsed().as_millis() as u64;
             if blocks.0.is_empty() {
                 continue;
             }
-            let (mut tree, witnesses) = db.get_tree()?;
+            let mut metrics = ChunkMetrics {
+                start_height: blocks.0[0].height as u32,
+                end_height: blocks.0[blocks.0.len() - 1].height as u32,
+                blocks: blocks.0.len() as u64,
+                bytes: blocks.1.bytes as u64,
+                download_wait_ms,
+                queue_ms: blocks.1.downloaded_at.elapsed().as_millis() as u64,
+                ..ChunkMetrics::default()
+            };
+            {
+                let callback = proc_callback.lock().await;
+                callback(tracker.set_stage(SyncStage::Decrypt));
+            }
+            let (mut tree, witnesses) = db.get_tree_at(prev_height)?;
             let mut bp = BlockProcessor::new(&tree, &witnesses);
             let mut absolute_position_at_block_start = tree.get_position();
 
@@ -114,6 +448,7 @@ pub async fn sync_async(
 
             let mut new_ids_tx: HashMap<u32, TxIdHeight> = HashMap::new();
             let mut witnesses: Vec<Witness> = vec![];
+            let mut spent_ids: Vec<u32> = vec![];
 
             {
                 // db tx scope
@@ -121,13 +456,19 @@ pub async fn sync_async(
                 let dec_blocks = decrypter.decrypt_blocks(&network, &blocks.0);
                 let batch_decrypt_elapsed: usize = dec_blocks.iter().map(|b| b.elapsed).sum();
                 log::info!("  Batch Decrypt: {} ms", batch_decrypt_elapsed);
+                metrics.decrypt_ms = start.elapsed().as_millis() as u64;
+                // the mempool scan shares the index, don't hold it during the decryption
+                let mut nfs = nf_index.lock().unwrap();
                 for b in dec_blocks.iter() {
-                    let mut my_nfs: Vec<Nf> = vec![];
+                    metrics.outputs += b.count_outputs as u64;
+                    metrics.notes += b.notes.len() as u64;
+                    let mut my_nfs: HashMap<Nf, NfRef> = HashMap::new();
                     for nf in b.spends.iter() {
                         if let Some(&nf_ref) = nfs.get(nf) {
                             log::info!("NF FOUND {} {}", nf_ref.id_note, b.height);
                             DbAdapter::mark_spent(nf_ref.id_note, b.height, &db_tx)?;
-                            my_nfs.push(*nf);
+                            my_nfs.insert(*nf, nf_ref);
+                            spent_ids.push(nf_ref.id_note);
                             nfs.remove(nf);
                         }
                     }
@@ -173,12 +514,20 @@ pub async fn sync_async(
                             n.position_in_block,
                             &db_tx,
                         )?;
+                        DbAdapter::store_invoice_payment(
+                            id_note,
+                            n.account,
+                            n.height,
+                            &n.pa.diversifier().0,
+                            &db_tx,
+                        )?;
                         DbAdapter::add_value(id_tx, note.value as i64, &db_tx)?;
                         nfs.insert(
                             Nf(nf.0),
                             NfRef {
                                 id_note,
                                 account: n.account,
+                                value: note.value,
                             },
                         );
 
@@ -192,9 +541,8 @@ pub async fn sync_async(
                                 let mut nf = [0u8; 32];
                                 nf.copy_from_slice(&cs.nf);
                                 let nf = Nf(nf);
-                                if my_nfs.contains(&nf) {
-                                    let (account, note_value) =
-                                        DbAdapter::get_received_note_value(&nf, &db_tx)?;
+                                if let Some(nf_ref) = my_nfs.get(&nf) {
+                                    let (account, note_value) = (nf_ref.account, nf_ref.value);
                                     let txid = &*tx.hash;
                                     let id_tx = DbAdapter::store_transaction(
                                         txid,
@@ -223,8 +571,14 @@ pub async fn sync_async(
                 log::info!("Dec end : {}", start.elapsed().as_millis());
 
                 db_tx.commit()?;
+                metrics.notes_db_ms = start.elapsed().as_millis() as u64 - metrics.decrypt_ms;
+                metrics.nullifier_hits = spent_ids.len() as u64;
             }
 
+            {
+                let callback = proc_callback.lock().await;
+                callback(tracker.set_stage(SyncStage::Witness));
+            }
             let start = Instant::now();
             let mut nodes: Vec<Node> = vec![];
             for cb in blocks.0.iter() {
@@ -244,9 +598,14 @@ pub async fn sync_async(
             // println!("NOTES = {}", nodes.len());
 
             log::info!("Witness : {}", start.elapsed().as_millis());
+            metrics.witness_ms = start.elapsed().as_millis() as u64;
 
             let start = Instant::now();
             if get_tx && !new_ids_tx.is_empty() {
+                {
+                    let callback = proc_callback.lock().await;
+                    callback(tracker.set_stage(SyncStage::TxDetails));
+                }
                 let mut ids: Vec<_> = new_ids_tx.into_iter().map(|(_, v)| v).collect();
                 ids.sort_by(|a, b| {
                     let c = a.height.cmp(&b.height);
@@ -262,6 +621,7 @@ pub async fn sync_async(
                     .unwrap();
             }
             log::info!("Transaction Details : {}", start.elapsed().as_millis());
+            metrics.tx_details_ms = start.elapsed().as_millis() as u64;
 
             let (new_tree, new_witnesses) = bp.finalize();
             tree = new_tree;
@@ -269,8 +629,21 @@ pub async fn sync_async(
 
             if let Some(block) = blocks.0.last() {
                 {
-                    let mut db_transaction = db.begin_transaction()?;
+                    let callback = proc_callback.lock().await;
+                    callback(tracker.set_stage(SyncStage::Commit));
+                }
+                let start = Instant::now();
+                {
                     let height = block.height as u32;
+                    // a block stored by another pass must have the same tree
+                    if let Some(stored_tree) = db.get_stored_tree(height)? {
+                        let mut bb: Vec<u8> = vec![];
+                        tree.write(&mut bb)?;
+                        if stored_tree != bb {
+                            anyhow::bail!(ChainError::TreeMismatch);
+                        }
+                    }
+                    let mut db_transaction = db.begin_transaction()?;
                     for w in witnesses.iter() {
                         DbAdapter::store_witnesses(&db_transaction, w, height, w.id_note)?;
                     }
@@ -284,21 +657,38 @@ pub async fn sync_async(
                     db_transaction.commit()?;
                     // db_transaction is dropped here
                 }
+                {
+                    let mut note_cache = note_cache.lock().unwrap();
+                    note_cache.add_checkpoint(prev_height, block.height as u32, &witnesses)?;
+                    note_cache.remove_spent(&spent_ids);
+                }
+                metrics.commit_ms = start.elapsed().as_millis() as u64;
+                let (blocks_done, outputs_done) = (metrics.blocks, metrics.outputs);
+                sync_metrics.lock().unwrap().record(metrics);
+                prev_height = block.height as u32;
                 log::info!("progress: {}", block.height);
                 let callback = proc_callback.lock().await;
-                callback(block.height as u32);
+                callback(tracker.chunk_done(prev_height, blocks_done, outputs_done));
             }
+            wait_start = Instant::now();
         }
 
-        let callback = progress_callback.lock().await;
-        callback(end_height);
+        if final_pass {
+            let callback = progress_callback.lock().await;
+            callback(tracker.done());
+        }
 
-        db.purge_old_witnesses(end_height - 100)?;
+        db.purge_checkpoints(&checkpoint_policy, end_height)?;
 
         Ok::<_, anyhow::Error>(())
     });
 
     let res = tokio::try_join!(downloader, processor);
+    if !matches!(res, Ok((_, Ok(())))) {
+        // the index may have changes from a rolled back db transaction
+        nf_index2.lock().unwrap().invalidate();
+        note_cache2.lock().unwrap().invalidate();
+    }
     match res {
         Ok((d, p)) => {
             if let Err(err) = d {
@@ -324,8 +714,247 @@ pub async fn sync_async(
     Ok(())
 }
 
+/// Nullifier index to keep up to date while scanning
+///
+/// Shares the index of the coin when the sync targets its database so that
+/// the mempool sees new notes and spends without reloading them
+fn shared_nf_index(coin_type: CoinType, db_path: &str) -> Arc<std::sync::Mutex<NfIndex>> {
+    let c = CoinConfig::get(get_coin_id(coin_type));
+    if c.db_path.as_deref() == Some(db_path) {
+        c.nf_index
+    } else {
+        Arc::new(std::sync::Mutex::new(NfIndex::default()))
+    }
+}
+
+/// Spendable note cache to keep up to date while scanning
+fn shared_note_cache(coin_type: CoinType, db_path: &str) -> Arc<std::sync::Mutex<NoteCache>> {
+    let c = CoinConfig::get(get_coin_id(coin_type));
+    if c.db_path.as_deref() == Some(db_path) {
+        c.note_cache
+    } else {
+        Arc::new(std::sync::Mutex::new(NoteCache::default()))
+    }
+}
+
 pub async fn latest_height(ld_url: &str) -> anyhow::Result<u32> {
     let mut client = connect_lightwalletd(ld_url).await?;
     let height = get_latest_height(&mut client).await?;
     Ok(height)
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chain_gen::{ChainGenConfig, ChainGenerator};
+    use crate::mock_lwd::{create_test_wallet, spawn_mock_lightwalletd, MockLightwalletd};
+    use rusqlite::params;
+
+    const RECENT_BLOCKS: u32 = 40;
+
+    /// Wallet synced up to 180 blocks below the tip of a 200 block chain,
+    /// with the last `RECENT_BLOCKS` blocks to scan first
+    ///
+    /// Returns the chain, the server url, the database and the frontier height
+    async fn backfill_wallet(
+        name: &str,
+    ) -> anyhow::Result<(Arc<ChainGenerator>, String, String, u32)> {
+        let config = ChainGenConfig {
+            block_count: 200,
+            outputs_per_block: 20,
+            spends_per_block: 5,
+            wallet_output_rate: 0.1,
+            wallet_spend_delay: 10,
+            ..ChainGenConfig::default()
+        };
+        let fvks = ChainGenerator::test_fvks(1);
+        let chain = Arc::new(ChainGenerator::new(
+            Network::MainNetwork,
+            config,
+            fvks.clone(),
+        ));
+        let server = Arc::new(MockLightwalletd::new(Network::MainNetwork, chain.clone()));
+        let url = spawn_mock_lightwalletd(server).await?;
+        let db_path = std::env::temp_dir().join(format!("warp-{}-{}.db", name, std::process::id()));
+        let db_path = db_path.to_string_lossy().to_string();
+        create_test_wallet(Network::MainNetwork, &db_path, &fvks)?;
+
+        let tip = chain.tip_height();
+        let no_progress: AMProgressCallback = Arc::new(Mutex::new(|_: &SyncProgress| {}));
+        static CANCEL: AtomicBool = AtomicBool::new(false);
+        sync_async(
+            CoinType::Zcash,
+            0,
+            false,
+            &db_path,
+            180,
+            no_progress,
+            &CANCEL,
+            &url,
+        )
+        .await?;
+        let mut client = connect_lightwalletd(&url).await?;
+        start_recent_first(CoinType::Zcash, &db_path, RECENT_BLOCKS, tip, &mut client).await?;
+        let frontier_height = tip - RECENT_BLOCKS;
+        let backfill = DbAdapter::new(CoinType::Zcash, &db_path)?.get_backfill()?;
+        assert_eq!(backfill, Some((tip - 180, frontier_height)));
+        Ok((chain, url, db_path, frontier_height))
+    }
+
+    async fn sync_canceled_at(
+        db_path: &str,
+        url: &str,
+        cancel_height: u32,
+        cancel: &'static AtomicBool,
+    ) -> anyhow::Result<()> {
+        cancel.store(false, atomic::Ordering::Release);
+        let callback: AMProgressCallback = Arc::new(Mutex::new(move |p: &SyncProgress| {
+            if p.height == cancel_height {
+                cancel.store(true, atomic::Ordering::Release);
+            }
+        }));
+        sync_async(CoinType::Zcash, 0, false, db_path, 0, callback, cancel, url).await
+    }
+
+    fn count(db: &DbAdapter, sql: &str, height: u32) -> anyhow::Result<usize> {
+        let count = db
+            .connection
+            .query_row(sql, params![height], |row| row.get(0))?;
+        Ok(count)
+    }
+
+    /// Notes, spends and witnesses of a wallet that completed its backfill
+    fn check_backfilled(
+        chain: &ChainGenerator,
+        db_path: &str,
+        frontier_height: u32,
+    ) -> anyhow::Result<()> {
+        let tip = chain.tip_height();
+        let delay = chain.config.wallet_spend_delay;
+        let db = DbAdapter::new(CoinType::Zcash, db_path)?;
+        assert_eq!(db.get_backfill()?, None);
+        assert_eq!(db.get_last_sync_height()?, Some(tip));
+
+        let received = count(
+            &db,
+            "SELECT COUNT(*) FROM received_notes WHERE height <= ?1",
+            tip,
+        )?;
+        let spent = count(
+            &db,
+            "SELECT COUNT(*) FROM received_notes WHERE spent IS NOT NULL AND spent <= ?1",
+            tip,
+        )?;
+        assert_eq!(received, chain.wallet_note_count(tip));
+        assert_eq!(spent, chain.wallet_spent_count());
+
+        // backfilled notes spent in the blocks scanned first
+        let expected = chain.wallet_note_count(frontier_height)
+            - chain.wallet_note_count(frontier_height - delay);
+        assert!(expected > 0);
+        let spent_recent = count(
+            &db,
+            "SELECT COUNT(*) FROM received_notes WHERE height <= ?1 AND spent > ?1",
+            frontier_height,
+        )?;
+        assert_eq!(spent_recent, expected);
+
+        let (_, witnesses) = db.get_tree_at(tip)?;
+        assert_eq!(witnesses.len(), received - spent);
+        let witness_sql = "SELECT COUNT(*) FROM sapling_witnesses w JOIN received_notes n \
+            ON w.note = n.id_note WHERE w.height = ?2 AND n.spent IS NULL AND n.height";
+        let backfilled = db.connection.query_row(
+            &format!("{} <= ?1", witness_sql),
+            params![frontier_height, tip],
+            |row| row.get::<_, usize>(0),
+        )?;
+        let recent = db.connection.query_row(
+            &format!("{} > ?1", witness_sql),
+            params![frontier_height, tip],
+            |row| row.get::<_, usize>(0),
+        )?;
+        assert!(backfilled > 0 && recent > 0);
+        assert_eq!(backfilled + recent, witnesses.len());
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_backfill() -> anyhow::Result<()> {
+        static CANCEL: AtomicBool = AtomicBool::new(false);
+        let (chain, url, db_path, frontier_height) = backfill_wallet("backfill").await?;
+        sync_canceled_at(&db_path, &url, 0, &CANCEL).await?;
+        check_backfilled(&chain, &db_path, frontier_height)?;
+        let _ = std::fs::remove_file(&db_path);
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn test_backfill_canceled() -> anyhow::Result<()> {
+        static CANCEL: AtomicBool = AtomicBool::new(false);
+        let (chain, url, db_path, frontier_height) = backfill_wallet("backfill-canceled").await?;
+        let tip = chain.tip_height();
+
+        // after the recent blocks, then after the blocks before the frontier
+        for cancel_height in vec![tip, frontier_height] {
+            sync_canceled_at(&db_path, &url, cancel_height, &CANCEL).await?;
+            let db = DbAdapter::new(CoinType::Zcash, &db_path)?;
+            assert!(db.get_backfill()?.is_some());
+        }
+        sync_canceled_at(&db_path, &url, 0, &CANCEL).await?;
+        check_backfilled(&chain, &db_path, frontier_height)?;
+        let _ = std::fs::remove_file(&db_path);
+        Ok(())
+    }
+    #[tokio::test]
+    async fn test_invoice_payments() -> anyhow::Result<()> {
+        static CANCEL: AtomicBool = AtomicBool::new(false);
+        let config = ChainGenConfig {
+            block_count: 100,
+            outputs_per_block: 20,
+            wallet_output_rate: 0.1,
+            ..ChainGenConfig::default()
+        };
+        let fvks = ChainGenerator::test_fvks(1);
+        let chain = Arc::new(ChainGenerator::new(
+            Network::MainNetwork,
+            config,
+            fvks.clone(),
+        ));
+        let server = Arc::new(MockLightwalletd::new(Network::MainNetwork, chain.clone()));
+        let url = spawn_mock_lightwalletd(server).await?;
+        let db_path = std::env::temp_dir().join(format!("warp-invoice-{}.db", std::process::id()));
+        let db_path = db_path.to_string_lossy().to_string();
+        let accounts = create_test_wallet(Network::MainNetwork, &db_path, &fvks)?;
+
+        // the generated notes all go to the default address
+        let (_, pa) = fvks[0].default_address();
+        DbAdapter::new(CoinType::Zcash, &db_path)?.store_invoice(
+            accounts[0],
+            &pa.diversifier().0,
+            "inv-1",
+        )?;
+        sync_canceled_at(&db_path, &url, 0, &CANCEL).await?;
+
+        let tip = chain.tip_height();
+        let mut db = DbAdapter::new(CoinType::Zcash, &db_path)?;
+        let payments = db.get_invoice_payments("inv-1")?;
+        assert!(!payments.is_empty());
+        assert_eq!(payments.len(), chain.wallet_note_count(tip));
+        assert!(payments.iter().all(|p| p.account == accounts[0]));
+        assert!(db.get_invoice_payments("inv-2")?.is_empty());
+
+        // payments at or above the trim height go away with their notes
+        let height = db.trim_to_height(tip - 50)?;
+        let payments = db.get_invoice_payments("inv-1")?;
+        assert_eq!(payments.len(), chain.wallet_note_count(height - 1));
+        assert!(payments.iter().all(|p| p.height < height));
+        let rows = count(
+            &db,
+            "SELECT COUNT(*) FROM invoice_payments WHERE height >= ?1",
+            height,
+        )?;
+        assert_eq!(rows, 0);
+        let _ = std::fs::remove_file(&db_path);
+        Ok(())
+    }
+}
@@ -0,0 +1,544 @@
+use crate::builder::BlockProcessor;
+use crate::chain::{Nf, NfRef};
+use crate::checkpoint::CheckpointPolicy;
+use crate::coinconfig::CoinConfig;
+use crate::db::{AccountViewKey, DbAdapter, ReceivedNote};
+use crate::scan::Blocks;
+use crate::transaction::retrieve_tx_info;
+use crate::{
+    connect_lightwalletd, download_chain, get_latest_height, CTree, CompactBlock,
+    CompactTxStreamerClient, DecryptNode, Witness,
+};
+use ff::PrimeField;
+use rusqlite::Transaction;
+use std::collections::{HashMap, HashSet};
+use std::sync::atomic::AtomicBool;
+use tokio::sync::mpsc;
+use tonic::transport::Channel;
+use zcash_params::coin::{get_coin_chain, get_coin_id, CoinType};
+use zcash_primitives::consensus::Network;
+use zcash_primitives::sapling::Node;
+
+/// A wallet database synced by `sync_tenants`
+///
+/// Its connection is only opened for the chunks that write to it
+struct Tenant {
+    db_path: String,
+    height: u32,
+}
+
+/// Scan state of all the tenants that joined
+///
+/// Accounts and notes get ids that are unique across tenants.
+/// `accounts` and `notes` map them back to the tenant and its own ids
+struct SharedState {
+    coin_type: CoinType,
+    tree: CTree,
+    witnesses: Vec<Witness>,
+    vks: HashMap<u32, AccountViewKey>,
+    accounts: Vec<(usize, u32)>,
+    notes: Vec<(usize, u32)>,
+    // the same note can be in several databases
+    nfs: HashMap<Nf, Vec<(usize, NfRef)>>,
+    active: Vec<bool>,
+}
+
+/// Sync many wallet databases with a single pass over the chain
+///
+/// The blocks are downloaded, decrypted with the keys of every database
+/// and added to the commitment tree once. The notes, spends and witnesses
+/// are then stored in the database they belong to.
+/// Databases that are behind join the scan when it reaches their height.
+/// A database is only written when the chunk has notes, spends or witnesses
+/// for it, or ends at a checkpoint
+pub async fn sync_tenants(
+    coin_type: CoinType,
+    db_paths: &[String],
+    ld_url: &str,
+    get_tx: bool,
+    cancel: &'static AtomicBool,
+) -> anyhow::Result<()> {
+    let network = *get_coin_chain(coin_type).network();
+    let checkpoint_policy = CoinConfig::get(get_coin_id(coin_type)).checkpoint_policy;
+    let mut client = connect_lightwalletd(ld_url).await?;
+    let end_height = get_latest_height(&mut client).await?;
+
+    let mut tenants = vec![];
+    for db_path in db_paths.iter() {
+        let db = DbAdapter::new(coin_type, db_path)?;
+        if db.get_backfill()?.is_some() {
+            log::warn!(
+                "{} has a pending backfill and must sync on its own",
+                db_path
+            );
+            continue;
+        }
+        let height = db.get_db_height()?;
+        if height < end_height {
+            tenants.push(Tenant {
+                db_path: db_path.clone(),
+                height,
+            });
+        }
+    }
+    if tenants.is_empty() {
+        return Ok(());
+    }
+    tenants.sort_by_key(|t| t.height);
+
+    let mut height = tenants[0].height;
+    let (tree, mut prev_hash) = {
+        let db = DbAdapter::new(coin_type, &tenants[0].db_path)?;
+        let (tree, _) = db.get_tree_at(height)?;
+        (tree, db.get_db_hash(height)?)
+    };
+    let mut state = SharedState::new(coin_type, tree, tenants.len());
+    let mut next = 0;
+    while height < end_height {
+        while next < tenants.len() && tenants[next].height == height {
+            state.add_tenant(next, &tenants[next])?;
+            next += 1;
+        }
+        let range_end = tenants.get(next).map(|t| t.height).unwrap_or(end_height);
+        log::info!("Shared scan {}-{}", height, range_end);
+        prev_hash = scan_tenants(
+            coin_type,
+            &network,
+            &mut client,
+            &mut state,
+            &tenants,
+            height,
+            range_end,
+            prev_hash,
+            &checkpoint_policy,
+            get_tx,
+            cancel,
+        )
+        .await?;
+        height = range_end;
+    }
+
+    for (t, tenant) in tenants.iter().enumerate() {
+        if state.active[t] {
+            DbAdapter::new(coin_type, &tenant.db_path)?
+                .purge_checkpoints(&checkpoint_policy, end_height)?;
+        }
+    }
+    log::info!("Shared scan completed");
+    Ok(())
+}
+
+/// Scan `(start_height, end_height]` for the active tenants and return the hash
+/// of the last block
+async fn scan_tenants(
+    coin_type: CoinType,
+    network: &Network,
+    client: &mut CompactTxStreamerClient<Channel>,
+    state: &mut SharedState,
+    tenants: &[Tenant],
+    start_height: u32,
+    end_height: u32,
+    prev_hash: Option<[u8; 32]>,
+    checkpoint_policy: &CheckpointPolicy,
+    get_tx: bool,
+    cancel: &'static AtomicBool,
+) -> anyhow::Result<Option<[u8; 32]>> {
+    let (blocks_tx, mut blocks_rx) = mpsc::channel::<Blocks>(1);
+    let mut download_client = client.clone();
+    let checkpoint_policy = *checkpoint_policy;
+    let downloader = tokio::spawn(async move {
+        download_chain(
+            &mut download_client,
+            start_height,
+            end_height,
+            prev_hash,
+            &[],
+            &checkpoint_policy,
+            blocks_tx,
+            cancel,
+        )
+        .await
+    });
+
+    let decrypter = DecryptNode::new(state.vks.clone());
+    let mut last_hash = prev_hash;
+    while let Some(blocks) = blocks_rx.recv().await {
+        let block = match blocks.0.last() {
+            Some(block) => block,
+            None => continue,
+        };
+        let height = block.height as u32;
+        let store_all = height == end_height || checkpoint_policy.is_checkpoint(height, end_height);
+        let new_txs = state.process_blocks(tenants, &decrypter, network, &blocks.0, store_all)?;
+        let mut hash = [0u8; 32];
+        hash.copy_from_slice(&block.hash);
+        last_hash = Some(hash);
+
+        if get_tx {
+            for (t, ids) in new_txs.iter().enumerate() {
+                if !ids.is_empty() {
+                    retrieve_tx_info(coin_type, client, &tenants[t].db_path, ids).await?;
+                }
+            }
+        }
+    }
+    downloader.await??;
+    Ok(last_hash)
+}
+
+impl SharedState {
+    fn new(coin_type: CoinType, tree: CTree, tenant_count: usize) -> Self {
+        SharedState {
+            coin_type,
+            tree,
+            witnesses: vec![],
+            vks: HashMap::new(),
+            accounts: vec![],
+            notes: vec![],
+            nfs: HashMap::new(),
+            active: vec![false; tenant_count],
+        }
+    }
+
+    /// Add the keys, nullifiers and witnesses of a tenant that is at the height of the scan
+    ///
+    /// The tenant is left out if its tree is not the one of the scan
+    fn add_tenant(&mut self, t: usize, tenant: &Tenant) -> anyhow::Result<()> {
+        let db = DbAdapter::new(self.coin_type, &tenant.db_path)?;
+        let (tree, witnesses) = db.get_tree_at(tenant.height)?;
+        if tree_bytes(&tree)? != tree_bytes(&self.tree)? {
+            log::warn!(
+                "{} is on a different chain and must sync on its own",
+                tenant.db_path
+            );
+            return Ok(());
+        }
+        for (account, vk) in db.get_fvks()? {
+            let id = self.accounts.len() as u32;
+            self.accounts.push((t, account));
+            self.vks.insert(id, vk);
+        }
+        for (nf, nf_ref) in db.get_nullifiers()? {
+            self.nfs.entry(nf).or_default().push((t, nf_ref));
+        }
+        for mut w in witnesses {
+            w.id_note = self.new_note_id(t, w.id_note);
+            self.witnesses.push(w);
+        }
+        self.active[t] = true;
+        Ok(())
+    }
+
+    fn new_note_id(&mut self, t: usize, id_note: u32) -> u32 {
+        let id = self.notes.len() as u32;
+        self.notes.push((t, id_note));
+        id
+    }
+
+    /// Store the notes and spends of a chunk in the tenant databases, advance
+    /// the tree and the witnesses of every tenant together, then store them
+    ///
+    /// Each tenant that has something to write gets a single transaction.
+    /// With `store_all`, the block is stored in every tenant.
+    /// Returns the new transaction ids of each tenant, in chain order
+    fn process_blocks(
+        &mut self,
+        tenants: &[Tenant],
+        decrypter: &DecryptNode,
+        network: &Network,
+        blocks: &[CompactBlock],
+        store_all: bool,
+    ) -> anyhow::Result<Vec<Vec<u32>>> {
+        let dec_blocks = decrypter.decrypt_blocks(network, blocks);
+        let mut writes = vec![store_all; tenants.len()];
+        for w in self.witnesses.iter() {
+            writes[self.notes[w.id_note as usize].0] = true;
+        }
+        for b in dec_blocks.iter() {
+            for n in b.notes.iter() {
+                writes[self.accounts[n.account as usize].0] = true;
+            }
+            for nf in b.spends.iter() {
+                if let Some(refs) = self.nfs.get(nf) {
+                    for &(t, _) in refs.iter() {
+                        writes[t] = true;
+                    }
+                }
+            }
+        }
+        let mut dbs: Vec<Option<DbAdapter>> = vec![];
+        for (t, tenant) in tenants.iter().enumerate() {
+            dbs.push(if self.active[t] && writes[t] {
+                Some(DbAdapter::new(self.coin_type, &tenant.db_path)?)
+            } else {
+                None
+            });
+        }
+        let mut db_txs: Vec<Option<Transaction>> = vec![];
+        for db in dbs.iter_mut() {
+            db_txs.push(match db {
+                Some(db) => Some(db.begin_transaction()?),
+                None => None,
+            });
+        }
+
+        let mut position = self.tree.get_position();
+        let mut new_witnesses: Vec<Witness> = vec![];
+        let mut new_txs: Vec<HashMap<u32, (u32, u32)>> = vec![HashMap::new(); tenants.len()];
+        let mut spent: HashSet<(usize, u32)> = HashSet::new();
+        for b in dec_blocks.iter() {
+            let mut my_nfs: HashMap<Nf, Vec<(usize, NfRef)>> = HashMap::new();
+            for nf in b.spends.iter() {
+                if let Some(refs) = self.nfs.remove(nf) {
+                    for &(t, nf_ref) in refs.iter() {
+                        let db_tx = db_txs[t].as_ref().unwrap();
+                        DbAdapter::mark_spent(nf_ref.id_note, b.height, db_tx)?;
+                        spent.insert((t, nf_ref.id_note));
+                    }
+                    my_nfs.insert(*nf, refs);
+                }
+            }
+
+            for n in b.notes.iter() {
+                let (t, account) = self.accounts[n.account as usize];
+                let db_tx = db_txs[t].as_ref().unwrap();
+                let p = position + n.position_in_block;
+                let note = &n.note;
+                let rcm = note.rcm().to_repr();
+                let nf = note.nf(&n.ivk.fvk.vk, p as u64);
+
+                let id_tx = DbAdapter::store_transaction(
+                    &n.txid,
+                    account,
+                    n.height,
+                    b.compact_block.time,
+                    n.tx_index as u32,
+                    db_tx,
+                )?;
+                new_txs[t].insert(id_tx, (n.height, n.tx_index as u32));
+                let id_note = DbAdapter::store_received_note(
+                    &ReceivedNote {
+                        account,
+                        height: n.height,
+                        output_index: n.output_index as u32,
+                        diversifier: n.pa.diversifier().0.to_vec(),
+                        value: note.value,
+                        rcm: rcm.to_vec(),
+                        nf: nf.0.to_vec(),
+                        spent: None,
+                    },
+                    id_tx,
+                    n.position_in_block,
+                    db_tx,
+                )?;
+                DbAdapter::store_invoice_payment(
+                    id_note,
+                    account,
+                    n.height,
+                    &n.pa.diversifier().0,
+                    db_tx,
+                )?;
+                DbAdapter::add_value(id_tx, note.value as i64, db_tx)?;
+                self.nfs.entry(Nf(nf.0)).or_default().push((
+                    t,
+                    NfRef {
+                        id_note,
+                        account,
+                        value: note.value,
+                    },
+                ));
+                let id = self.new_note_id(t, id_note);
+                new_witnesses.push(Witness::new(p as usize, id, Some(n.clone())));
+            }
+
+            if !my_nfs.is_empty() {
+                for (tx_index, tx) in b.compact_block.vtx.iter().enumerate() {
+                    for cs in tx.spends.iter() {
+                        let mut nf = [0u8; 32];
+                        nf.copy_from_slice(&cs.nf);
+                        if let Some(refs) = my_nfs.get(&Nf(nf)) {
+                            for &(t, nf_ref) in refs.iter() {
+                                let db_tx = db_txs[t].as_ref().unwrap();
+                                let id_tx = DbAdapter::store_transaction(
+                                    &tx.hash,
+                                    nf_ref.account,
+                                    b.height,
+                                    b.compact_block.time,
+                                    tx_index as u32,
+                                    db_tx,
+                                )?;
+                                new_txs[t].insert(id_tx, (b.height, tx_index as u32));
+                                DbAdapter::add_value(id_tx, -(nf_ref.value as i64), db_tx)?;
+                            }
+                        }
+                    }
+                }
+            }
+
+            position += b.count_outputs as usize;
+        }
+
+        let mut nodes: Vec<Node> = vec![];
+        for cb in blocks.iter() {
+            for tx in cb.vtx.iter() {
+                for co in tx.outputs.iter() {
+                    let mut cmu = [0u8; 32];
+                    cmu.copy_from_slice(&co.cmu);
+                    nodes.push(Node::new(cmu));
+                }
+            }
+        }
+        let mut bp = BlockProcessor::new(&self.tree, &self.witnesses);
+        if !nodes.is_empty() {
+            bp.add_nodes(&mut nodes, &new_witnesses);
+        }
+        let (tree, witnesses) = bp.finalize();
+        self.tree = tree;
+        let notes = &self.notes;
+        self.witnesses = witnesses
+            .into_iter()
+            .filter(|w| !spent.contains(&notes[w.id_note as usize]))
+            .collect();
+
+        let block = blocks.last().unwrap();
+        let height = block.height as u32;
+        for w in self.witnesses.iter() {
+            let (t, id_note) = self.notes[w.id_note as usize];
+            if let Some(db_tx) = db_txs[t].as_ref() {
+                DbAdapter::store_witnesses(db_tx, w, height, id_note)?;
+            }
+        }
+        for db_tx in db_txs.into_iter().flatten() {
+            DbAdapter::store_block(&db_tx, height, &block.hash, block.time, &self.tree)?;
+            db_tx.commit()?;
+        }
+
+        let new_txs = new_txs
+            .into_iter()
+            .map(|txs| {
+                let mut ids: Vec<_> = txs.into_iter().collect();
+                ids.sort_by_key(|(_, height_index)| *height_index);
+                ids.into_iter().map(|(id_tx, _)| id_tx).collect()
+            })
+            .collect();
+        Ok(new_txs)
+    }
+}
+
+fn tree_bytes(tree: &CTree) -> anyhow::Result<Vec<u8>> {
+    let mut bb: Vec<u8> = vec![];
+    tree.write(&mut bb)?;
+    Ok(bb)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::chain::get_block_tree_state;
+    use crate::chain_gen::{ChainGenConfig, ChainGenerator};
+    use crate::mock_lwd::{create_test_wallet, spawn_mock_lightwalletd, MockLightwalletd};
+    use rusqlite::params;
+    use std::sync::Arc;
+    use zcash_primitives::zip32::ExtendedFullViewingKey;
+
+    static CANCEL: AtomicBool = AtomicBool::new(false);
+
+    /// Notes received and spent by the chain account `account` after `from`
+    fn expected_notes(chain: &ChainGenerator, account: usize, from: u32) -> (usize, usize) {
+        let tip = chain.tip_height();
+        let delay = chain.config.wallet_spend_delay;
+        let (mut received, mut spent) = (0, 0);
+        for height in from + 1..=tip {
+            let count = chain
+                .wallet_notes(height)
+                .iter()
+                .filter(|(_, n)| n.account == account)
+                .count();
+            received += count;
+            if height + delay <= tip {
+                spent += count;
+            }
+        }
+        (received, spent)
+    }
+
+    fn stored_notes(db: &DbAdapter, account: u32) -> anyhow::Result<(usize, usize)> {
+        let received = db.connection.query_row(
+            "SELECT COUNT(*) FROM received_notes WHERE account = ?1",
+            params![account],
+            |row| row.get(0),
+        )?;
+        let spent = db.connection.query_row(
+            "SELECT COUNT(*) FROM received_notes WHERE account = ?1 AND spent IS NOT NULL",
+            params![account],
+            |row| row.get(0),
+        )?;
+        Ok((received, spent))
+    }
+
+    #[tokio::test]
+    async fn test_shared_scan() -> anyhow::Result<()> {
+        let network = Network::MainNetwork;
+        let config = ChainGenConfig {
+            block_count: 100,
+            outputs_per_block: 20,
+            spends_per_block: 5,
+            wallet_output_rate: 0.1,
+            wallet_spend_delay: 10,
+            ..ChainGenConfig::default()
+        };
+        let start_height = config.start_height;
+        let fvks = ChainGenerator::test_fvks(3);
+        let chain = Arc::new(ChainGenerator::new(network, config, fvks.clone()));
+        let server = Arc::new(MockLightwalletd::new(network, chain.clone()));
+        let url = spawn_mock_lightwalletd(server).await?;
+        let tip = chain.tip_height();
+
+        // A and B both hold the second account, so its nullifiers are in both.
+        // C joins the scan halfway
+        let join_height = start_height + 50;
+        let tenants: Vec<(&[ExtendedFullViewingKey], Vec<usize>, u32)> = vec![
+            (&fvks[0..2], vec![0, 1], start_height),
+            (&fvks[1..2], vec![1], start_height),
+            (&fvks[2..3], vec![2], join_height),
+        ];
+        let mut db_paths = vec![];
+        let mut account_ids = vec![];
+        for (i, (tenant_fvks, _, _)) in tenants.iter().enumerate() {
+            let db_path = std::env::temp_dir().join(format!(
+                "warp-shared-scan-{}-{}.db",
+                std::process::id(),
+                i
+            ));
+            let db_path = db_path.to_string_lossy().to_string();
+            account_ids.push(create_test_wallet(network, &db_path, tenant_fvks)?);
+            db_paths.push(db_path);
+        }
+        let mut client = connect_lightwalletd(&url).await?;
+        let (hash, time, tree) = get_block_tree_state(&mut client, join_height).await?;
+        {
+            let db = DbAdapter::new(CoinType::Zcash, &db_paths[2])?;
+            DbAdapter::store_block(&db.connection, join_height, &hash, time, &tree)?;
+        }
+
+        sync_tenants(CoinType::Zcash, &db_paths, &url, false, &CANCEL).await?;
+
+        assert!(expected_notes(&chain, 1, start_height).1 > 0);
+        for ((_, chain_accounts, from), (db_path, ids)) in
+            tenants.iter().zip(db_paths.iter().zip(account_ids.iter()))
+        {
+            let db = DbAdapter::new(CoinType::Zcash, db_path)?;
+            assert_eq!(db.get_last_sync_height()?, Some(tip));
+            let mut unspent = 0;
+            for (&account, &id_account) in chain_accounts.iter().zip(ids.iter()) {
+                let expected = expected_notes(&chain, account, *from);
+                assert_eq!(stored_notes(&db, id_account)?, expected);
+                unspent += expected.0 - expected.1;
+            }
+            let (_, witnesses) = db.get_tree_at(tip)?;
+            assert_eq!(witnesses.len(), unspent);
+            let _ = std::fs::remove_file(db_path);
+        }
+        Ok(())
+    }
+}
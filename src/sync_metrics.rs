@@ -0,0 +1,245 @@
+use serde::Serialize;
+use std::fmt::Write;
+use std::time::Instant;
+
+const RATE_SMOOTHING: f64 = 0.3;
+
+/// Counters of a chunk of blocks processed by the sync
+#[derive(Clone, Debug, Default, Serialize)]
+pub struct ChunkMetrics {
+    pub start_height: u32,
+    pub end_height: u32,
+    pub blocks: u64,
+    pub outputs: u64,
+    /// Size of the compact blocks as received from the server
+    pub bytes: u64,
+    pub notes: u64,
+    pub nullifier_hits: u64,
+    /// Time the processor waited for the downloader
+    pub download_wait_ms: u64,
+    /// Time the chunk waited for the processor after its download
+    pub queue_ms: u64,
+    pub decrypt_ms: u64,
+    /// Storing the new notes and spends
+    pub notes_db_ms: u64,
+    pub witness_ms: u64,
+    pub tx_details_ms: u64,
+    /// Storing the tree and the witnesses of the last block
+    pub commit_ms: u64,
+}
+
+impl ChunkMetrics {
+    fn add(&mut self, other: &ChunkMetrics) {
+        if self.blocks == 0 {
+            self.start_height = other.start_height;
+        }
+        self.end_height = other.end_height;
+        self.blocks += other.blocks;
+        self.outputs += other.outputs;
+        self.bytes += other.bytes;
+        self.notes += other.notes;
+        self.nullifier_hits += other.nullifier_hits;
+        self.download_wait_ms += other.download_wait_ms;
+        self.queue_ms += other.queue_ms;
+        self.decrypt_ms += other.decrypt_ms;
+        self.notes_db_ms += other.notes_db_ms;
+        self.witness_ms += other.witness_ms;
+        self.tx_details_ms += other.tx_details_ms;
+        self.commit_ms += other.commit_ms;
+    }
+}
+
+/// Sync counters of a coin since the start of the process
+#[derive(Clone, Debug, Default, Serialize)]
+pub struct SyncMetrics {
+    pub chunks: u64,
+    pub total: ChunkMetrics,
+    pub last_chunk: Option<ChunkMetrics>,
+}
+
+impl SyncMetrics {
+    pub fn record(&mut self, chunk: ChunkMetrics) {
+        self.chunks += 1;
+        self.total.add(&chunk);
+        self.last_chunk = Some(chunk);
+    }
+
+    fn samples(&self) -> [(&'static str, &'static str, u64); 14] {
+        let t = &self.total;
+        [
+            ("chunks", "Chunks of blocks processed", self.chunks),
+            ("blocks", "Blocks processed", t.blocks),
+            ("outputs", "Sapling outputs processed", t.outputs),
+            ("bytes", "Bytes of compact blocks downloaded", t.bytes),
+            ("notes", "Notes received", t.notes),
+            ("nullifier_hits", "Notes spent", t.nullifier_hits),
+            (
+                "download_wait_ms",
+                "Time waiting for the downloader",
+                t.download_wait_ms,
+            ),
+            (
+                "queue_ms",
+                "Time downloaded chunks waited for the processor",
+                t.queue_ms,
+            ),
+            ("decrypt_ms", "Time decrypting outputs", t.decrypt_ms),
+            (
+                "notes_db_ms",
+                "Time storing notes and spends",
+                t.notes_db_ms,
+            ),
+            (
+                "witness_ms",
+                "Time updating the tree and witnesses",
+                t.witness_ms,
+            ),
+            (
+                "tx_details_ms",
+                "Time fetching transaction details",
+                t.tx_details_ms,
+            ),
+            (
+                "commit_ms",
+                "Time storing the tree and witnesses",
+                t.commit_ms,
+            ),
+            ("height", "Last height processed", t.end_height as u64),
+        ]
+    }
+}
+
+/// Sync metrics of several coins in the Prometheus text format
+pub fn to_prometheus(metrics: &[(u8, SyncMetrics)]) -> String {
+    let samples: Vec<_> = metrics.iter().map(|(c, m)| (*c, m.samples())).collect();
+    let mut out = String::new();
+    if samples.is_empty() {
+        return out;
+    }
+    for i in 0..samples[0].1.len() {
+        let (name, help, _) = samples[0].1[i];
+        let kind = if name == "height" { "gauge" } else { "counter" };
+        let _ = writeln!(out, "# HELP warp_sync_{} {}", name, help);
+        let _ = writeln!(out, "# TYPE warp_sync_{} {}", name, kind);
+        for (coin, s) in samples.iter() {
+            let _ = writeln!(out, "warp_sync_{}{{coin=\"{}\"}} {}", name, coin, s[i].2);
+        }
+    }
+    out
+}
+
+/// What the sync is doing
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Serialize)]
+#[serde(rename_all = "snake_case")]
+pub enum SyncStage {
+    /// Waiting for the next chunk of blocks
+    Download,
+    /// Decrypting outputs and storing notes and spends
+    Decrypt,
+    Witness,
+    TxDetails,
+    /// Storing the tree and the witnesses
+    Commit,
+    Done,
+}
+
+/// Progress event of a sync pass
+#[derive(Clone, Debug, Serialize)]
+pub struct SyncProgress {
+    pub stage: SyncStage,
+    /// Last block stored
+    pub height: u32,
+    pub start_height: u32,
+    pub target_height: u32,
+    pub blocks_per_sec: f64,
+    pub outputs_per_sec: f64,
+    /// None until the first chunk is done
+    pub eta_secs: Option<u64>,
+}
+
+/// Derives the rates and the remaining time of a sync pass from its chunks
+///
+/// The rates are smoothed over the last chunks because the number of outputs
+/// per block varies a lot along the chain
+pub struct ProgressTracker {
+    progress: SyncProgress,
+    chunk_start: Instant,
+}
+
+impl ProgressTracker {
+    pub fn new(start_height: u32, target_height: u32) -> Self {
+        ProgressTracker {
+            progress: SyncProgress {
+                stage: SyncStage::Download,
+                height: start_height,
+                start_height,
+                target_height,
+                blocks_per_sec: 0.0,
+                outputs_per_sec: 0.0,
+                eta_secs: None,
+            },
+            chunk_start: Instant::now(),
+        }
+    }
+
+    pub fn set_stage(&mut self, stage: SyncStage) -> &SyncProgress {
+        self.progress.stage = stage;
+        &self.progress
+    }
+
+    /// Update the rates with a chunk that ends at `height`
+    pub fn chunk_done(&mut self, height: u32, blocks: u64, outputs: u64) -> &SyncProgress {
+        let elapsed = self.chunk_start.elapsed().as_secs_f64().max(1e-3);
+        self.chunk_start = Instant::now();
+        let p = &mut self.progress;
+        let blocks_per_sec = blocks as f64 / elapsed;
+        let outputs_per_sec = outputs as f64 / elapsed;
+        if p.eta_secs.is_none() {
+            p.blocks_per_sec = blocks_per_sec;
+            p.outputs_per_sec = outputs_per_sec;
+        } else {
+            p.blocks_per_sec += RATE_SMOOTHING * (blocks_per_sec - p.blocks_per_sec);
+            p.outputs_per_sec += RATE_SMOOTHING * (outputs_per_sec - p.outputs_per_sec);
+        }
+        p.height = height;
+        p.stage = SyncStage::Download;
+        let remaining = p.target_height.saturating_sub(height) as f64;
+        p.eta_secs = Some((remaining / p.blocks_per_sec.max(1e-3)).ceil() as u64);
+        p
+    }
+
+    pub fn done(&mut self) -> &SyncProgress {
+        let p = &mut self.progress;
+        p.height = p.target_height;
+        p.stage = SyncStage::Done;
+        p.eta_secs = Some(0);
+        p
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_prometheus_format() {
+        let mut metrics = SyncMetrics::default();
+        for h in [1_000u32, 2_000].iter() {
+            metrics.record(ChunkMetrics {
+                start_height: h - 999,
+                end_height: *h,
+                blocks: 1_000,
+                outputs: 5_000,
+                ..ChunkMetrics::default()
+            });
+        }
+        assert_eq!(metrics.total.start_height, 1);
+        assert_eq!(metrics.total.blocks, 2_000);
+
+        let text = to_prometheus(&[(0, metrics.clone()), (1, SyncMetrics::default())]);
+        assert_eq!(text.matches("# TYPE warp_sync_outputs counter").count(), 1);
+        assert!(text.contains("warp_sync_outputs{coin=\"0\"} 10000\n"));
+        assert!(text.contains("warp_sync_outputs{coin=\"1\"} 0\n"));
+        assert!(text.contains("warp_sync_height{coin=\"0\"} 2000\n"));
+    }
+}
@@ -4,24 +4,27 @@ use crate::api::payment::decode_memo;
 use crate::{CompactTxStreamerClient, DbAdapter, TxFilter};
 use anyhow::anyhow;
 use futures::StreamExt;
+use rayon::prelude::*;
 use std::collections::HashMap;
 use std::convert::TryFrom;
-use std::sync::mpsc;
-use std::sync::mpsc::SyncSender;
 use tonic::transport::Channel;
 use tonic::Request;
 use zcash_client_backend::encoding::{
     decode_extended_full_viewing_key, encode_payment_address, encode_transparent_address,
 };
+use zcash_note_encryption::batch::try_note_decryption;
 use zcash_params::coin::{get_branch, get_coin_chain, CoinType};
 use zcash_primitives::consensus::{BlockHeight, Network, Parameters};
-use zcash_primitives::memo::Memo;
-use zcash_primitives::sapling::note_encryption::{
-    try_sapling_note_decryption, try_sapling_output_recovery,
-};
+use zcash_primitives::memo::{Memo, MemoBytes};
+use zcash_primitives::sapling::note_encryption::{try_sapling_output_recovery, SaplingDomain};
+use zcash_primitives::sapling::{Note, PaymentAddress};
+use zcash_primitives::transaction::components::sapling::{GrothProofBytes, OutputDescription};
 use zcash_primitives::transaction::Transaction;
 use zcash_primitives::zip32::ExtendedFullViewingKey;
 
+const DECRYPT_BATCH_SIZE: usize = 64;
+const MAX_CONCURRENT_FETCHES: usize = 16;
+
 #[derive(Debug)]
 pub struct TransactionInfo {
     height: u32,
@@ -55,10 +58,16 @@ pub async fn decode_transaction(
     timestamp: u32,
     index: u32,
 ) -> anyhow::Result<TransactionInfo> {
-    let consensus_branch_id = get_branch(network, height);
-    let ivk = fvk.fvk.vk.ivk();
-    let ovk = fvk.fvk.ovk;
+    let raw_tx = fetch_raw_transaction(client, tx_hash).await?;
+    decode_transaction_data(
+        network, nfs, id_tx, account, fvk, &raw_tx, height, timestamp, index,
+    )
+}
 
+async fn fetch_raw_transaction(
+    client: &mut CompactTxStreamerClient<Channel>,
+    tx_hash: &[u8],
+) -> anyhow::Result<Vec<u8>> {
     let tx_filter = TxFilter {
         block: None,
         index: 0,
@@ -68,7 +77,82 @@ pub async fn decode_transaction(
         .get_transaction(Request::new(tx_filter))
         .await?
         .into_inner();
-    let tx = Transaction::read(&*raw_tx.data, consensus_branch_id)?;
+    Ok(raw_tx.data)
+}
+
+/// A shielded output that decrypts with one of our keys
+pub struct DecryptedOutput {
+    pub note: Note,
+    pub pa: PaymentAddress,
+    pub memo: MemoBytes,
+    pub incoming: bool, // decrypted with the ivk, otherwise recovered with the ovk
+}
+
+/// Trial decrypt the shielded outputs of a full transaction
+///
+/// Outputs are decrypted in batches with the ivk so that the ephemeral keys
+/// are prepared once per batch. The batches and the ovk recovery of the outputs
+/// that are not ours run on the rayon pool.
+///
+/// Returns one entry per output, in the same order
+pub fn decrypt_shielded_outputs(
+    network: &Network,
+    height: BlockHeight,
+    fvk: &ExtendedFullViewingKey,
+    outputs: &[OutputDescription<GrothProofBytes>],
+) -> Vec<Option<DecryptedOutput>> {
+    let ivks = [fvk.fvk.vk.ivk()];
+    let ovk = fvk.fvk.ovk;
+    let outputs_with_domain: Vec<_> = outputs
+        .iter()
+        .map(|o| (SaplingDomain::for_height(*network, height), o.clone()))
+        .collect();
+    let incoming: Vec<_> = outputs_with_domain
+        .par_chunks(DECRYPT_BATCH_SIZE)
+        .map(|batch| try_note_decryption(&ivks, batch))
+        .collect::<Vec<_>>()
+        .into_iter()
+        .flatten()
+        .collect();
+
+    incoming
+        .into_par_iter()
+        .zip(outputs.par_iter())
+        .map(|(dec, output)| match dec {
+            Some((note, pa, memo)) => Some(DecryptedOutput {
+                note,
+                pa,
+                memo,
+                incoming: true,
+            }),
+            None => try_sapling_output_recovery(network, height, &ovk, output).map(
+                |(note, pa, memo)| DecryptedOutput {
+                    note,
+                    pa,
+                    memo,
+                    incoming: false,
+                },
+            ),
+        })
+        .collect()
+}
+
+/// Decode a raw transaction: amount, address, memo and contacts
+///
+/// CPU only, does not make any server call
+pub fn decode_transaction_data(
+    network: &Network,
+    nfs: &HashMap<(u32, Vec<u8>), u64>,
+    id_tx: u32,
+    account: u32,
+    fvk: &ExtendedFullViewingKey,
+    raw_tx: &[u8],
+    height: u32,
+    timestamp: u32,
+    index: u32,
+) -> anyhow::Result<TransactionInfo> {
+    let consensus_branch_id = get_branch(network, height);
+    let tx = Transaction::read(raw_tx, consensus_branch_id)?;
 
     let height = BlockHeight::from_u32(height);
     let mut amount = 0i64;
@@ -101,25 +185,22 @@ pub async fn decode_transaction(
         }
     }
 
-    for output in sapling_bundle.shielded_outputs.iter() {
-        if let Some((note, pa, memo)) = try_sapling_note_decryption(network, height, &ivk, output) {
-            amount += note.value as i64; // change or self transfer
-            let _ = contact_decoder.add_memo(&memo); // ignore memo that is not for contacts
-            let memo = Memo::try_from(memo)?;
+    let decrypted_outputs =
+        decrypt_shielded_outputs(network, height, fvk, &sapling_bundle.shielded_outputs);
+    for output in decrypted_outputs.into_iter().flatten() {
+        if output.incoming {
+            amount += output.note.value as i64; // change or self transfer
+            let _ = contact_decoder.add_memo(&output.memo); // ignore memo that is not for contacts
             if zaddress.is_empty() {
-                zaddress = encode_payment_address(network.hrp_sapling_payment_address(), &pa);
-            }
-            if memo != Memo::Empty {
-                tx_memo = memo;
-            }
-        } else if let Some((_note, pa, memo)) =
-            try_sapling_output_recovery(network, height, &ovk, output)
-        {
-            zaddress = encode_payment_address(network.hrp_sapling_payment_address(), &pa);
-            let memo = Memo::try_from(memo)?;
-            if memo != Memo::Empty {
-                tx_memo = memo;
+                zaddress =
+                    encode_payment_address(network.hrp_sapling_payment_address(), &output.pa);
             }
+        } else {
+            zaddress = encode_payment_address(network.hrp_sapling_payment_address(), &output.pa);
+        }
+        let memo = Memo::try_from(output.memo)?;
+        if memo != Memo::Empty {
+            tx_memo = memo;
         }
     }
 
@@ -157,8 +238,6 @@ pub async fn decode_transaction(
 }
 
 struct DecodeTxParams<'a> {
-    tx: SyncSender<TransactionInfo>,
-    client: CompactTxStreamerClient<Channel>,
     nf_map: &'a HashMap<(u32, Vec<u8>), u64>,
     index: u32,
     id_tx: u32,
@@ -188,7 +267,6 @@ pub async fn retrieve_tx_info(
     }
     let mut fvk_cache: HashMap<u32, ExtendedFullViewingKey> = HashMap::new();
     let mut decode_tx_params: Vec<DecodeTxParams> = vec![];
-    let (tx, rx) = mpsc::sync_channel::<TransactionInfo>(4);
     for (index, &id_tx) in tx_ids.iter().enumerate() {
         let (account, height, timestamp, tx_hash, ivk) = db.get_txhash(id_tx)?;
         let fvk: &ExtendedFullViewingKey = fvk_cache.entry(account).or_insert_with(|| {
@@ -197,8 +275,6 @@ pub async fn retrieve_tx_info(
                 .unwrap()
         });
         let params = DecodeTxParams {
-            tx: tx.clone(),
-            client: client.clone(),
             nf_map: &nf_map,
             index: index as u32,
             id_tx,
@@ -211,58 +287,62 @@ pub async fn retrieve_tx_info(
         decode_tx_params.push(params);
     }
 
-    let res = tokio_stream::iter(decode_tx_params).for_each_concurrent(None, |mut p| async move {
-        if let Ok(tx_info) = decode_transaction(
-            &network,
-            &mut p.client,
-            p.nf_map,
-            p.id_tx,
-            p.account,
-            &p.fvk,
-            &p.tx_hash,
-            p.height,
-            p.timestamp,
-            p.index,
-        )
-        .await
-        {
-            p.tx.send(tx_info).unwrap();
-            drop(p.tx);
-        }
-    });
-
-    let f = tokio::spawn(async move {
-        let mut contacts: Vec<ContactRef> = vec![];
-        while let Ok(tx_info) = rx.recv() {
-            for c in tx_info.contacts.iter() {
-                contacts.push(ContactRef {
-                    height: tx_info.height,
-                    index: tx_info.index,
-                    contact: c.clone(),
-                });
+    // Download concurrently, then decrypt on the rayon pool
+    let raw_txs: Vec<_> = futures::stream::iter(decode_tx_params)
+        .map(|p| {
+            let mut client = client.clone();
+            async move {
+                let raw_tx = fetch_raw_transaction(&mut client, &p.tx_hash).await;
+                (p, raw_tx)
             }
-            db.store_tx_metadata(tx_info.id_tx, &tx_info)?;
-            let z_msg = decode_memo(
-                &tx_info.memo,
-                &tx_info.address,
-                tx_info.timestamp,
-                tx_info.height,
-            );
-            if !z_msg.is_empty() {
-                db.store_message(tx_info.account, &z_msg)?;
-            }
-        }
-        contacts.sort_by(|a, b| a.index.cmp(&b.index));
-        for cref in contacts.iter() {
-            db.store_contact(&cref.contact, false)?;
-        }
+        })
+        .buffer_unordered(MAX_CONCURRENT_FETCHES)
+        .filter_map(|(p, raw_tx)| async move { raw_tx.ok().map(|raw_tx| (p, raw_tx)) })
+        .collect()
+        .await;
 
-        Ok::<_, anyhow::Error>(())
-    });
+    let tx_infos: Vec<TransactionInfo> = raw_txs
+        .par_iter()
+        .filter_map(|(p, raw_tx)| {
+            decode_transaction_data(
+                &network,
+                p.nf_map,
+                p.id_tx,
+                p.account,
+                &p.fvk,
+                raw_tx,
+                p.height,
+                p.timestamp,
+                p.index,
+            )
+            .ok()
+        })
+        .collect();
 
-    res.await;
-    drop(tx);
-    f.await??;
+    let mut contacts: Vec<ContactRef> = vec![];
+    for tx_info in tx_infos.iter() {
+        for c in tx_info.contacts.iter() {
+            contacts.push(ContactRef {
+                height: tx_info.height,
+                index: tx_info.index,
+                contact: c.clone(),
+            });
+        }
+        db.store_tx_metadata(tx_info.id_tx, tx_info)?;
+        let z_msg = decode_memo(
+            &tx_info.memo,
+            &tx_info.address,
+            tx_info.timestamp,
+            tx_info.height,
+        );
+        if !z_msg.is_empty() {
+            db.store_message(tx_info.account, &z_msg)?;
+        }
+    }
+    contacts.sort_by(|a, b| a.index.cmp(&b.index));
+    for cref in contacts.iter() {
+        db.store_contact(&cref.contact, false)?;
+    }
 
     Ok(())
 }